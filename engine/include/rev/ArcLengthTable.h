@@ -0,0 +1,158 @@
+#pragma once
+
+#include "rev/NurbsCurve.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <glm/glm.hpp>
+#include <gsl/gsl_assert>
+#include <vector>
+
+namespace rev {
+
+// Maps distances along a curve to the curve's parameter, so points can be spaced evenly in space
+// rather than in parameter. The table is built once by integrating the curve's speed with
+// adaptive Gaussian quadrature, after which each lookup is a binary search and a few Newton steps
+// within one table interval.
+template <typename PointType, size_t Order = kDynamicCurveOrder>
+class ArcLengthTable {
+public:
+    using ValueType = typename PointType::value_type;
+
+    // Every interval in the table has its length estimated to within this fraction of itself.
+    static constexpr ValueType kDefaultTolerance = static_cast<ValueType>(1e-5);
+
+    // Intervals are split at most this many times, which bounds the size of the table around
+    // points where the curve's speed isn't smooth.
+    static constexpr size_t kMaxSubdivisions = 12;
+
+    // The table refers back to the curve, which must outlive it.
+    explicit ArcLengthTable(
+        const NurbsCurve<PointType, Order>& curve, ValueType tolerance = kDefaultTolerance)
+        : _curve(curve)
+    {
+        Expects(tolerance > 0);
+        _parameters.push_back(curve.getStart());
+        _distances.push_back(0);
+
+        // The speed is only smooth within a knot span, so every span is integrated separately.
+        auto knots = curve.getKnots();
+        for (size_t i = 1; i < static_cast<size_t>(knots.size()); i++) {
+            if (knots[i - 1] < knots[i]) {
+                addInterval(knots[i - 1], knots[i], integrateSpeed(knots[i - 1], knots[i]),
+                    tolerance, kMaxSubdivisions);
+            }
+        }
+    }
+
+    ValueType getLength() const { return _distances.back(); }
+
+    // Finds the parameter at the given distance along the curve from its start. Distances beyond
+    // either end give the parameter at that end.
+    ValueType parameterAtDistance(ValueType distance) const
+    {
+        if (!(distance > 0)) {
+            return _parameters.front();
+        }
+        if (!(distance < getLength())) {
+            return _parameters.back();
+        }
+
+        auto intervalEnd = std::upper_bound(_distances.begin(), _distances.end(), distance);
+        size_t index = std::distance(_distances.begin(), intervalEnd);
+        ValueType startParameter = _parameters[index - 1];
+        ValueType endParameter = _parameters[index];
+        ValueType startDistance = _distances[index - 1];
+        ValueType remaining = distance - startDistance;
+
+        // Speed varies little within an interval, so interpolating gives a close first guess.
+        ValueType fraction = remaining / (_distances[index] - startDistance);
+        ValueType parameter = startParameter + (fraction * (endParameter - startParameter));
+        for (size_t i = 0; i < kMaxNewtonIterations; i++) {
+            ValueType speed = getSpeed(parameter);
+            if (!(speed > 0)) {
+                break;
+            }
+            ValueType error = integrateSpeed(startParameter, parameter) - remaining;
+            ValueType next = std::clamp(parameter - (error / speed), startParameter, endParameter);
+            if (next == parameter) {
+                break;
+            }
+            parameter = next;
+        }
+        return parameter;
+    }
+
+    // The distance along the curve from its start to the given parameter.
+    ValueType distanceAtParameter(ValueType parameter) const
+    {
+        if (!(parameter > _parameters.front())) {
+            return 0;
+        }
+        if (!(parameter < _parameters.back())) {
+            return getLength();
+        }
+
+        auto intervalEnd = std::upper_bound(_parameters.begin(), _parameters.end(), parameter);
+        size_t index = std::distance(_parameters.begin(), intervalEnd);
+        return _distances[index - 1] + integrateSpeed(_parameters[index - 1], parameter);
+    }
+
+    size_t getIntervalCount() const { return _parameters.size() - 1; }
+
+private:
+    // Newton's method usually settles in three or four steps; this only bounds the search when
+    // rounding keeps it from settling exactly.
+    static constexpr size_t kMaxNewtonIterations = 8;
+
+    // Splits the interval until halving it no longer changes its estimated length, then appends
+    // it to the table.
+    void addInterval(ValueType start, ValueType end, ValueType length, ValueType tolerance,
+        size_t subdivisionsLeft)
+    {
+        ValueType middle = start + ((end - start) / 2);
+        ValueType firstHalf = integrateSpeed(start, middle);
+        ValueType secondHalf = integrateSpeed(middle, end);
+        ValueType refinedLength = firstHalf + secondHalf;
+        bool isAccurate = std::abs(refinedLength - length) <= (tolerance * refinedLength);
+        if (!isAccurate && (subdivisionsLeft > 0)) {
+            addInterval(start, middle, firstHalf, tolerance, subdivisionsLeft - 1);
+            addInterval(middle, end, secondHalf, tolerance, subdivisionsLeft - 1);
+            return;
+        }
+        _parameters.push_back(end);
+        _distances.push_back(_distances.back() + refinedLength);
+    }
+
+    // Five-point Gauss-Legendre quadrature, which is exact for polynomials up to degree nine.
+    ValueType integrateSpeed(ValueType start, ValueType end) const
+    {
+        static constexpr std::array<double, 5> kNodes{ -0.9061798459386640, -0.5384693101056831,
+            0.0, 0.5384693101056831, 0.9061798459386640 };
+        static constexpr std::array<double, 5> kWeights{ 0.2369268850561891, 0.4786286704993665,
+            0.5688888888888889, 0.4786286704993665, 0.2369268850561891 };
+
+        ValueType halfWidth = (end - start) / 2;
+        ValueType center = start + halfWidth;
+        ValueType sum = 0;
+        for (size_t i = 0; i < kNodes.size(); i++) {
+            ValueType position = center + (halfWidth * static_cast<ValueType>(kNodes[i]));
+            sum += static_cast<ValueType>(kWeights[i]) * getSpeed(position);
+        }
+        return sum * halfWidth;
+    }
+
+    ValueType getSpeed(ValueType parameter) const
+    {
+        return glm::length(_curve.getDerivatives(parameter).firstDerivative);
+    }
+
+    const NurbsCurve<PointType, Order>& _curve;
+    // The table's intervals, as matching parameters and distances at their ends.
+    std::vector<ValueType> _parameters;
+    std::vector<ValueType> _distances;
+};
+
+} // namespace rev
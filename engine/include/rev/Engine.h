@@ -3,6 +3,7 @@
 #include "Types.h"
 
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -11,6 +12,7 @@ class Environment;
 class Scene;
 class SceneView;
 class Window;
+class WorkerPool;
 
 class Engine {
 public:
@@ -20,11 +22,17 @@ public:
         const RectSize<int> size);
     std::shared_ptr<Environment> createEnvironment();
 
+    // A pool shared by engine systems for background and parallel work. Created on first use, which
+    // may come from any thread.
+    std::shared_ptr<WorkerPool> getWorkerPool();
+
     void update();
 
 private:
     std::shared_ptr<Window> _window;
     std::vector<std::shared_ptr<Environment>> _environments;
+    std::once_flag _workerPoolCreated;
+    std::shared_ptr<WorkerPool> _workerPool;
 };
 
 } // namespace rev
\ No newline at end of file
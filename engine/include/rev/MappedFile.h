@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <gsl/span>
+#include <string>
+
+namespace rev {
+
+// A whole file mapped into memory. The mapping is copy-on-write: its contents can be modified in
+// place, but the changes stay private to this process and never reach the file.
+class MappedFile {
+public:
+    // Throws std::runtime_error if the file can't be opened or mapped.
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // The start of the mapping is page aligned.
+    gsl::span<std::byte> getBytes() const;
+
+private:
+    std::byte* _data = nullptr;
+    size_t _size = 0;
+};
+
+} // namespace rev
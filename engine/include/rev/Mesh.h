@@ -59,8 +59,9 @@ public:
         return Mesh{ gsl::span<const VertexData>(_vertices), gsl::span<const GLuint>(_indices) };
     }
 
-    template <typename SurfaceData>
-    void addTrianglesToTree(KDTreeBuilder<SurfaceData>& builder)
+    // Works with any of the KDTree builders.
+    template <typename TreeBuilder>
+    void addTrianglesToTree(TreeBuilder& builder)
     {
         for (size_t i = 0; i < _indices.size() - 2; i += 3) {
             builder.addTriangle(
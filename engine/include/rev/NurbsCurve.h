@@ -1,12 +1,17 @@
 #pragma once
 
 #include "rev/Utilities.h"
+#include "rev/geometry/Simd.h"
 #include <algorithm>
+#include <array>
+#include <cmath>
 #include <cstddef>
 #include <glm/glm.hpp>
 #include <gsl/gsl_assert>
 #include <gsl/span>
 #include <limits>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace rev {
@@ -17,116 +22,567 @@ struct WeightedControlPoint {
     typename PointType::value_type weight;
 };
 
+// A point on a curve, with the curve's first and second derivatives there with respect to its
+// parameter.
 template <typename PointType>
-class NurbsCurve {
+struct CurveDerivatives {
+    using ValueType = typename PointType::value_type;
+
+    PointType point;
+    PointType firstDerivative;
+    PointType secondDerivative;
+
+    // How sharply the curve bends here: the reciprocal of the radius of the circle that fits it
+    // best. Zero where the curve stops moving.
+    ValueType getCurvature() const
+    {
+        ValueType speedSquared = glm::dot(firstDerivative, firstDerivative);
+        if (speedSquared == 0) {
+            return 0;
+        }
+        ValueType alignment = glm::dot(firstDerivative, secondDerivative);
+        ValueType accelerationSquared = glm::dot(secondDerivative, secondDerivative);
+        ValueType areaSquared = (speedSquared * accelerationSquared) - (alignment * alignment);
+        return std::sqrt(std::max<ValueType>(areaSquared, 0))
+            / (speedSquared * std::sqrt(speedSquared));
+    }
+};
+
+// The order of curves that only know it at run time, such as those read from files.
+constexpr size_t kDynamicCurveOrder = 0;
+
+namespace detail {
+    // Only curves that learn their order at run time store it. Curves that fix it at compile time
+    // derive from the empty version, so their order costs neither space nor a load.
+    template <size_t Order>
+    class CurveOrder {
+    public:
+        static constexpr size_t getOrder() { return Order; }
+    };
+
+    template <>
+    class CurveOrder<kDynamicCurveOrder> {
+    public:
+        explicit CurveOrder(size_t order)
+            : _order(order)
+        {
+        }
+
+        size_t getOrder() const { return _order; }
+
+    private:
+        size_t _order;
+    };
+} // namespace detail
+
+// A curve can fix its order at compile time, which lets the compiler unroll its evaluation loops
+// and size its basis buffers exactly.
+template <typename PointType, size_t Order = kDynamicCurveOrder>
+class NurbsCurve : private detail::CurveOrder<Order> {
 public:
     using ControlPointType = WeightedControlPoint<PointType>;
     using ValueType = typename PointType::value_type;
+    using detail::CurveOrder<Order>::getOrder;
+
+    // Evaluation works out the basis functions in fixed-size buffers on the stack, which limits
+    // the order of the curves it supports.
+    static constexpr size_t kMaxOrder = (Order == kDynamicCurveOrder) ? 8 : Order;
+    static_assert(Order != 1, "Curves need an order of at least two.");
 
+    // Curves of a dynamic order are given it along with their knots and control points.
+    template <size_t ThisOrder = Order,
+        std::enable_if_t<ThisOrder == kDynamicCurveOrder, int> = 0>
     NurbsCurve(size_t order, gsl::span<const ValueType> knots,
         gsl::span<const ControlPointType> controlPoints)
-        : _order(order)
+        : detail::CurveOrder<Order>(order)
         , _knots(knots.begin(), knots.end())
         , _controlPoints(controlPoints.begin(), controlPoints.end())
     {
         Expects(order > 1);
-        Expects(static_cast<size_t>(controlPoints.size()) >= order);
-        Expects(knots.size() == (controlPoints.size() + order));
+        Expects(order <= kMaxOrder);
+        expectValidSizes();
+    }
+
+    template <size_t ThisOrder = Order,
+        std::enable_if_t<ThisOrder != kDynamicCurveOrder, int> = 0>
+    NurbsCurve(gsl::span<const ValueType> knots, gsl::span<const ControlPointType> controlPoints)
+        : _knots(knots.begin(), knots.end())
+        , _controlPoints(controlPoints.begin(), controlPoints.end())
+    {
+        expectValidSizes();
     }
 
     ValueType getStart() const { return _knots.front(); }
 
     ValueType getEnd() const { return _knots.back(); }
 
+    gsl::span<const ValueType> getKnots() const { return _knots; }
+
     PointType operator[](ValueType position) const
     {
-        auto knotsBegin = _knots.begin();
-        auto knotsEnd = _knots.end();
-        auto spanStart = std::lower_bound(knotsBegin, knotsEnd, position);
-        size_t controlPointIndex = std::distance(knotsBegin, spanStart);
-        if (controlPointIndex == 0) {
+        auto spanStart = std::lower_bound(_knots.begin(), _knots.end(), position);
+        return evaluate(position, std::distance(_knots.begin(), spanStart));
+    }
+
+    // Evaluates the curve and its first two derivatives, from the same basis functions as the
+    // point itself. Before the start and past the end, where the curve holds still at its end
+    // control points, the derivatives are zero.
+    CurveDerivatives<PointType> getDerivatives(ValueType position) const
+    {
+        return evaluateDerivatives(position, findSpanEnd(position, 0));
+    }
+
+    // Evaluates the curve and its first two derivatives at each of the positions. As with sample,
+    // this is fastest when the positions come in increasing order, since each position's span is
+    // found by stepping on from the last one's.
+    void getDerivatives(gsl::span<const ValueType> positions,
+        gsl::span<CurveDerivatives<PointType>> derivatives) const
+    {
+        Expects(positions.size() == derivatives.size());
+        size_t spanEnd = 0;
+        for (size_t i = 0; i < static_cast<size_t>(positions.size()); i++) {
+            spanEnd = findSpanEnd(positions[i], spanEnd);
+            derivatives[i] = evaluateDerivatives(positions[i], spanEnd);
+        }
+    }
+
+    // Finds the parameter of the point on the curve closest to the given one, with Newton's method
+    // on the derivative of the squared distance, starting from the hint. From a hint close to the
+    // answer, such as the answer for the same point a frame ago, this settles in a few steps. From
+    // a poor hint it may settle on a point that's only closest locally.
+    ValueType closestParameter(const PointType& point, ValueType hint) const
+    {
+        ValueType start = getStart();
+        ValueType end = getEnd();
+        ValueType tolerance = kClosestParameterTolerance * (end - start);
+        ValueType parameter = std::clamp(hint, start, end);
+        auto derivatives = getDerivatives(parameter);
+        PointType offset = derivatives.point - point;
+        ValueType distance = glm::dot(offset, offset);
+        for (size_t i = 0; i < kMaxClosestParameterIterations; i++) {
+            const PointType& velocity = derivatives.firstDerivative;
+            ValueType slope = glm::dot(velocity, offset);
+            ValueType speedSquared = glm::dot(velocity, velocity);
+            ValueType slopeRate = speedSquared + glm::dot(derivatives.secondDerivative, offset);
+            // Where the distance isn't locally convex, Newton's method would head for a maximum,
+            // so this falls back to a Gauss-Newton step, which always heads downhill.
+            ValueType rate = (slopeRate > 0) ? slopeRate : speedSquared;
+            if (!(rate > 0)) {
+                return parameter;
+            }
+
+            // A full step can overshoot into the pull of another stretch of the curve, or bounce
+            // across a kink at a knot, so it's halved until it gets closer.
+            ValueType step = -slope / rate;
+            while (true) {
+                ValueType next = std::clamp(parameter + step, start, end);
+                if (!(std::abs(next - parameter) > tolerance)) {
+                    return parameter;
+                }
+                auto nextDerivatives = getDerivatives(next);
+                PointType nextOffset = nextDerivatives.point - point;
+                ValueType nextDistance = glm::dot(nextOffset, nextOffset);
+                if (nextDistance < distance) {
+                    parameter = next;
+                    derivatives = nextDerivatives;
+                    offset = nextOffset;
+                    distance = nextDistance;
+                    break;
+                }
+                step /= 2;
+            }
+        }
+        return parameter;
+    }
+
+    // Finds the parameter of the closest point without a hint. This samples a few points on each
+    // knot span, and starts from each sample that's closer than both its neighbours.
+    ValueType closestParameter(const PointType& point) const
+    {
+        std::vector<ValueType> parameters;
+        for (size_t i = 1; i < _knots.size(); i++) {
+            ValueType spanStart = _knots[i - 1];
+            ValueType spanWidth = _knots[i] - spanStart;
+            if (!(spanWidth > 0)) {
+                continue;
+            }
+            for (size_t j = 0; j < kClosestParameterSamplesPerSpan; j++) {
+                parameters.push_back(spanStart
+                    + (spanWidth * static_cast<ValueType>(j)
+                        / static_cast<ValueType>(kClosestParameterSamplesPerSpan)));
+            }
+        }
+        parameters.push_back(getEnd());
+
+        std::vector<ValueType> distances;
+        for (ValueType parameter : parameters) {
+            PointType offset = (*this)[parameter] - point;
+            distances.push_back(glm::dot(offset, offset));
+        }
+
+        ValueType closest = getStart();
+        ValueType closestDistance = std::numeric_limits<ValueType>::infinity();
+        for (size_t i = 0; i < parameters.size(); i++) {
+            bool isLocalMinimum = ((i == 0) || !(distances[i - 1] < distances[i]))
+                && ((i + 1 == parameters.size()) || !(distances[i + 1] < distances[i]));
+            if (!isLocalMinimum) {
+                continue;
+            }
+            ValueType parameter = closestParameter(point, parameters[i]);
+            PointType offset = (*this)[parameter] - point;
+            ValueType distance = glm::dot(offset, offset);
+            if (distance < closestDistance) {
+                closestDistance = distance;
+                closest = parameter;
+            }
+        }
+        return closest;
+    }
+
+    // Evaluates the curve at each of the positions. This is much faster than evaluating them one
+    // at a time when they come in increasing order: each position's span is found by stepping on
+    // from the last one's, and positions on the same span are evaluated together with SIMD.
+    void sample(gsl::span<const ValueType> positions, gsl::span<PointType> points) const
+    {
+        Expects(positions.size() == points.size());
+        auto count = static_cast<size_t>(positions.size());
+        size_t spanEnd = 0;
+        size_t i = 0;
+        while (i < count) {
+            spanEnd = findSpanEnd(positions[i], spanEnd);
+            size_t runEnd = i + 1;
+            if ((spanEnd > 0) && (spanEnd < _knots.size())) {
+                while ((runEnd < count) && (runEnd - i < kSampleWidth)
+                    && isOnSpan(positions[runEnd], spanEnd)) {
+                    runEnd++;
+                }
+            }
+            evaluate(positions.subspan(i, runEnd - i), spanEnd, points.subspan(i, runEnd - i));
+            i = runEnd;
+        }
+    }
+
+    // Evaluates the curve at evenly spaced positions from start to end, including both.
+    void sampleUniform(
+        ValueType start, ValueType end, size_t count, gsl::span<PointType> points) const
+    {
+        Expects(static_cast<size_t>(points.size()) == count);
+        ValueType step = (count > 1) ? (end - start) / static_cast<ValueType>(count - 1) : 0;
+        std::array<ValueType, kSampleWidth> positions;
+        for (size_t i = 0; i < count; i += kSampleWidth) {
+            size_t batchSize = std::min(kSampleWidth, count - i);
+            for (size_t j = 0; j < batchSize; j++) {
+                positions[j] = start + (step * static_cast<ValueType>(i + j));
+            }
+            if ((count > 1) && (i + batchSize == count)) {
+                // Keeps rounding from landing the last position short of the end.
+                positions[batchSize - 1] = end;
+            }
+            sample(gsl::span<const ValueType>(positions.data(), batchSize),
+                points.subspan(i, batchSize));
+        }
+    }
+
+private:
+    static constexpr ValueType kClosestParameterTolerance
+        = 4 * std::numeric_limits<ValueType>::epsilon();
+    static constexpr size_t kMaxClosestParameterIterations = 16;
+    static constexpr size_t kClosestParameterSamplesPerSpan = 4;
+
+    // Positions sampled together share SIMD registers this wide.
+    static constexpr size_t kSampleWidth = 8;
+
+    void expectValidSizes() const
+    {
+        Expects(_controlPoints.size() >= getOrder());
+        Expects(_knots.size() == (_controlPoints.size() + getOrder()));
+    }
+
+    // Finds the index of the first knot at or past the position, which ends the position's span,
+    // starting the search from the end of an earlier position's span.
+    size_t findSpanEnd(ValueType position, size_t spanEnd) const
+    {
+        size_t knotCount = _knots.size();
+        if ((spanEnd == 0) || (spanEnd >= knotCount) || !(_knots[spanEnd - 1] < position)) {
+            auto spanStart = std::lower_bound(_knots.begin(), _knots.end(), position);
+            return std::distance(_knots.begin(), spanStart);
+        }
+        while ((spanEnd < knotCount) && (_knots[spanEnd] < position)) {
+            spanEnd++;
+        }
+        return spanEnd;
+    }
+
+    bool isOnSpan(ValueType position, size_t spanEnd) const
+    {
+        return (_knots[spanEnd - 1] < position) && !(_knots[spanEnd] < position);
+    }
+
+    PointType evaluate(ValueType position, size_t spanEnd) const
+    {
+        if (spanEnd == 0) {
             // Before the first knot. Just return the value of the first control
             // point.
             return _controlPoints.front().point;
         }
 
-        if (spanStart == knotsEnd) {
+        if (spanEnd == _knots.size()) {
             // We're past the last knot. Just return the value of the last control
             // point.
             return _controlPoints.back().point;
         }
 
-        size_t controlPointsToProcess = _order;
-        size_t controlPointCount = _controlPoints.size();
-        if (controlPointIndex > controlPointCount) {
-            controlPointsToProcess -= (controlPointIndex - controlPointCount);
-        }
+        std::array<ValueType, kMaxOrder> basis;
+        getSpanBasis(position, spanEnd, basis);
 
         PointType numerator{ 0 };
         ValueType denominator{ 0 };
-        do {
-            controlPointIndex--;
-            auto& controlPoint = _controlPoints[controlPointIndex];
-            ValueType weightedBasis
-                = basisValue(position, controlPointIndex, _order) * controlPoint.weight;
-            numerator += weightedBasis * _controlPoints[controlPointIndex].point;
+        auto [firstBasis, lastBasis] = getSpanBasisRange(spanEnd);
+        for (size_t i = firstBasis; i < lastBasis; i++) {
+            auto& controlPoint = _controlPoints[spanEnd + i - getOrder()];
+            ValueType weightedBasis = basis[i] * controlPoint.weight;
+            numerator += weightedBasis * controlPoint.point;
             denominator += weightedBasis;
-            controlPointsToProcess--;
-        } while (controlPointIndex && controlPointsToProcess);
+        }
         return numerator / denominator;
     }
 
-private:
-    ValueType basisValue(ValueType position, size_t controlPointIndex, size_t order) const
-    {
-        auto& controlPoint = _controlPoints[controlPointIndex];
-        ValueType firstKnot = _knots[controlPointIndex];
-        ValueType lastKnot = _knots[controlPointIndex + order];
-        if (order == 2) {
-            // Triangle function
-            ValueType middleKnot = _knots[controlPointIndex + 1];
-            if (position < middleKnot) {
-                return rampUp(position, firstKnot, middleKnot);
-            } else {
-                return rampDown(position, middleKnot, lastKnot);
+    CurveDerivatives<PointType> evaluateDerivatives(ValueType position, size_t spanEnd) const
+    {
+        if ((spanEnd == 0) && !(position < _knots.front())) {
+            // The very start of the curve ends an empty span. Its derivatives come from the span
+            // it starts instead.
+            auto spanStart = std::upper_bound(_knots.begin(), _knots.end(), position);
+            spanEnd = std::distance(_knots.begin(), spanStart);
+        }
+        if (spanEnd == 0) {
+            return { _controlPoints.front().point, PointType{ 0 }, PointType{ 0 } };
+        }
+        if (spanEnd == _knots.size()) {
+            return { _controlPoints.back().point, PointType{ 0 }, PointType{ 0 } };
+        }
+
+        std::array<std::array<ValueType, kMaxOrder>, 3> basis;
+        getSpanBasisDerivatives(position, spanEnd, basis);
+
+        // The curve is a quotient of weighted sums, so its derivatives follow from the
+        // derivatives of the sums by the quotient rule.
+        std::array<PointType, 3> numerator{ PointType{ 0 }, PointType{ 0 }, PointType{ 0 } };
+        std::array<ValueType, 3> denominator{ 0, 0, 0 };
+        auto [firstBasis, lastBasis] = getSpanBasisRange(spanEnd);
+        for (size_t i = firstBasis; i < lastBasis; i++) {
+            auto& controlPoint = _controlPoints[spanEnd + i - getOrder()];
+            for (size_t k = 0; k < 3; k++) {
+                ValueType weightedBasis = basis[k][i] * controlPoint.weight;
+                numerator[k] += weightedBasis * controlPoint.point;
+                denominator[k] += weightedBasis;
             }
-        } else {
-            size_t lowerOrder = order - 1;
-            ValueType secondKnot = _knots[controlPointIndex + 1];
-            ValueType secondToLastKnot = _knots[controlPointIndex + lowerOrder];
+        }
+
+        CurveDerivatives<PointType> result;
+        result.point = numerator[0] / denominator[0];
+        result.firstDerivative
+            = (numerator[1] - (denominator[1] * result.point)) / denominator[0];
+        result.secondDerivative = (numerator[2]
+                                      - (ValueType{ 2 } * denominator[1] * result.firstDerivative)
+                                      - (denominator[2] * result.point))
+            / denominator[0];
+        return result;
+    }
+
+    // Evaluates up to kSampleWidth positions on the same span, one in each SIMD lane. Curves
+    // over other types than float are evaluated one position at a time.
+    void evaluate(
+        gsl::span<const ValueType> positions, size_t spanEnd, gsl::span<PointType> points) const
+    {
+        auto count = static_cast<size_t>(positions.size());
+        if constexpr (std::is_same_v<ValueType, float>) {
+            if ((count > 1) && (spanEnd > 0) && (spanEnd < _knots.size())) {
+                evaluateLanes(positions, spanEnd, points);
+                return;
+            }
+        }
+        for (size_t i = 0; i < count; i++) {
+            points[i] = evaluate(positions[i], spanEnd);
+        }
+    }
+
+    // Runs the same arithmetic as evaluating each position alone, so the results match it.
+    void evaluateLanes(
+        gsl::span<const float> positions, size_t spanEnd, gsl::span<PointType> points) const
+    {
+        using Float = simd::Float<kSampleWidth>;
+        constexpr auto kDimensionCount = static_cast<size_t>(PointType::length());
+
+        auto count = static_cast<size_t>(positions.size());
+        std::array<float, kSampleWidth> positionLanes;
+        std::copy(positions.begin(), positions.end(), positionLanes.begin());
+        // Spare lanes repeat the last position, which keeps them on the span.
+        std::fill(positionLanes.begin() + count, positionLanes.end(), positions[count - 1]);
 
-            ValueType result{ 0 };
-            if (position < secondToLastKnot) {
-                result += rampUp(position, firstKnot, secondToLastKnot)
-                    * basisValue(position, controlPointIndex, lowerOrder);
+        std::array<Float, kMaxOrder> basis;
+        getSpanBasis(Float::load(positionLanes.data()), spanEnd, basis);
+
+        std::array<Float, kDimensionCount> numerator;
+        numerator.fill(Float::broadcast(0.0f));
+        Float denominator = Float::broadcast(0.0f);
+        auto [firstBasis, lastBasis] = getSpanBasisRange(spanEnd);
+        for (size_t i = firstBasis; i < lastBasis; i++) {
+            auto& controlPoint = _controlPoints[spanEnd + i - getOrder()];
+            Float weightedBasis = basis[i] * Float::broadcast(controlPoint.weight);
+            for (size_t k = 0; k < kDimensionCount; k++) {
+                numerator[k]
+                    = numerator[k] + (weightedBasis * Float::broadcast(controlPoint.point[k]));
             }
+            denominator = denominator + weightedBasis;
+        }
 
-            if (position > secondKnot) {
-                result += rampDown(position, secondKnot, lastKnot)
-                    * basisValue(position, controlPointIndex + 1, lowerOrder);
+        std::array<std::array<float, kSampleWidth>, kDimensionCount> components;
+        for (size_t k = 0; k < kDimensionCount; k++) {
+            (numerator[k] / denominator).store(components[k].data());
+        }
+        for (size_t i = 0; i < count; i++) {
+            for (size_t k = 0; k < kDimensionCount; k++) {
+                points[i][k] = components[k][i];
             }
+        }
+    }
+
+    // The basis functions of a span weight the order control points before the knot that ends
+    // it. Near the ends of an unclamped knot vector, some of those control points don't exist,
+    // so this gives the range of basis functions whose control points do.
+    std::pair<size_t, size_t> getSpanBasisRange(size_t spanEnd) const
+    {
+        size_t order = getOrder();
+        size_t firstBasis = (spanEnd < order) ? (order - spanEnd) : 0;
+        size_t lastBasis = std::min(order, _controlPoints.size() + order - spanEnd);
+        return { firstBasis, lastBasis };
+    }
+
+    // Works out the basis functions that are nonzero on the span ending at the given knot, with
+    // the triangular scheme of Cox and de Boor as given in The NURBS Book. Each order is built
+    // from the one below it in place, so this takes O(order^2) time and no allocations. Knots
+    // missing before the start or past the end of an unclamped knot vector repeat the end knots.
+    //
+    // Lanes is either ValueType, or a simd::Float holding several positions on the same span.
+    template <typename Lanes>
+    void getSpanBasis(
+        const Lanes& position, size_t spanEnd, std::array<Lanes, kMaxOrder>& basis) const
+    {
+        // The distances from the position back to the knots before it, and on to the knots after.
+        std::array<Lanes, kMaxOrder> left;
+        std::array<Lanes, kMaxOrder> right;
+        auto spanIndex = static_cast<ptrdiff_t>(spanEnd);
+        basis[0] = broadcast<Lanes>(1);
+        for (size_t degree = 1; degree < getOrder(); degree++) {
+            auto offset = static_cast<ptrdiff_t>(degree);
+            left[degree] = position - broadcast<Lanes>(getKnot(spanIndex - offset));
+            right[degree] = broadcast<Lanes>(getKnot(spanIndex + offset - 1)) - position;
 
-            return result;
+            Lanes saved = broadcast<Lanes>(0);
+            for (size_t i = 0; i < degree; i++) {
+                // Never zero, since every pair of knots here spans the position's span.
+                Lanes term = basis[i] / (right[i + 1] + left[degree - i]);
+                basis[i] = saved + (right[i + 1] * term);
+                saved = left[degree - i] * term;
+            }
+            basis[degree] = saved;
         }
     }
 
-    ValueType rampUp(ValueType value, ValueType bottom, ValueType top) const
+    // The basis functions of the span ending at the given knot and their first two derivatives,
+    // indexed by derivative and then basis function, following algorithm A2.3 of The NURBS Book.
+    void getSpanBasisDerivatives(ValueType position, size_t spanEnd,
+        std::array<std::array<ValueType, kMaxOrder>, 3>& derivatives) const
     {
-        if (nearEqual(top, bottom)) {
-            return 0.5;
+        // The basis functions of every order below the span's own go in the upper triangle, and
+        // the widths of the knot intervals they're built from go in the lower one.
+        std::array<std::array<ValueType, kMaxOrder>, kMaxOrder> table;
+        std::array<ValueType, kMaxOrder> left;
+        std::array<ValueType, kMaxOrder> right;
+        auto spanIndex = static_cast<ptrdiff_t>(spanEnd);
+        size_t degree = getOrder() - 1;
+        table[0][0] = 1;
+        for (size_t j = 1; j <= degree; j++) {
+            auto offset = static_cast<ptrdiff_t>(j);
+            left[j] = position - getKnot(spanIndex - offset);
+            right[j] = getKnot(spanIndex + offset - 1) - position;
+            ValueType saved = 0;
+            for (size_t r = 0; r < j; r++) {
+                table[j][r] = right[r + 1] + left[j - r];
+                ValueType term = table[r][j - 1] / table[j][r];
+                table[r][j] = saved + (right[r + 1] * term);
+                saved = left[j - r] * term;
+            }
+            table[j][j] = saved;
+        }
+
+        for (size_t j = 0; j <= degree; j++) {
+            derivatives[0][j] = table[j][degree];
+        }
+
+        // Each derivative is a combination of the basis functions one order lower, whose
+        // coefficients are worked out from the last derivative's in two alternating rows.
+        std::array<std::array<ValueType, kMaxOrder>, 2> coefficients;
+        for (size_t r = 0; r <= degree; r++) {
+            size_t current = 0;
+            size_t next = 1;
+            coefficients[current][0] = 1;
+            for (size_t k = 1; k < 3; k++) {
+                if (k > degree) {
+                    derivatives[k][r] = 0;
+                    continue;
+                }
+                ValueType sum = 0;
+                size_t lowerDegree = degree - k;
+                if (r >= k) {
+                    coefficients[next][0]
+                        = coefficients[current][0] / table[lowerDegree + 1][r - k];
+                    sum = coefficients[next][0] * table[r - k][lowerDegree];
+                }
+                size_t firstTerm = (r + 1 >= k) ? 1 : k - r;
+                size_t lastTerm = (r <= lowerDegree + 1) ? k - 1 : degree - r;
+                for (size_t j = firstTerm; j <= lastTerm; j++) {
+                    coefficients[next][j]
+                        = (coefficients[current][j] - coefficients[current][j - 1])
+                        / table[lowerDegree + 1][r + j - k];
+                    sum += coefficients[next][j] * table[r + j - k][lowerDegree];
+                }
+                if (r <= lowerDegree) {
+                    coefficients[next][k]
+                        = -coefficients[current][k - 1] / table[lowerDegree + 1][r];
+                    sum += coefficients[next][k] * table[r][lowerDegree];
+                }
+                derivatives[k][r] = sum;
+                std::swap(current, next);
+            }
+        }
+
+        ValueType scale = static_cast<ValueType>(degree);
+        for (size_t k = 1; k < 3; k++) {
+            for (size_t j = 0; j <= degree; j++) {
+                derivatives[k][j] *= scale;
+            }
+            scale *= static_cast<ValueType>((degree > k) ? degree - k : 0);
         }
-        return (value - bottom) / (top - bottom);
     }
 
-    ValueType rampDown(ValueType value, ValueType bottom, ValueType top) const
+    template <typename Lanes>
+    static Lanes broadcast(ValueType value)
     {
-        if (nearEqual(top, bottom)) {
-            return 0.5;
+        if constexpr (std::is_same_v<Lanes, ValueType>) {
+            return value;
+        } else {
+            return Lanes::broadcast(value);
         }
-        return (top - value) / (top - bottom);
     }
 
-    size_t _order;
+    ValueType getKnot(ptrdiff_t index) const
+    {
+        auto lastIndex = static_cast<ptrdiff_t>(_knots.size()) - 1;
+        return _knots[std::clamp<ptrdiff_t>(index, 0, lastIndex)];
+    }
+
     std::vector<ValueType> _knots;
     std::vector<ControlPointType> _controlPoints;
 };
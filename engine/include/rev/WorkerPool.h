@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rev {
+
+// A fixed set of worker threads that run queued tasks in the background.
+class WorkerPool {
+public:
+    // Defaults to one thread per hardware thread.
+    WorkerPool();
+    explicit WorkerPool(size_t threadCount);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    size_t getThreadCount() const;
+
+    void enqueue(std::function<void()> task);
+
+    // Runs a single queued task on the calling thread. Returns false if the queue was empty.
+    bool runPendingTask();
+
+private:
+    void runWorker();
+
+    std::mutex _mutex;
+    std::condition_variable _taskAvailable;
+    std::deque<std::function<void()>> _tasks;
+    bool _stopping = false;
+    std::vector<std::thread> _threads;
+};
+
+// Tracks a set of tasks running on a worker pool. Waiting on the group runs queued tasks on the
+// waiting thread, so tasks can safely start and wait on groups of their own.
+class TaskGroup {
+public:
+    explicit TaskGroup(WorkerPool& pool);
+    ~TaskGroup();
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    template <typename Task>
+    void run(Task&& task)
+    {
+        _pendingCount++;
+        _pool.enqueue([this, task = std::forward<Task>(task)]() mutable {
+            try {
+                task();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(_exceptionMutex);
+                if (!_exception) {
+                    _exception = std::current_exception();
+                }
+            }
+            finishTask();
+        });
+    }
+
+    // Blocks until every task in the group has finished, then rethrows the first exception
+    // thrown by any of them.
+    void wait();
+
+private:
+    void finishTask();
+    void runUntilFinished();
+
+    WorkerPool& _pool;
+    std::atomic<size_t> _pendingCount{ 0 };
+    std::mutex _finishedMutex;
+    std::condition_variable _taskFinished;
+    std::mutex _exceptionMutex;
+    std::exception_ptr _exception;
+};
+
+// Calls body(begin, end) over consecutive ranges of [0, count) that are at most grainSize long.
+// Ranges are spread over the pool, and the calling thread takes part.
+template <typename Body>
+void parallelFor(WorkerPool& pool, size_t count, size_t grainSize, Body&& body)
+{
+    if (count <= grainSize) {
+        if (count) {
+            body(size_t{ 0 }, count);
+        }
+        return;
+    }
+
+    TaskGroup group(pool);
+    for (size_t begin = grainSize; begin < count; begin += grainSize) {
+        size_t end = std::min(begin + grainSize, count);
+        group.run([&body, begin, end]() { body(begin, end); });
+    }
+    body(size_t{ 0 }, grainSize);
+    group.wait();
+}
+
+} // namespace rev
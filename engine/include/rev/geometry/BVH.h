@@ -0,0 +1,517 @@
+#pragma once
+
+#include "rev/geometry/KDTree.h"
+#include "rev/geometry/Tools.h"
+#include <algorithm>
+#include <array>
+#include <glm/glm.hpp>
+#include <gsl/gsl_assert>
+#include <gsl/span>
+#include <limits>
+#include <numeric>
+#include <optional>
+#include <vector>
+
+namespace rev {
+
+// Relative costs of stepping into a BVH node and of testing a single primitive. These match the
+// KD-tree's costs, so the surface area costs of the two structures can be compared.
+constexpr float kBVHTraversalCost = kKDTreeTraversalCost;
+constexpr float kBVHIntersectionCost = kKDTreeIntersectionCost;
+
+// Traversal keeps a fixed-size stack, so the builder stops splitting at this depth.
+constexpr size_t kMaxBVHDepth = 64;
+
+// A bounding volume hierarchy over a set of boxes, built with the binned surface area heuristic.
+// It only knows primitives by their index into the boxes it was built from, so the same hierarchy
+// serves triangles, instances, or anything else that has a bounding box.
+//
+// Unlike a KD-tree, moving primitives doesn't invalidate the structure: refit() grows and shrinks
+// the node boxes to match in a single pass, though the tree gets slower to query the further the
+// primitives move from where it was built.
+class BoxHierarchy {
+public:
+    void build(gsl::span<const AxisAlignedBoundingBox> boxes)
+    {
+        auto primitiveCount = static_cast<uint32_t>(boxes.size());
+        _nodes.clear();
+        _primitiveIndices.resize(primitiveCount);
+        std::iota(_primitiveIndices.begin(), _primitiveIndices.end(), 0);
+        if (!primitiveCount) {
+            return;
+        }
+
+        std::vector<glm::vec3> centroids;
+        centroids.reserve(primitiveCount);
+        for (const auto& box : boxes) {
+            centroids.push_back((box.minimum + box.maximum) * 0.5f);
+        }
+
+        _nodes.emplace_back();
+        buildNode(0, 0, primitiveCount, 1, boxes, centroids);
+    }
+
+    // Recomputes every node's box from the primitives' current boxes, keeping the tree's shape.
+    void refit(gsl::span<const AxisAlignedBoundingBox> boxes)
+    {
+        Expects(static_cast<size_t>(boxes.size()) == _primitiveIndices.size());
+        // Children always come after their parent, so walking backwards visits them first.
+        for (size_t i = _nodes.size(); i-- > 0;) {
+            Node& node = _nodes[i];
+            node.box = {};
+            if (node.isLeaf()) {
+                for (auto primitiveIndex : getLeafPrimitives(node)) {
+                    node.box.expandToBox(boxes[primitiveIndex]);
+                }
+            } else {
+                node.box.expandToBox(_nodes[node.first].box);
+                node.box.expandToBox(_nodes[node.first + 1].box);
+            }
+        }
+    }
+
+    bool isEmpty() const { return _nodes.empty(); }
+
+    AxisAlignedBoundingBox getBoundingBox() const
+    {
+        return isEmpty() ? AxisAlignedBoundingBox{} : _nodes[0].box;
+    }
+
+    // The expected cost of casting a ray through the hierarchy, as estimated by the surface area
+    // heuristic.
+    float getSurfaceAreaCost() const
+    {
+        if (isEmpty()) {
+            return 0.0f;
+        }
+
+        std::vector<float> costs(_nodes.size());
+        for (size_t i = _nodes.size(); i-- > 0;) {
+            const Node& node = _nodes[i];
+            if (node.isLeaf()) {
+                costs[i] = static_cast<float>(node.count) * kBVHIntersectionCost;
+                continue;
+            }
+
+            const Node& left = _nodes[node.first];
+            const Node& right = _nodes[node.first + 1];
+            float surfaceArea = node.box.getSurfaceArea();
+            if (!(surfaceArea > 0.0f)) {
+                costs[i] = kBVHTraversalCost + costs[node.first] + costs[node.first + 1];
+                continue;
+            }
+            costs[i] = kBVHTraversalCost
+                + ((left.box.getSurfaceArea() * costs[node.first])
+                      + (right.box.getSurfaceArea() * costs[node.first + 1]))
+                    / surfaceArea;
+        }
+        return costs[0];
+    }
+
+    // Walks the leaves whose boxes the ray passes through, nearest box first. The visitor gets
+    // each leaf's primitive indices and may shorten maxDistance once it finds a hit, which prunes
+    // every box that starts beyond it. It returns true to stop the traversal altogether.
+    template <typename LeafVisitor>
+    void traverseRay(const Ray& ray, float maxDistance, LeafVisitor&& visitLeaf) const
+    {
+        if (isEmpty()) {
+            return;
+        }
+
+        SlabRay slabRay(ray);
+        if (!(getEntryDistance(_nodes[0].box, slabRay, maxDistance) <= maxDistance)) {
+            return;
+        }
+
+        struct StackEntry {
+            uint32_t nodeIndex;
+            float entryDistance;
+        };
+        std::array<StackEntry, kMaxBVHDepth> stack;
+        size_t stackSize = 0;
+
+        uint32_t nodeIndex = 0;
+        while (true) {
+            const Node& node = _nodes[nodeIndex];
+            if (!node.isLeaf()) {
+                uint32_t nearChild = node.first;
+                uint32_t farChild = node.first + 1;
+                float nearDistance = getEntryDistance(_nodes[nearChild].box, slabRay, maxDistance);
+                float farDistance = getEntryDistance(_nodes[farChild].box, slabRay, maxDistance);
+                if (farDistance < nearDistance) {
+                    std::swap(nearChild, farChild);
+                    std::swap(nearDistance, farDistance);
+                }
+
+                if (nearDistance <= maxDistance) {
+                    if (farDistance <= maxDistance) {
+                        stack[stackSize++] = { farChild, farDistance };
+                    }
+                    nodeIndex = nearChild;
+                    continue;
+                }
+            } else if (visitLeaf(getLeafPrimitives(node), maxDistance)) {
+                return;
+            }
+
+            do {
+                if (!stackSize) {
+                    return;
+                }
+                stackSize--;
+                nodeIndex = stack[stackSize].nodeIndex;
+            } while (stack[stackSize].entryDistance > maxDistance);
+        }
+    }
+
+    // Visits every leaf whose box passes the given test, which is also used to prune branches.
+    template <typename BoxTest, typename LeafVisitor>
+    void visitLeaves(BoxTest&& intersects, LeafVisitor&& visitLeaf) const
+    {
+        if (isEmpty()) {
+            return;
+        }
+
+        std::array<uint32_t, kMaxBVHDepth> stack;
+        size_t stackSize = 0;
+
+        uint32_t nodeIndex = 0;
+        while (true) {
+            const Node& node = _nodes[nodeIndex];
+            if (intersects(node.box)) {
+                if (!node.isLeaf()) {
+                    stack[stackSize++] = node.first + 1;
+                    nodeIndex = node.first;
+                    continue;
+                }
+                visitLeaf(getLeafPrimitives(node));
+            }
+
+            if (!stackSize) {
+                return;
+            }
+            nodeIndex = stack[--stackSize];
+        }
+    }
+
+private:
+    static constexpr size_t kBinCount = 16;
+    // Leaves this small are never split, whatever the heuristic says.
+    static constexpr uint32_t kMinSplitCount = 2;
+
+    struct Node {
+        bool isLeaf() const { return count > 0; }
+
+        AxisAlignedBoundingBox box;
+        // The first primitive index for leaves, and the left child for branches. The right child
+        // directly follows the left one.
+        uint32_t first = 0;
+        uint32_t count = 0;
+    };
+
+    gsl::span<const uint32_t> getLeafPrimitives(const Node& leaf) const
+    {
+        return { _primitiveIndices.data() + leaf.first, leaf.count };
+    }
+
+    // Returns the distance at which the ray enters the box, or infinity if it misses the box or
+    // only reaches it beyond maxDistance.
+    static float getEntryDistance(
+        const AxisAlignedBoundingBox& box, const SlabRay& ray, float maxDistance)
+    {
+        auto interval = box.clipRay(ray, 0.0f, maxDistance);
+        return interval.isHit() ? interval.entryDistance : std::numeric_limits<float>::infinity();
+    }
+
+    void buildNode(uint32_t nodeIndex, uint32_t begin, uint32_t end, size_t depth,
+        gsl::span<const AxisAlignedBoundingBox> boxes, const std::vector<glm::vec3>& centroids)
+    {
+        AxisAlignedBoundingBox box;
+        AxisAlignedBoundingBox centroidBox;
+        for (uint32_t i = begin; i < end; i++) {
+            box.expandToBox(boxes[_primitiveIndices[i]]);
+            centroidBox.expandToVertex(centroids[_primitiveIndices[i]]);
+        }
+        _nodes[nodeIndex].box = box;
+
+        uint32_t count = end - begin;
+        auto makeLeaf = [this, nodeIndex, begin, count]() {
+            _nodes[nodeIndex].first = begin;
+            _nodes[nodeIndex].count = count;
+        };
+        if ((count < kMinSplitCount) || (depth >= kMaxBVHDepth)) {
+            makeLeaf();
+            return;
+        }
+
+        auto split = findBestSplit(begin, end, box, centroidBox, boxes, centroids);
+        if (!split || (split->cost >= static_cast<float>(count) * kBVHIntersectionCost)) {
+            makeLeaf();
+            return;
+        }
+
+        Binning binning(centroidBox, split->dimension);
+        auto middle = std::partition(_primitiveIndices.begin() + begin,
+            _primitiveIndices.begin() + end, [&](uint32_t primitiveIndex) {
+                return binning.getBin(centroids[primitiveIndex]) <= split->bin;
+            });
+        auto middleIndex = static_cast<uint32_t>(middle - _primitiveIndices.begin());
+
+        auto leftChild = static_cast<uint32_t>(_nodes.size());
+        _nodes.emplace_back();
+        _nodes.emplace_back();
+        _nodes[nodeIndex].first = leftChild;
+        buildNode(leftChild, begin, middleIndex, depth + 1, boxes, centroids);
+        buildNode(leftChild + 1, middleIndex, end, depth + 1, boxes, centroids);
+    }
+
+    struct Split {
+        uint8_t dimension;
+        // The last bin on the left side.
+        size_t bin;
+        float cost;
+    };
+
+    // Spreads the bins evenly over the centroids' extent along one axis.
+    struct Binning {
+        Binning(const AxisAlignedBoundingBox& centroidBox, uint8_t dimension)
+            : dimension(dimension)
+            , minimum(centroidBox.minimum[dimension])
+            , scale(static_cast<float>(kBinCount)
+                  / (centroidBox.maximum[dimension] - centroidBox.minimum[dimension]))
+        {
+        }
+
+        size_t getBin(const glm::vec3& centroid) const
+        {
+            auto bin = static_cast<size_t>((centroid[dimension] - minimum) * scale);
+            return std::min(bin, kBinCount - 1);
+        }
+
+        uint8_t dimension;
+        float minimum;
+        float scale;
+    };
+
+    std::optional<Split> findBestSplit(uint32_t begin, uint32_t end,
+        const AxisAlignedBoundingBox& box, const AxisAlignedBoundingBox& centroidBox,
+        gsl::span<const AxisAlignedBoundingBox> boxes,
+        const std::vector<glm::vec3>& centroids) const
+    {
+        float surfaceArea = box.getSurfaceArea();
+        std::optional<Split> bestSplit;
+        for (uint8_t dimension = 0; dimension < 3; dimension++) {
+            if (!(centroidBox.maximum[dimension] > centroidBox.minimum[dimension])) {
+                // Every centroid lies in the same plane, so nothing separates them on this axis.
+                continue;
+            }
+
+            Binning binning(centroidBox, dimension);
+            std::array<AxisAlignedBoundingBox, kBinCount> binBoxes;
+            std::array<uint32_t, kBinCount> binCounts{};
+            for (uint32_t i = begin; i < end; i++) {
+                auto primitiveIndex = _primitiveIndices[i];
+                auto bin = binning.getBin(centroids[primitiveIndex]);
+                binBoxes[bin].expandToBox(boxes[primitiveIndex]);
+                binCounts[bin]++;
+            }
+
+            // Sweep from the right to find the area and count to the right of every boundary,
+            // then from the left to evaluate each boundary.
+            std::array<float, kBinCount> rightAreas;
+            std::array<uint32_t, kBinCount> rightCounts;
+            AxisAlignedBoundingBox rightBox;
+            uint32_t rightCount = 0;
+            float rightArea = 0.0f;
+            for (size_t bin = kBinCount; bin-- > 1;) {
+                if (binCounts[bin]) {
+                    rightBox.expandToBox(binBoxes[bin]);
+                    rightCount += binCounts[bin];
+                    rightArea = rightBox.getSurfaceArea();
+                }
+                rightAreas[bin] = rightArea;
+                rightCounts[bin] = rightCount;
+            }
+
+            AxisAlignedBoundingBox leftBox;
+            uint32_t leftCount = 0;
+            for (size_t bin = 0; bin + 1 < kBinCount; bin++) {
+                // A boundary after an empty bin splits the same way as the one before it.
+                if (!binCounts[bin]) {
+                    continue;
+                }
+                leftBox.expandToBox(binBoxes[bin]);
+                leftCount += binCounts[bin];
+                if (!rightCounts[bin + 1]) {
+                    break;
+                }
+
+                float cost = kBVHTraversalCost
+                    + kBVHIntersectionCost
+                        * ((leftBox.getSurfaceArea() * static_cast<float>(leftCount))
+                            + (rightAreas[bin + 1] * static_cast<float>(rightCounts[bin + 1])))
+                        / surfaceArea;
+                if (!bestSplit || (cost < bestSplit->cost)) {
+                    bestSplit = Split{ dimension, bin, cost };
+                }
+            }
+        }
+        return bestSplit;
+    }
+
+    std::vector<Node> _nodes;
+    std::vector<uint32_t> _primitiveIndices;
+};
+
+// Quality may degrade this far, relative to a fresh build, before update() rebuilds the tree
+// instead of refitting it.
+constexpr float kBVHRebuildCostRatio = 1.5f;
+
+// A bounding volume hierarchy of triangles that, unlike KDTree, can follow them as they move. It
+// answers the same queries as KDTree.
+template <typename SurfaceData>
+class BVH {
+public:
+    struct Hit {
+        Triangle<SurfaceData>* triangle;
+        glm::vec2 uv;
+        float t;
+    };
+
+    BVH() = default;
+
+    explicit BVH(std::vector<Triangle<SurfaceData>> triangles)
+        : _triangles(std::move(triangles))
+    {
+        for (const auto& triangle : _triangles) {
+            _boxes.push_back(triangle.getBoundingBox());
+        }
+        rebuild();
+    }
+
+    size_t getTriangleCount() const { return _triangles.size(); }
+    Triangle<SurfaceData>& getTriangle(size_t index) { return _triangles[index]; }
+    const Triangle<SurfaceData>& getTriangle(size_t index) const { return _triangles[index]; }
+
+    // Triangles added or moved are picked up by the next update, which has to run before the
+    // tree is queried again.
+    size_t addTriangle(const std::array<glm::vec3, 3>& vertices, SurfaceData data)
+    {
+        _triangles.push_back({ vertices, data });
+        _boxes.push_back(_triangles.back().getBoundingBox());
+        _needsRebuild = true;
+        return _triangles.size() - 1;
+    }
+
+    void moveTriangle(size_t index, const std::array<glm::vec3, 3>& vertices)
+    {
+        _triangles[index].vertices = vertices;
+        _boxes[index] = _triangles[index].getBoundingBox();
+        _needsRefit = true;
+    }
+
+    // Refits the tree to the triangles' current positions, or rebuilds it if triangles were added
+    // or refitting has degraded it too far since the last build.
+    void update()
+    {
+        if (_needsRebuild) {
+            rebuild();
+            return;
+        }
+        if (!_needsRefit) {
+            return;
+        }
+
+        refit();
+        if (_hierarchy.getSurfaceAreaCost() > _builtCost * kBVHRebuildCostRatio) {
+            rebuild();
+        }
+    }
+
+    // Updates the boxes of the existing tree in O(N).
+    void refit()
+    {
+        Expects(!_needsRebuild);
+        _hierarchy.refit(_boxes);
+        _needsRefit = false;
+    }
+
+    void rebuild()
+    {
+        _hierarchy.build(_boxes);
+        _builtCost = _hierarchy.getSurfaceAreaCost();
+        _needsRebuild = false;
+        _needsRefit = false;
+    }
+
+    std::optional<Hit> castRay(
+        const Ray& ray, float maxDistance = std::numeric_limits<float>::infinity()) const
+    {
+        Expects(isUpToDate());
+        std::optional<Hit> bestHit;
+        _hierarchy.traverseRay(ray, maxDistance,
+            [this, &ray, &bestHit](gsl::span<const uint32_t> triangles, float& maxDistance) {
+                for (auto triangleIndex : triangles) {
+                    auto* triangle = &_triangles[triangleIndex];
+                    auto hit = triangle->castRay(ray);
+                    if (hit && !(hit->t > maxDistance)) {
+                        bestHit = Hit{ triangle, hit->uv, hit->t };
+                        maxDistance = hit->t;
+                    }
+                }
+                return false;
+            });
+        return bestHit;
+    }
+
+    // Like KDTree::occluded, this stops at the first hit within maxDistance.
+    bool occluded(const Ray& ray, float maxDistance) const
+    {
+        Expects(isUpToDate());
+        bool isOccluded = false;
+        _hierarchy.traverseRay(ray, maxDistance,
+            [this, &ray, &isOccluded](gsl::span<const uint32_t> triangles, float& maxDistance) {
+                for (auto triangleIndex : triangles) {
+                    auto hit = _triangles[triangleIndex].castRay(ray);
+                    if (hit && !(hit->t > maxDistance)) {
+                        isOccluded = true;
+                        return true;
+                    }
+                }
+                return false;
+            });
+        return isOccluded;
+    }
+
+    template <typename Visitor>
+    void visitTrianglesIntersectingSphere(const Sphere& sphere, Visitor&& visitor) const
+    {
+        Expects(isUpToDate());
+        _hierarchy.visitLeaves(
+            [&sphere](const AxisAlignedBoundingBox& box) { return box.intersectsSphere(sphere); },
+            [this, &sphere, &visitor](gsl::span<const uint32_t> triangles) {
+                for (auto triangleIndex : triangles) {
+                    auto& triangle = _triangles[triangleIndex];
+                    auto hit = triangle.intersectsSphere(sphere);
+                    if (hit) {
+                        visitor(triangle, *hit);
+                    }
+                }
+            });
+    }
+
+    float getSurfaceAreaCost() const { return _hierarchy.getSurfaceAreaCost(); }
+
+private:
+    bool isUpToDate() const { return !_needsRebuild && !_needsRefit; }
+
+    // Hits hand out mutable triangles so that callers can update their surface data.
+    mutable std::vector<Triangle<SurfaceData>> _triangles;
+    std::vector<AxisAlignedBoundingBox> _boxes;
+    BoxHierarchy _hierarchy;
+    float _builtCost = 0.0f;
+    bool _needsRebuild = false;
+    bool _needsRefit = false;
+};
+
+} // namespace rev
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "rev/geometry/BVH.h"
+#include "rev/geometry/KDTree.h"
+#include "rev/geometry/Tools.h"
+#include <glm/glm.hpp>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace rev {
+
+// Returns the smallest box containing the given box once it has been transformed.
+inline AxisAlignedBoundingBox transformBoundingBox(
+    const AxisAlignedBoundingBox& box, const glm::mat4& transform)
+{
+    glm::vec3 center = (box.minimum + box.maximum) * 0.5f;
+    glm::vec3 extent = (box.maximum - box.minimum) * 0.5f;
+
+    glm::vec3 transformedCenter(transform * glm::vec4(center, 1.0f));
+    glm::vec3 transformedExtent(0.0f);
+    for (int column = 0; column < 3; column++) {
+        for (int row = 0; row < 3; row++) {
+            transformedExtent[row] += std::abs(transform[column][row]) * extent[column];
+        }
+    }
+
+    AxisAlignedBoundingBox transformedBox;
+    transformedBox.minimum = transformedCenter - transformedExtent;
+    transformedBox.maximum = transformedCenter + transformedExtent;
+    return transformedBox;
+}
+
+// Ray casting against many copies of one model, like the objects of a SceneObjectGroup. The
+// model's triangles are stored once, in a KDTree in object space that every instance shares. A
+// BoxHierarchy over the instances' world space boxes finds the instances a ray might hit, and the
+// ray is then moved into each one's object space to traverse the shared tree. Memory per instance
+// is just its transform and box, however many triangles the model has.
+//
+// Instances can be any type with a glm::mat4 transform member, such as CompositeObject.
+template <typename SurfaceData, typename InstanceType>
+class InstancedKDTree {
+public:
+    struct Hit {
+        InstanceType* instance;
+        // In the model's object space.
+        Triangle<SurfaceData>* triangle;
+        glm::vec2 uv;
+        // In world space.
+        float t;
+    };
+
+    explicit InstancedKDTree(std::shared_ptr<const KDTree<SurfaceData>> model)
+        : _model(std::move(model))
+    {
+    }
+
+    void addInstance(std::shared_ptr<InstanceType> instance)
+    {
+        _instances.push_back(std::move(instance));
+        _needsRebuild = true;
+    }
+
+    size_t getInstanceCount() const { return _instances.size(); }
+
+    // Reads every instance's current transform and refits the top level to match. Call this once
+    // per tick, after instances have moved and before casting rays. It rebuilds instead when
+    // instances were added, or when they've moved far enough that refitting has degraded the top
+    // level.
+    void update()
+    {
+        _inverseTransforms.resize(_instances.size());
+        _boxes.resize(_instances.size());
+        const auto& modelBox = _model->getBoundingBox();
+        for (size_t i = 0; i < _instances.size(); i++) {
+            const glm::mat4& transform = _instances[i]->transform;
+            _inverseTransforms[i] = glm::inverse(transform);
+            _boxes[i] = transformBoundingBox(modelBox, transform);
+        }
+
+        if (!_needsRebuild) {
+            _hierarchy.refit(_boxes);
+            if (!(_hierarchy.getSurfaceAreaCost() > _builtCost * kBVHRebuildCostRatio)) {
+                return;
+            }
+        }
+        _hierarchy.build(_boxes);
+        _builtCost = _hierarchy.getSurfaceAreaCost();
+        _needsRebuild = false;
+    }
+
+    std::optional<Hit> castRay(
+        const Ray& ray, float maxDistance = std::numeric_limits<float>::infinity()) const
+    {
+        Expects(!_needsRebuild);
+        std::optional<Hit> bestHit;
+        _hierarchy.traverseRay(ray, maxDistance,
+            [this, &ray, &bestHit](gsl::span<const uint32_t> instances, float& maxDistance) {
+                for (auto instanceIndex : instances) {
+                    auto hit = _model->castRay(getObjectSpaceRay(ray, instanceIndex), maxDistance);
+                    if (hit) {
+                        bestHit = Hit{ _instances[instanceIndex].get(), hit->triangle, hit->uv,
+                            hit->t };
+                        maxDistance = hit->t;
+                    }
+                }
+                return false;
+            });
+        return bestHit;
+    }
+
+    bool occluded(const Ray& ray, float maxDistance) const
+    {
+        Expects(!_needsRebuild);
+        bool isOccluded = false;
+        _hierarchy.traverseRay(ray, maxDistance,
+            [this, &ray, &isOccluded](gsl::span<const uint32_t> instances, float& maxDistance) {
+                for (auto instanceIndex : instances) {
+                    if (_model->occluded(getObjectSpaceRay(ray, instanceIndex), maxDistance)) {
+                        isOccluded = true;
+                        return true;
+                    }
+                }
+                return false;
+            });
+        return isOccluded;
+    }
+
+private:
+    // The direction is left unnormalized, so distances along the ray are the same in both
+    // spaces.
+    Ray getObjectSpaceRay(const Ray& ray, uint32_t instanceIndex) const
+    {
+        const glm::mat4& inverseTransform = _inverseTransforms[instanceIndex];
+        return { glm::vec3(inverseTransform * glm::vec4(ray.origin, 1.0f)),
+            glm::vec3(inverseTransform * glm::vec4(ray.direction, 0.0f)) };
+    }
+
+    std::shared_ptr<const KDTree<SurfaceData>> _model;
+    std::vector<std::shared_ptr<InstanceType>> _instances;
+    std::vector<glm::mat4> _inverseTransforms;
+    std::vector<AxisAlignedBoundingBox> _boxes;
+    BoxHierarchy _hierarchy;
+    float _builtCost = 0.0f;
+    bool _needsRebuild = false;
+};
+
+} // namespace rev
@@ -1,13 +1,28 @@
 #pragma once
 
 #include "rev/Utilities.h"
+#include "rev/WorkerPool.h"
+#include "rev/geometry/KDTreeStats.h"
+#include "rev/geometry/PackedBoxes.h"
+#include "rev/geometry/PackedTriangles.h"
+#include "rev/geometry/Simd.h"
 #include "rev/geometry/Tools.h"
+#include <algorithm>
 #include <array>
+#include <bitset>
+#include <chrono>
+#include <functional>
 #include <glm/glm.hpp>
 #include <gsl/gsl_assert>
+#include <gsl/span>
 #include <iostream>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <set>
+#include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
 #include <variant>
 #include <vector>
@@ -55,7 +70,8 @@ struct Triangle {
         return false;
     }
 
-    std::optional<AxisAlignedBoundingBox> clippedBoundingBox(const AxisAlignedBoundingBox& box)
+    std::optional<AxisAlignedBoundingBox> clippedBoundingBox(
+        const AxisAlignedBoundingBox& box) const
     {
         // Alternate between these two buffers for input and output
         std::array<glm::vec3, 9> buf1{};
@@ -132,7 +148,7 @@ struct Triangle {
 
         glm::vec3 q = glm::cross(fromV0, edge1);
         float v = glm::dot(ray.direction, q) / determinant;
-        if (v < 0.0f || v > 1.0f) {
+        if (v < 0.0f || (u + v) > 1.0f) {
             return std::nullopt;
         }
 
@@ -144,6 +160,135 @@ struct Triangle {
         return Hit{ { u, v }, t };
     }
 
+    // The point of the triangle closest to the given point.
+    glm::vec3 getClosestPoint(const glm::vec3& point) const
+    {
+        // Works out which feature of the triangle is closest from the point's position relative
+        // to each edge, as in Ericson's Real-Time Collision Detection.
+        glm::vec3 edge1 = vertices[1] - vertices[0];
+        glm::vec3 edge2 = vertices[2] - vertices[0];
+        glm::vec3 fromV0 = point - vertices[0];
+        float d1 = glm::dot(edge1, fromV0);
+        float d2 = glm::dot(edge2, fromV0);
+        if ((d1 <= 0.0f) && (d2 <= 0.0f)) {
+            return vertices[0];
+        }
+
+        glm::vec3 fromV1 = point - vertices[1];
+        float d3 = glm::dot(edge1, fromV1);
+        float d4 = glm::dot(edge2, fromV1);
+        if ((d3 >= 0.0f) && (d4 <= d3)) {
+            return vertices[1];
+        }
+
+        float vc = (d1 * d4) - (d3 * d2);
+        if ((vc <= 0.0f) && (d1 >= 0.0f) && (d3 <= 0.0f)) {
+            return vertices[0] + (edge1 * (d1 / (d1 - d3)));
+        }
+
+        glm::vec3 fromV2 = point - vertices[2];
+        float d5 = glm::dot(edge1, fromV2);
+        float d6 = glm::dot(edge2, fromV2);
+        if ((d6 >= 0.0f) && (d5 <= d6)) {
+            return vertices[2];
+        }
+
+        float vb = (d5 * d2) - (d1 * d6);
+        if ((vb <= 0.0f) && (d2 >= 0.0f) && (d6 <= 0.0f)) {
+            return vertices[0] + (edge2 * (d2 / (d2 - d6)));
+        }
+
+        float va = (d3 * d6) - (d5 * d4);
+        if ((va <= 0.0f) && ((d4 - d3) >= 0.0f) && ((d5 - d6) >= 0.0f)) {
+            float along = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+            return vertices[1] + ((vertices[2] - vertices[1]) * along);
+        }
+
+        float denominator = 1.0f / (va + vb + vc);
+        return vertices[0] + (edge1 * (vb * denominator)) + (edge2 * (vc * denominator));
+    }
+
+    struct SweepHit {
+        // The fraction of the displacement travelled before touching the triangle.
+        float t;
+        glm::vec3 point;
+    };
+
+    // Moves a sphere along the displacement and finds where it first touches the triangle. A
+    // sphere that already touches the triangle hits it at t = 0.
+    std::optional<SweepHit> sweepSphere(
+        const Sphere& sphere, const glm::vec3& displacement, float maxT = 1.0f) const
+    {
+        glm::vec3 closestPoint = getClosestPoint(sphere.center);
+        glm::vec3 toClosestPoint = closestPoint - sphere.center;
+        float radiusSquared = sphere.radius * sphere.radius;
+        if (glm::dot(toClosestPoint, toClosestPoint) <= radiusSquared) {
+            return SweepHit{ 0.0f, closestPoint };
+        }
+
+        // The sphere can first touch the inside of the face, or failing that one of the edges or
+        // vertices.
+        glm::vec3 normal = glm::cross(vertices[1] - vertices[0], vertices[2] - vertices[0]);
+        float normalLength = glm::length(normal);
+        if (normalLength > 0.0f) {
+            normal /= normalLength;
+            float distance = glm::dot(normal, sphere.center - vertices[0]);
+            float approachSpeed = glm::dot(normal, displacement);
+            if ((approachSpeed != 0.0f) && ((distance > 0.0f) == (approachSpeed < 0.0f))) {
+                float side = (distance > 0.0f) ? 1.0f : -1.0f;
+                float t = (distance - (side * sphere.radius)) / -approachSpeed;
+                if ((t >= 0.0f) && (t <= maxT)) {
+                    glm::vec3 point
+                        = sphere.center + (displacement * t) - (normal * (side * sphere.radius));
+                    if (containsCoplanarPoint(point)) {
+                        return SweepHit{ t, point };
+                    }
+                }
+            }
+        }
+
+        std::optional<SweepHit> hit;
+        float a = glm::dot(displacement, displacement);
+        for (const auto& vertex : vertices) {
+            glm::vec3 fromVertex = sphere.center - vertex;
+            auto t = findSmallestQuadraticRoot(a, 2.0f * glm::dot(displacement, fromVertex),
+                glm::dot(fromVertex, fromVertex) - radiusSquared, maxT);
+            if (t) {
+                hit = SweepHit{ *t, vertex };
+                maxT = *t;
+            }
+        }
+
+        for (size_t i = 0; i < 3; i++) {
+            const glm::vec3& start = vertices[i];
+            glm::vec3 edge = vertices[(i + 1) % 3] - start;
+            glm::vec3 toStart = start - sphere.center;
+            float edgeLengthSquared = glm::dot(edge, edge);
+            float edgeDotDisplacement = glm::dot(edge, displacement);
+            float edgeDotToStart = glm::dot(edge, toStart);
+
+            // When the sphere's center comes within the radius of the edge's infinite line.
+            auto t = findSmallestQuadraticRoot(
+                (edgeLengthSquared * -a) + (edgeDotDisplacement * edgeDotDisplacement),
+                (edgeLengthSquared * 2.0f * glm::dot(displacement, toStart))
+                    - (2.0f * edgeDotDisplacement * edgeDotToStart),
+                (edgeLengthSquared * (radiusSquared - glm::dot(toStart, toStart)))
+                    + (edgeDotToStart * edgeDotToStart),
+                maxT);
+            if (!t) {
+                continue;
+            }
+
+            // Only contacts within the edge itself count; the rest are covered by the vertices.
+            float along = ((edgeDotDisplacement * *t) - edgeDotToStart) / edgeLengthSquared;
+            if ((along >= 0.0f) && (along <= 1.0f)) {
+                hit = SweepHit{ *t, start + (edge * along) };
+                maxT = *t;
+            }
+        }
+        return hit;
+    }
+
     glm::vec3 baryCentricToCartesian(glm::vec2 uv)
     {
         float u = uv[0];
@@ -152,286 +297,1760 @@ struct Triangle {
         return w * vertices[0] + u * vertices[1] + v * vertices[2];
     }
 
-    glm::vec2 cartesianToBarycentric(glm::vec3 position)
+    glm::vec2 cartesianToBarycentric(glm::vec3 position)
+    {
+        glm::vec3 v0 = vertices[1] - vertices[0];
+        glm::vec3 v1 = vertices[2] - vertices[0];
+        glm::vec3 v2 = position - vertices[0];
+
+        float d00 = glm::dot(v0, v0);
+        float d01 = glm::dot(v0, v1);
+        float d11 = glm::dot(v1, v1);
+        float d20 = glm::dot(v2, v0);
+        float d21 = glm::dot(v2, v1);
+        float denom = d00 * d11 - d01 * d01;
+
+        float v = (d11 * d20 - d01 * d21) / denom;
+        float w = (d00 * d21 - d01 * d20) / denom;
+        float u = 1.0f - v - w;
+
+        return { u, v };
+    }
+
+    // Whether a point in the triangle's plane lies inside it.
+    bool containsCoplanarPoint(const glm::vec3& point) const
+    {
+        glm::vec3 normal = glm::cross(vertices[1] - vertices[0], vertices[2] - vertices[0]);
+        for (size_t i = 0; i < 3; i++) {
+            glm::vec3 edge = vertices[(i + 1) % 3] - vertices[i];
+            if (glm::dot(glm::cross(edge, point - vertices[i]), normal) < 0.0f) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Finds whether any part of the triangle lies within the sphere. If it does, returns the
+    // distance from the sphere's center to the triangle's plane along the normal.
+    std::optional<float> intersectsSphere(const Sphere& sphere) const
+    {
+        glm::vec3 toClosestPoint = getClosestPoint(sphere.center) - sphere.center;
+        if (glm::dot(toClosestPoint, toClosestPoint) > (sphere.radius * sphere.radius)) {
+            return std::nullopt;
+        }
+        return glm::dot(getNormal(), vertices[0] - sphere.center);
+    }
+};
+
+// Hashes triangles as they're handed to a builder, so that a saved tree can be matched against
+// the input it was built from.
+class TriangleContentHash {
+public:
+    template <typename SurfaceData>
+    void add(const std::array<glm::vec3, 3>& vertices, const SurfaceData& data)
+    {
+        addBytes(vertices.data(), sizeof(vertices));
+        // Padding bytes hold arbitrary values, so surface data with padding is left out.
+        if constexpr (std::has_unique_object_representations_v<SurfaceData>) {
+            addBytes(&data, sizeof(data));
+        }
+    }
+
+    uint64_t get() const { return _hash; }
+
+private:
+    // 64 bit FNV-1a.
+    void addBytes(const void* bytes, size_t size)
+    {
+        for (size_t i = 0; i < size; i++) {
+            _hash ^= static_cast<const uint8_t*>(bytes)[i];
+            _hash *= 0x100000001b3;
+        }
+    }
+
+    uint64_t _hash = 0xcbf29ce484222325;
+};
+
+template <typename Primitive>
+struct LeafNode {
+    std::unordered_set<Primitive*> primitives;
+    // Set to the leaf's box when the subtree below it is to be built on demand.
+    std::optional<AxisAlignedBoundingBox> deferredBox{};
+};
+
+template <typename Primitive>
+struct BranchNode;
+
+template <typename Primitive>
+using MapNode = std::variant<LeafNode<Primitive>, BranchNode<Primitive>>;
+
+template <typename Primitive>
+struct BranchNode {
+    AxisAlignedPlane split;
+
+    std::unique_ptr<MapNode<Primitive>> left{};
+    std::unique_ptr<MapNode<Primitive>> right{};
+};
+
+// Relative costs of stepping through a branch node and of testing a single triangle, as used by the
+// surface area heuristic.
+constexpr float kKDTreeTraversalCost = 15.0f;
+constexpr float kKDTreeIntersectionCost = 20.0f;
+constexpr float kKDTreeEmptySplitDiscount = 0.8f;
+
+// The child that receives triangles lying exactly in a split plane.
+enum class KDTreeSplitSide {
+    Left,
+    Right,
+};
+
+// Estimates the cost of splitting a box with the surface area heuristic, and picks the side that
+// triangles lying in the split plane should go to.
+inline std::pair<KDTreeSplitSide, float> evaluateKDTreeSplit(const AxisAlignedBoundingBox& box,
+    const AxisAlignedPlane& splitPlane, size_t leftTriangleCount, size_t planarTriangleCount,
+    size_t rightTriangleCount)
+{
+    auto [leftBox, rightBox] = box.split(splitPlane);
+    float boxSurfaceArea = box.getSurfaceArea();
+
+    float leftArea = leftBox.getSurfaceArea() / boxSurfaceArea;
+    float rightArea = rightBox.getSurfaceArea() / boxSurfaceArea;
+    bool removesVolume = (leftBox.getVolume() > 0.0f) && (rightBox.getVolume() > 0.0f);
+
+    auto cost = [leftArea, rightArea, removesVolume](
+                    size_t leftTriangleCount, size_t rightTriangleCount) {
+        float cost = static_cast<float>(leftTriangleCount) * leftArea
+            + static_cast<float>(rightTriangleCount) * rightArea;
+        if (removesVolume && (!leftTriangleCount || !rightTriangleCount)) {
+            // We slightly prefer splits that remove empty space.
+            cost *= kKDTreeEmptySplitDiscount;
+        }
+        return cost;
+    };
+
+    float leftCost = cost(leftTriangleCount + planarTriangleCount, rightTriangleCount);
+    float rightCost = cost(leftTriangleCount, planarTriangleCount + rightTriangleCount);
+    if (leftCost < rightCost) {
+        return { KDTreeSplitSide::Left,
+            (kKDTreeIntersectionCost * leftCost) + kKDTreeTraversalCost };
+    } else {
+        return { KDTreeSplitSide::Right,
+            (kKDTreeIntersectionCost * rightCost) + kKDTreeTraversalCost };
+    }
+}
+
+// A node of a built KDTree. Nodes are stored depth-first in a single array: the left child of a
+// branch directly follows its parent, and the branch stores the index of its right child. Leaves
+// store a range of the tree's triangle index array. Deferred leaves stand in for subtrees that are
+// only built when a query first reaches them, and store the index of that subtree instead.
+class KDTreeNode {
+public:
+    static KDTreeNode makeBranch(const AxisAlignedPlane& split, uint32_t rightChildIndex)
+    {
+        Expects(split.dimensionIndex < 3);
+        Expects(rightChildIndex <= kMaxPayload);
+
+        KDTreeNode node;
+        node._split = split.boundary;
+        node._flags = (rightChildIndex << 2) | split.dimensionIndex;
+        return node;
+    }
+
+    static KDTreeNode makeLeaf(uint32_t firstTriangle, uint32_t triangleCount)
+    {
+        Expects(triangleCount < kDeferredCount);
+
+        KDTreeNode node;
+        node._firstTriangle = firstTriangle;
+        node._flags = (triangleCount << 2) | kLeafFlag;
+        return node;
+    }
+
+    static KDTreeNode makeDeferredLeaf(uint32_t subtreeIndex)
+    {
+        KDTreeNode node;
+        node._firstTriangle = subtreeIndex;
+        node._flags = (kDeferredCount << 2) | kLeafFlag;
+        return node;
+    }
+
+    // Deferred leaves are leaves too, so check for them first.
+    bool isLeaf() const { return (_flags & kLeafFlag) == kLeafFlag; }
+    bool isDeferred() const { return _flags == ((kDeferredCount << 2) | kLeafFlag); }
+
+    uint8_t getSplitDimension() const { return static_cast<uint8_t>(_flags & kLeafFlag); }
+    float getSplitPosition() const { return _split; }
+    AxisAlignedPlane getSplitPlane() const { return { getSplitDimension(), _split }; }
+    uint32_t getRightChildIndex() const { return _flags >> 2; }
+
+    uint32_t getFirstTriangle() const { return _firstTriangle; }
+    uint32_t getTriangleCount() const { return _flags >> 2; }
+
+    uint32_t getDeferredSubtreeIndex() const { return _firstTriangle; }
+
+private:
+    static constexpr uint32_t kLeafFlag = 3;
+    static constexpr uint32_t kMaxPayload = std::numeric_limits<uint32_t>::max() >> 2;
+    // The triangle count that marks a deferred leaf, which no real leaf can have.
+    static constexpr uint32_t kDeferredCount = kMaxPayload;
+
+    union {
+        float _split;
+        uint32_t _firstTriangle;
+    };
+
+    // The low two bits hold the split dimension, or kLeafFlag for leaves. The rest holds the
+    // right child index for branches and the triangle count for leaves.
+    uint32_t _flags;
+};
+static_assert(sizeof(KDTreeNode) == 8);
+
+// Traversal keeps a fixed-size stack, so builders must not produce trees deeper than this.
+constexpr size_t kMaxKDTreeDepth = 64;
+
+// Remembers which primitives a query has already tested. Primitives straddling a split are stored
+// in every leaf they touch, and without this a query would test them again in each one. Tags are
+// kept in a small hashed array, so a primitive can be forgotten when another lands in its slot; it
+// is then just tested again. Every query keeps its own mailbox on the stack, which keeps
+// concurrent queries apart without any locking.
+class PrimitiveMailbox {
+public:
+    PrimitiveMailbox() { _tags.fill(kEmptyTag); }
+
+    static constexpr uint32_t kEmptyTag = std::numeric_limits<uint32_t>::max();
+
+    // Records the primitive, returning false if it was already recorded.
+    bool add(uint32_t primitiveIndex) { return replace(primitiveIndex) != primitiveIndex; }
+
+    // Records the primitive in its slot, returning the primitive that was recorded there before,
+    // or kEmptyTag if there was none.
+    uint32_t replace(uint32_t primitiveIndex)
+    {
+        // Fibonacci hashing, which spreads out runs of neighboring indices.
+        uint32_t& tag = _tags[(primitiveIndex * 2654435769u) >> (32 - kSizeBits)];
+        uint32_t replaced = tag;
+        tag = primitiveIndex;
+        return replaced;
+    }
+
+private:
+    static constexpr uint32_t kSizeBits = 5;
+
+    std::array<uint32_t, size_t{ 1 } << kSizeBits> _tags;
+};
+
+// A PrimitiveMailbox that never forgets, for queries that hand each primitive to a visitor and so
+// can't visit one twice. Primitives pushed out of their slot move to an overflow set, which is only
+// allocated once the slots start colliding.
+class ExactPrimitiveMailbox {
+public:
+    // Records the primitive, returning false if it was already recorded.
+    bool add(uint32_t primitiveIndex)
+    {
+        uint32_t replaced = _mailbox.replace(primitiveIndex);
+        if (replaced == primitiveIndex) {
+            return false;
+        }
+        if (replaced != PrimitiveMailbox::kEmptyTag) {
+            _overflow.insert(replaced);
+        }
+        return _overflow.empty() || !_overflow.erase(primitiveIndex);
+    }
+
+private:
+    PrimitiveMailbox _mailbox;
+    std::unordered_set<uint32_t> _overflow;
+};
+
+// The flat arrays that make up a built KDTree. None of them hold pointers, so they can be written
+// to a file and used again straight from memory.
+template <typename SurfaceData>
+struct KDTreeArrays {
+    gsl::span<Triangle<SurfaceData>> triangles;
+    gsl::span<const KDTreeNode> nodes;
+    // Indexes into triangles for each leaf, in leaf order.
+    gsl::span<const uint32_t> triangleIndices;
+    // The PackedTriangles components of each entry of triangleIndices.
+    gsl::span<const float> leafTriangles;
+    AxisAlignedBoundingBox boundingBox;
+};
+
+// The nodes of a built tree and the traversals over them, shared by the trees over each kind of
+// primitive. Leaves hold indices into the tree's own primitive array, and the traversals hand
+// those leaves to visitors that know how to test the primitives.
+//
+// Trees built lazily leave some subtrees unbuilt behind deferred leaves. The first query to reach
+// one builds it as a tree of its own, which shares the primitives of its parent. Traversals carry
+// on into these subtrees, so visitors are handed the tree each leaf belongs to.
+class KDTreeNodes {
+public:
+    // Builds the subtree of a deferred leaf, given the tree, the leaf's primitives and its box.
+    using SubtreeBuilder = std::function<std::shared_ptr<const KDTreeNodes>(
+        const KDTreeNodes&, gsl::span<const uint32_t>, const AxisAlignedBoundingBox&)>;
+
+    // The expected cost of casting a ray through the tree, as estimated by the surface area
+    // heuristic. Lower is better; this is the quantity the builders try to minimize.
+    float getSurfaceAreaCost() const { return getSurfaceAreaCost(0, _boundingBox); }
+
+    const AxisAlignedBoundingBox& getBoundingBox() const { return _boundingBox; }
+
+    KDTreeBuildStats getBuildStats() const
+    {
+        KDTreeBuildStats stats;
+        stats.nodeCount = _nodes.size();
+        stats.triangleCount = _primitiveCount;
+        stats.surfaceAreaCost = getSurfaceAreaCost();
+        stats.buildTime = _buildTime;
+
+        struct StackEntry {
+            uint32_t nodeIndex;
+            size_t depth;
+        };
+        std::array<StackEntry, kMaxKDTreeDepth> stack;
+        size_t stackSize = 0;
+
+        StackEntry entry{ 0, 0 };
+        while (true) {
+            const KDTreeNode& node = _nodes[entry.nodeIndex];
+            if (!node.isLeaf()) {
+                stack[stackSize++] = { node.getRightChildIndex(), entry.depth + 1 };
+                entry = { entry.nodeIndex + 1, entry.depth + 1 };
+                continue;
+            }
+
+            size_t triangleCount = getLeafPrimitives(node).size();
+            stats.leafCount++;
+            stats.deferredLeafCount += node.isDeferred() ? 1 : 0;
+            stats.emptyLeafCount += triangleCount ? 0 : 1;
+            stats.leafTriangleCount += triangleCount;
+            stats.maxLeafTriangleCount = std::max(stats.maxLeafTriangleCount, triangleCount);
+            if (stats.leafDepthHistogram.size() <= entry.depth) {
+                stats.leafDepthHistogram.resize(entry.depth + 1);
+            }
+            stats.leafDepthHistogram[entry.depth]++;
+
+            if (!stackSize) {
+                return stats;
+            }
+            entry = stack[--stackSize];
+        }
+    }
+
+    // The totals of every query's counters since the tree was made or the stats were last reset.
+    // Queries are only counted when REV_KDTREE_QUERY_STATS is enabled, and these stay zero
+    // otherwise.
+    KDTreeQueryStats getQueryStats() const { return _queryStats->get(); }
+
+    void resetQueryStats() const { _queryStats->reset(); }
+
+protected:
+    KDTreeNodes() = default;
+
+    template <typename Primitive>
+    static std::unordered_map<const Primitive*, uint32_t> indexPrimitives(
+        const std::vector<std::unique_ptr<Primitive>>& primitives)
+    {
+        std::unordered_map<const Primitive*, uint32_t> primitiveIndices;
+        for (size_t i = 0; i < primitives.size(); i++) {
+            primitiveIndices.emplace(primitives[i].get(), static_cast<uint32_t>(i));
+        }
+        return primitiveIndices;
+    }
+
+    // Flattens a tree a builder has made into depth-first node and leaf index arrays, giving each
+    // primitive the index it has in the map.
+    template <typename Primitive>
+    void flattenTree(const MapNode<Primitive>& root,
+        const std::unordered_map<const Primitive*, uint32_t>& primitiveIndices,
+        std::vector<KDTreeNode>& nodes, std::vector<uint32_t>& leafIndices)
+    {
+        flattenNode(root, primitiveIndices, 0, nodes, leafIndices);
+    }
+
+    void setNodes(gsl::span<const KDTreeNode> nodes, gsl::span<const uint32_t> primitiveIndices,
+        const AxisAlignedBoundingBox& boundingBox, size_t primitiveCount)
+    {
+        _nodes = nodes;
+        _primitiveIndices = primitiveIndices;
+        _boundingBox = boundingBox;
+        _primitiveCount = primitiveCount;
+    }
+
+    // Walks the leaves pierced by the ray in front-to-back order. The leaf visitor may shorten
+    // maxDistance once it finds a hit, which prunes every node that starts beyond it, and returns
+    // true to stop the traversal altogether. Returns whether the visitor stopped it.
+    template <typename LeafVisitor>
+    bool traverseRay(const Ray& ray, float& maxDistance, KDTreeQueryCounter& counter,
+        LeafVisitor&& visitLeaf) const
+    {
+        SlabRay slabRay(ray);
+        auto interval = _boundingBox.clipRay(slabRay, 0.0f, maxDistance);
+        if (!interval.isHit()) {
+            return false;
+        }
+        float entryDistance = interval.entryDistance;
+        float exitDistance = interval.exitDistance;
+
+        struct StackEntry {
+            uint32_t nodeIndex;
+            float entryDistance;
+            float exitDistance;
+        };
+        std::array<StackEntry, kMaxKDTreeDepth> stack;
+        size_t stackSize = 0;
+
+        uint32_t nodeIndex = 0;
+        while (true) {
+            const KDTreeNode& node = _nodes[nodeIndex];
+            counter.countNode();
+            if (!node.isLeaf()) {
+                uint8_t dimension = node.getSplitDimension();
+                float split = node.getSplitPosition();
+                float origin = ray.origin[dimension];
+                float direction = ray.direction[dimension];
+
+                uint32_t nearChild = nodeIndex + 1;
+                uint32_t farChild = node.getRightChildIndex();
+                if ((origin > split) || ((origin == split) && (direction > 0.0f))) {
+                    std::swap(nearChild, farChild);
+                }
+
+                if (direction == 0.0f) {
+                    if (origin == split) {
+                        // The ray lies in the split plane, so it may touch either side.
+                        stack[stackSize++] = { farChild, entryDistance, exitDistance };
+                    }
+                    nodeIndex = nearChild;
+                    continue;
+                }
+
+                float splitDistance = (split - origin) * slabRay.inverseDirection[dimension];
+                if ((splitDistance > exitDistance) || !(splitDistance > 0.0f)) {
+                    nodeIndex = nearChild;
+                } else if (splitDistance < entryDistance) {
+                    nodeIndex = farChild;
+                } else {
+                    stack[stackSize++] = { farChild, splitDistance, exitDistance };
+                    nodeIndex = nearChild;
+                    exitDistance = splitDistance;
+                }
+                continue;
+            }
+
+            bool isStopped = node.isDeferred()
+                ? getDeferredSubtree(node).traverseRay(ray, maxDistance, counter, visitLeaf)
+                : visitLeaf(*this, node, maxDistance);
+            if (isStopped) {
+                return true;
+            }
+
+            do {
+                if (!stackSize) {
+                    return false;
+                }
+                stackSize--;
+                nodeIndex = stack[stackSize].nodeIndex;
+                entryDistance = stack[stackSize].entryDistance;
+                exitDistance = stack[stackSize].exitDistance;
+            } while (entryDistance > maxDistance);
+        }
+    }
+
+    // Hands each primitive in a region to the visitor once, given tests for whether node boxes and
+    // primitives lie in it. Primitives are visited as their leaves are reached, and the leaves of
+    // subtrees whose boxes lie entirely inside the region are visited without testing their
+    // primitives. The mailbox records the primitives visited so far, including those of any
+    // deferred subtrees the region reaches.
+    template <typename BoxTest, typename PrimitiveTest, typename Visitor>
+    void traverseRegion(BoxTest&& getBoxOverlap, PrimitiveTest&& isPrimitiveInRegion,
+        ExactPrimitiveMailbox& mailbox, KDTreeQueryCounter& counter, Visitor&& visitPrimitive) const
+    {
+        auto visitLeafPrimitives = [this, &mailbox, &visitPrimitive](const KDTreeNode& leaf) {
+            for (auto primitiveIndex : getLeafPrimitives(leaf)) {
+                if (mailbox.add(primitiveIndex)) {
+                    visitPrimitive(primitiveIndex);
+                }
+            }
+        };
+
+        struct StackEntry {
+            uint32_t nodeIndex;
+            AxisAlignedBoundingBox box;
+        };
+        std::array<StackEntry, kMaxKDTreeDepth> stack;
+        size_t stackSize = 0;
+
+        uint32_t nodeIndex = 0;
+        AxisAlignedBoundingBox box = _boundingBox;
+        while (true) {
+            const KDTreeNode& node = _nodes[nodeIndex];
+            counter.countNode();
+            auto overlap = getBoxOverlap(box);
+            if (overlap == RegionOverlap::Inside) {
+                visitSubtreeLeaves(nodeIndex, counter, visitLeafPrimitives);
+            } else if ((overlap == RegionOverlap::Partial) && !node.isLeaf()) {
+                auto [leftBox, rightBox] = box.split(node.getSplitPlane());
+                stack[stackSize++] = { node.getRightChildIndex(), rightBox };
+                nodeIndex++;
+                box = leftBox;
+                continue;
+            } else if ((overlap == RegionOverlap::Partial) && node.isDeferred()) {
+                getDeferredSubtree(node).traverseRegion(
+                    getBoxOverlap, isPrimitiveInRegion, mailbox, counter, visitPrimitive);
+            } else if (overlap == RegionOverlap::Partial) {
+                counter.countTriangles(node.getTriangleCount());
+                for (auto primitiveIndex : getLeafPrimitives(node)) {
+                    if (isPrimitiveInRegion(primitiveIndex) && mailbox.add(primitiveIndex)) {
+                        visitPrimitive(primitiveIndex);
+                    }
+                }
+            }
+
+            if (!stackSize) {
+                return;
+            }
+            stackSize--;
+            nodeIndex = stack[stackSize].nodeIndex;
+            box = stack[stackSize].box;
+        }
+    }
+
+    template <typename LeafVisitor>
+    void visitSubtreeLeaves(
+        uint32_t nodeIndex, KDTreeQueryCounter& counter, LeafVisitor&& visitLeaf) const
+    {
+        std::array<uint32_t, kMaxKDTreeDepth> stack;
+        size_t stackSize = 0;
+        while (true) {
+            const KDTreeNode& node = _nodes[nodeIndex];
+            counter.countNode();
+            if (!node.isLeaf()) {
+                stack[stackSize++] = node.getRightChildIndex();
+                nodeIndex++;
+                continue;
+            }
+
+            visitLeaf(node);
+            if (!stackSize) {
+                return;
+            }
+            nodeIndex = stack[--stackSize];
+        }
+    }
+
+    // Visits the leaves within maxRadius of the point, nearest first. The leaf visitor may shrink
+    // maxRadius as it finds primitives, which prunes every node farther away than that.
+    template <typename LeafVisitor>
+    void traverseNearestLeaves(const glm::vec3& point, float& maxRadius,
+        KDTreeQueryCounter& counter, LeafVisitor&& visitLeaf) const
+    {
+        struct QueueEntry {
+            float distanceSquared;
+            uint32_t nodeIndex;
+            AxisAlignedBoundingBox box;
+        };
+        // Ordered so that the heap keeps the nearest node on top.
+        auto isFarther = [](const QueueEntry& a, const QueueEntry& b) {
+            return a.distanceSquared > b.distanceSquared;
+        };
+        auto isWithinRadius = [&maxRadius](float distanceSquared) {
+            return distanceSquared <= (maxRadius * maxRadius);
+        };
+
+        std::vector<QueueEntry> queue;
+        auto push = [&queue, &point, &isWithinRadius, &isFarther](
+                        uint32_t nodeIndex, const AxisAlignedBoundingBox& box) {
+            float distanceSquared = box.getDistanceSquared(point);
+            if (isWithinRadius(distanceSquared)) {
+                queue.push_back({ distanceSquared, nodeIndex, box });
+                std::push_heap(queue.begin(), queue.end(), isFarther);
+            }
+        };
+
+        push(0, _boundingBox);
+        while (!queue.empty()) {
+            std::pop_heap(queue.begin(), queue.end(), isFarther);
+            QueueEntry entry = queue.back();
+            queue.pop_back();
+            // Everything left in the queue is at least this far away.
+            if (!isWithinRadius(entry.distanceSquared)) {
+                return;
+            }
+
+            const KDTreeNode& node = _nodes[entry.nodeIndex];
+            counter.countNode();
+            if (node.isDeferred()) {
+                getDeferredSubtree(node).traverseNearestLeaves(
+                    point, maxRadius, counter, visitLeaf);
+                continue;
+            }
+            if (node.isLeaf()) {
+                visitLeaf(*this, node, maxRadius);
+                continue;
+            }
+
+            auto [leftBox, rightBox] = entry.box.split(node.getSplitPlane());
+            push(entry.nodeIndex + 1, leftBox);
+            push(node.getRightChildIndex(), rightBox);
+        }
+    }
+
+    // Walks the leaves a moving sphere can touch, in order of when it first reaches them. Each node
+    // is visited over the part of the movement where the sphere overlaps the node's box grown by
+    // the radius. Only the movement up to maxT is followed, and the leaf visitor may shorten maxT
+    // once it finds a hit.
+    template <typename LeafVisitor>
+    void traverseSweptSphere(const Sphere& sphere, const glm::vec3& displacement, float& maxT,
+        KDTreeQueryCounter& counter, LeafVisitor&& visitLeaf) const
+    {
+        // Narrows [entryT, exitT] to the part of the movement where the center stays on the given
+        // side of a bound along one axis.
+        auto clipToBound = [&sphere, &displacement](uint8_t dimension, float bound, bool below,
+                               float& entryT, float& exitT) {
+            float origin = sphere.center[dimension];
+            float direction = below ? displacement[dimension] : -displacement[dimension];
+            float distance = below ? (bound - origin) : (origin - bound);
+            if (direction == 0.0f) {
+                if (distance < 0.0f) {
+                    exitT = -1.0f;
+                }
+            } else if (direction > 0.0f) {
+                exitT = std::min(exitT, distance / direction);
+            } else {
+                entryT = std::max(entryT, distance / direction);
+            }
+            return entryT <= exitT;
+        };
+
+        float entryT = 0.0f;
+        float exitT = maxT;
+        for (uint8_t k = 0; k < 3; k++) {
+            if (!clipToBound(k, _boundingBox.minimum[k] - sphere.radius, false, entryT, exitT)
+                || !clipToBound(k, _boundingBox.maximum[k] + sphere.radius, true, entryT, exitT)) {
+                return;
+            }
+        }
+
+        struct StackEntry {
+            uint32_t nodeIndex;
+            float entryT;
+            float exitT;
+        };
+        std::array<StackEntry, kMaxKDTreeDepth> stack;
+        size_t stackSize = 0;
+
+        uint32_t nodeIndex = 0;
+        while (true) {
+            const KDTreeNode& node = _nodes[nodeIndex];
+            counter.countNode();
+            if (!node.isLeaf()) {
+                uint8_t dimension = node.getSplitDimension();
+                float split = node.getSplitPosition();
+
+                float leftEntryT = entryT;
+                float leftExitT = exitT;
+                bool visitLeft = clipToBound(
+                    dimension, split + sphere.radius, true, leftEntryT, leftExitT);
+                float rightEntryT = entryT;
+                float rightExitT = exitT;
+                bool visitRight = clipToBound(
+                    dimension, split - sphere.radius, false, rightEntryT, rightExitT);
+
+                if (visitLeft && visitRight) {
+                    StackEntry nearChild{ nodeIndex + 1, leftEntryT, leftExitT };
+                    StackEntry farChild{ node.getRightChildIndex(), rightEntryT, rightExitT };
+                    if (farChild.entryT < nearChild.entryT) {
+                        std::swap(nearChild, farChild);
+                    }
+                    stack[stackSize++] = farChild;
+                    nodeIndex = nearChild.nodeIndex;
+                    entryT = nearChild.entryT;
+                    exitT = nearChild.exitT;
+                    continue;
+                }
+                if (visitLeft || visitRight) {
+                    nodeIndex = visitLeft ? nodeIndex + 1 : node.getRightChildIndex();
+                    entryT = visitLeft ? leftEntryT : rightEntryT;
+                    exitT = visitLeft ? leftExitT : rightExitT;
+                    continue;
+                }
+            } else if (node.isDeferred()) {
+                getDeferredSubtree(node).traverseSweptSphere(
+                    sphere, displacement, maxT, counter, visitLeaf);
+            } else {
+                visitLeaf(*this, node, maxT);
+            }
+
+            do {
+                if (!stackSize) {
+                    return;
+                }
+                stackSize--;
+                nodeIndex = stack[stackSize].nodeIndex;
+                entryT = stack[stackSize].entryT;
+                exitT = stack[stackSize].exitT;
+            } while (entryT > maxT);
+        }
+    }
+
+    float getSurfaceAreaCost(uint32_t nodeIndex, const AxisAlignedBoundingBox& box) const
+    {
+        const KDTreeNode& node = _nodes[nodeIndex];
+        if (node.isLeaf()) {
+            return static_cast<float>(getLeafPrimitives(node).size()) * kKDTreeIntersectionCost;
+        }
+
+        auto [leftBox, rightBox] = box.split(node.getSplitPlane());
+        float leftCost = getSurfaceAreaCost(nodeIndex + 1, leftBox);
+        float rightCost = getSurfaceAreaCost(node.getRightChildIndex(), rightBox);
+
+        float boxSurfaceArea = box.getSurfaceArea();
+        if (!(boxSurfaceArea > 0.0f)) {
+            return kKDTreeTraversalCost + leftCost + rightCost;
+        }
+        return kKDTreeTraversalCost
+            + ((leftBox.getSurfaceArea() * leftCost) + (rightBox.getSurfaceArea() * rightCost))
+            / boxSurfaceArea;
+    }
+
+    // The primitives of a leaf. Deferred leaves hold all the primitives of their subtree.
+    gsl::span<const uint32_t> getLeafPrimitives(const KDTreeNode& leaf) const
+    {
+        if (leaf.isDeferred()) {
+            const auto& subtree = *_deferredSubtrees[leaf.getDeferredSubtreeIndex()];
+            return { _primitiveIndices.data() + subtree.firstPrimitive, subtree.primitiveCount };
+        }
+        return { _primitiveIndices.data() + leaf.getFirstTriangle(), leaf.getTriangleCount() };
+    }
+
+    // Returns the subtree behind a deferred leaf, building it if no query has reached it yet.
+    // Concurrent queries that reach it at the same time wait for a single build.
+    const KDTreeNodes& getDeferredSubtree(const KDTreeNode& leaf) const
+    {
+        auto& subtree = *_deferredSubtrees[leaf.getDeferredSubtreeIndex()];
+        std::call_once(subtree.buildFlag, [this, &leaf, &subtree]() {
+            subtree.tree = _buildSubtree(*this, getLeafPrimitives(leaf), subtree.box);
+        });
+        return *subtree.tree;
+    }
+
+    void setSubtreeBuilder(SubtreeBuilder buildSubtree)
+    {
+        Expects(_deferredSubtrees.empty() || buildSubtree);
+        _buildSubtree = std::move(buildSubtree);
+    }
+
+    template <typename Primitive>
+    void flattenNode(const MapNode<Primitive>& node,
+        const std::unordered_map<const Primitive*, uint32_t>& primitiveIndices, size_t depth,
+        std::vector<KDTreeNode>& nodes, std::vector<uint32_t>& leafIndices)
+    {
+        Expects(depth < kMaxKDTreeDepth);
+        std::visit(
+            [this, &primitiveIndices, depth, &nodes, &leafIndices](const auto& node) {
+                flattenNode(node, primitiveIndices, depth, nodes, leafIndices);
+            },
+            node);
+    }
+
+    template <typename Primitive>
+    void flattenNode(const LeafNode<Primitive>& node,
+        const std::unordered_map<const Primitive*, uint32_t>& primitiveIndices, size_t,
+        std::vector<KDTreeNode>& nodes, std::vector<uint32_t>& leafIndices)
+    {
+        auto firstPrimitive = static_cast<uint32_t>(leafIndices.size());
+        for (const auto& primitive : node.primitives) {
+            leafIndices.push_back(primitiveIndices.at(primitive));
+        }
+        // Keep leaf contents in memory order rather than hash order.
+        std::sort(leafIndices.begin() + firstPrimitive, leafIndices.end());
+
+        auto primitiveCount = static_cast<uint32_t>(leafIndices.size()) - firstPrimitive;
+        if (!node.deferredBox) {
+            nodes.push_back(KDTreeNode::makeLeaf(firstPrimitive, primitiveCount));
+            return;
+        }
+
+        auto subtree = std::make_unique<DeferredSubtree>();
+        subtree->firstPrimitive = firstPrimitive;
+        subtree->primitiveCount = primitiveCount;
+        subtree->box = *node.deferredBox;
+        nodes.push_back(
+            KDTreeNode::makeDeferredLeaf(static_cast<uint32_t>(_deferredSubtrees.size())));
+        _deferredSubtrees.push_back(std::move(subtree));
+    }
+
+    template <typename Primitive>
+    void flattenNode(const BranchNode<Primitive>& node,
+        const std::unordered_map<const Primitive*, uint32_t>& primitiveIndices, size_t depth,
+        std::vector<KDTreeNode>& nodes, std::vector<uint32_t>& leafIndices)
+    {
+        size_t nodeIndex = nodes.size();
+        nodes.emplace_back();
+        flattenNode(*node.left, primitiveIndices, depth + 1, nodes, leafIndices);
+
+        auto rightChildIndex = static_cast<uint32_t>(nodes.size());
+        flattenNode(*node.right, primitiveIndices, depth + 1, nodes, leafIndices);
+        nodes[nodeIndex] = KDTreeNode::makeBranch(node.split, rightChildIndex);
+    }
+
+    struct DeferredSubtree {
+        // The subtree's primitives, as a range of the primitive index array.
+        uint32_t firstPrimitive;
+        uint32_t primitiveCount;
+        AxisAlignedBoundingBox box;
+        std::once_flag buildFlag;
+        std::shared_ptr<const KDTreeNodes> tree;
+    };
+
+    gsl::span<const KDTreeNode> _nodes;
+    // Each leaf's primitives, in leaf order. Primitives that straddle a split appear once for
+    // every leaf they're in, so each leaf's copies are contiguous.
+    gsl::span<const uint32_t> _primitiveIndices;
+    AxisAlignedBoundingBox _boundingBox;
+    size_t _primitiveCount = 0;
+    std::chrono::duration<double> _buildTime{};
+    // Kept behind a pointer so the tree stays movable.
+    std::unique_ptr<KDTreeQueryStatsTotals> _queryStats
+        = std::make_unique<KDTreeQueryStatsTotals>();
+    std::vector<std::unique_ptr<DeferredSubtree>> _deferredSubtrees;
+    SubtreeBuilder _buildSubtree;
+};
+
+// A tree over any kind of primitive, such as particle spheres, light volumes or instance boxes.
+// Primitives provide:
+//
+//   AxisAlignedBoundingBox getBoundingBox() const;
+//   // The bounds of the part of the primitive inside the box, if any of it is.
+//   std::optional<AxisAlignedBoundingBox> clippedBoundingBox(const AxisAlignedBoundingBox&) const;
+//   // A hit holds at least the distance t along the ray.
+//   std::optional<Hit> castRay(const Ray&) const;
+//   // Anything that converts to true if the primitive reaches into the sphere.
+//   intersectsSphere(const Sphere&) const;
+//
+// KDTree is this tree over triangles, with packed leaves that rays are tested against several
+// triangles at a time.
+template <typename Primitive>
+class BasicKDTree : public KDTreeNodes {
+public:
+    using PrimitiveHit = typename decltype(
+        std::declval<const Primitive&>().castRay(std::declval<const Ray&>()))::value_type;
+
+    // Takes the tree a builder has made. The build time reported in the build stats runs from
+    // buildStart until the tree is ready. Trees with deferred leaves need buildSubtree to build
+    // them.
+    BasicKDTree(std::vector<std::unique_ptr<Primitive>> primitives,
+        std::unique_ptr<MapNode<Primitive>> root, const AxisAlignedBoundingBox boundingBox,
+        std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now(),
+        SubtreeBuilder buildSubtree = {})
+    {
+        auto primitiveIndices = indexPrimitives(primitives);
+        auto storage = std::make_shared<OwnedArrays>();
+        storage->primitives.reserve(primitives.size());
+        for (auto& primitive : primitives) {
+            storage->primitives.push_back(std::move(*primitive));
+        }
+        gsl::span<Primitive> storedPrimitives = storage->primitives;
+        initialize(std::move(storage), storedPrimitives, *root, primitiveIndices, boundingBox);
+        setSubtreeBuilder(std::move(buildSubtree));
+        _buildTime = std::chrono::steady_clock::now() - buildStart;
+    }
+
+    // Takes the subtree a builder has made for one of the parent's deferred leaves. The
+    // primitives are copies of the parent's, listed in the same order as their indices in the
+    // parent, which the subtree shares rather than keeping primitives of its own.
+    BasicKDTree(const BasicKDTree& parent, gsl::span<const uint32_t> parentIndices,
+        const std::vector<std::unique_ptr<Primitive>>& primitives,
+        const MapNode<Primitive>& root, const AxisAlignedBoundingBox& boundingBox)
+    {
+        Expects(static_cast<size_t>(parentIndices.size()) == primitives.size());
+        std::unordered_map<const Primitive*, uint32_t> primitiveIndices;
+        for (size_t i = 0; i < primitives.size(); i++) {
+            primitiveIndices.emplace(primitives[i].get(), parentIndices[i]);
+        }
+        initialize(std::make_shared<OwnedArrays>(), parent._primitives, root, primitiveIndices,
+            boundingBox);
+    }
+
+    // Uses arrays that another tree was built into, which storage keeps alive.
+    BasicKDTree(gsl::span<Primitive> primitives, gsl::span<const KDTreeNode> nodes,
+        gsl::span<const uint32_t> primitiveIndices, const AxisAlignedBoundingBox& boundingBox,
+        std::shared_ptr<void> storage)
+        : _primitives(primitives)
+        , _storage(std::move(storage))
+    {
+        setNodes(nodes, primitiveIndices, boundingBox, static_cast<size_t>(primitives.size()));
+    }
+
+    BasicKDTree(const BasicKDTree&) = delete;
+    BasicKDTree(BasicKDTree&&) = default;
+    BasicKDTree& operator=(const BasicKDTree&) = delete;
+    BasicKDTree& operator=(BasicKDTree&&) = default;
+
+    size_t getPrimitiveCount() const { return static_cast<size_t>(_primitives.size()); }
+    Primitive& getPrimitive(size_t index) const { return _primitives[index]; }
+
+    struct Hit {
+        Primitive* primitive;
+        PrimitiveHit hit;
+    };
+
+    std::optional<Hit> castRay(
+        const Ray& ray, float maxDistance = std::numeric_limits<float>::infinity()) const
+    {
+        KDTreeQueryCounter counter;
+        auto hit = findHit(ray, maxDistance, false, counter);
+        counter.countHits(hit.has_value());
+        _queryStats->add(counter);
+        return hit;
+    }
+
+    // Finds out whether anything lies within maxDistance along the ray, stopping at the first hit.
+    bool occluded(const Ray& ray, float maxDistance) const
+    {
+        KDTreeQueryCounter counter;
+        bool isOccluded = findHit(ray, maxDistance, true, counter).has_value();
+        counter.countHits(isOccluded);
+        _queryStats->add(counter);
+        return isOccluded;
+    }
+
+    // Visits each primitive that reaches into the sphere once.
+    template <typename Visitor>
+    void visitPrimitivesIntersectingSphere(const Sphere& sphere, Visitor&& visitor) const
+    {
+        visitPrimitivesInRegion(
+            [&sphere](const AxisAlignedBoundingBox& box) { return box.getOverlap(sphere); },
+            [&sphere](const Primitive& primitive) {
+                return static_cast<bool>(primitive.intersectsSphere(sphere));
+            },
+            std::forward<Visitor>(visitor));
+    }
+
+    // Visits each primitive that intersects the box once.
+    template <typename Visitor>
+    void visitPrimitivesInBox(const AxisAlignedBoundingBox& box, Visitor&& visitor) const
+    {
+        visitPrimitivesInRegion(
+            [&box](const AxisAlignedBoundingBox& nodeBox) { return nodeBox.getOverlap(box); },
+            [&box](const Primitive& primitive) {
+                return (primitive.getBoundingBox().getOverlap(box) != RegionOverlap::Outside)
+                    && primitive.clippedBoundingBox(box).has_value();
+            },
+            std::forward<Visitor>(visitor));
+    }
+
+protected:
+    // Visits each primitive in a region once, in the order their leaves are reached.
+    template <typename BoxTest, typename PrimitiveTest, typename Visitor>
+    void visitPrimitivesInRegion(
+        BoxTest&& getBoxOverlap, PrimitiveTest&& isPrimitiveInRegion, Visitor&& visitor) const
+    {
+        ExactPrimitiveMailbox mailbox;
+        KDTreeQueryCounter counter;
+        size_t visitedCount = 0;
+        traverseRegion(
+            getBoxOverlap,
+            [this, &isPrimitiveInRegion](uint32_t primitiveIndex) {
+                return isPrimitiveInRegion(_primitives[primitiveIndex]);
+            },
+            mailbox, counter,
+            [this, &visitor, &visitedCount](uint32_t primitiveIndex) {
+                visitedCount++;
+                visitor(_primitives[primitiveIndex]);
+            });
+        counter.countHits(visitedCount);
+        _queryStats->add(counter);
+    }
+
+    // Queries hand out mutable primitives so that callers can update them.
+    gsl::span<Primitive> _primitives;
+
+private:
+    std::optional<Hit> findHit(
+        const Ray& ray, float maxDistance, bool anyHit, KDTreeQueryCounter& counter) const
+    {
+        std::optional<Hit> bestHit;
+        PrimitiveMailbox mailbox;
+        traverseRay(ray, maxDistance, counter,
+            [this, &ray, anyHit, &bestHit, &mailbox, &counter](
+                const KDTreeNodes& tree, const KDTreeNode& leaf, float& maxDistance) {
+                auto& leafTree = static_cast<const BasicKDTree&>(tree);
+                for (auto primitiveIndex : leafTree.getLeafPrimitives(leaf)) {
+                    if (!mailbox.add(primitiveIndex)) {
+                        continue;
+                    }
+                    counter.countTriangles(1);
+                    auto& primitive = _primitives[primitiveIndex];
+                    auto hit = primitive.castRay(ray);
+                    if (hit && !(hit->t > maxDistance)) {
+                        bestHit = Hit{ &primitive, *hit };
+                        if (anyHit) {
+                            return true;
+                        }
+                        maxDistance = hit->t;
+                    }
+                }
+                return false;
+            });
+        return bestHit;
+    }
+
+    struct OwnedArrays {
+        std::vector<Primitive> primitives;
+        std::vector<KDTreeNode> nodes;
+        std::vector<uint32_t> primitiveIndices;
+    };
+
+    void initialize(std::shared_ptr<OwnedArrays> storage, gsl::span<Primitive> primitives,
+        const MapNode<Primitive>& root,
+        const std::unordered_map<const Primitive*, uint32_t>& primitiveIndices,
+        const AxisAlignedBoundingBox& boundingBox)
     {
-        glm::vec3 v0 = vertices[1] - vertices[0];
-        glm::vec3 v1 = vertices[2] - vertices[0];
-        glm::vec3 v2 = position - vertices[0];
+        flattenTree(root, primitiveIndices, storage->nodes, storage->primitiveIndices);
+        setNodes(storage->nodes, storage->primitiveIndices, boundingBox,
+            static_cast<size_t>(primitives.size()));
+        _primitives = primitives;
+        _storage = std::move(storage);
+    }
 
-        float d00 = glm::dot(v0, v0);
-        float d01 = glm::dot(v0, v1);
-        float d11 = glm::dot(v1, v1);
-        float d20 = glm::dot(v2, v0);
-        float d21 = glm::dot(v2, v1);
-        float denom = d00 * d11 - d01 * d01;
+    // Keeps the primitives and the nodes alive. Subtrees share their parent's primitives.
+    std::shared_ptr<void> _storage;
+};
 
-        float v = (d11 * d20 - d01 * d21) / denom;
-        float w = (d00 * d21 - d01 * d20) / denom;
-        float u = 1.0f - v - w;
+// A tree over triangles. This is the BasicKDTree over them, whose leaves also keep packed copies
+// of their triangles that rays are tested against several at a time. Surface data is only needed
+// once a triangle has been hit, so the triangles themselves are kept apart from the packed copies.
+template <typename SurfaceData>
+class KDTree : public BasicKDTree<Triangle<SurfaceData>> {
+    using Base = BasicKDTree<Triangle<SurfaceData>>;
 
-        return { u, v };
+public:
+    // Takes the tree a builder has made. The build time reported in the build stats runs from
+    // buildStart until the tree is ready. Trees with deferred leaves need buildSubtree to build
+    // them.
+    KDTree(std::vector<std::unique_ptr<Triangle<SurfaceData>>> triangles,
+        std::unique_ptr<MapNode<Triangle<SurfaceData>>> root,
+        const AxisAlignedBoundingBox boundingBox,
+        std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now(),
+        KDTreeNodes::SubtreeBuilder buildSubtree = {})
+        : Base(std::move(triangles), std::move(root), boundingBox, buildStart,
+            std::move(buildSubtree))
+    {
+        packLeafTriangles();
+        _buildTime = std::chrono::steady_clock::now() - buildStart;
     }
 
-    std::optional<float> intersectsSphere(const Sphere& sphere)
+    // Takes the subtree a builder has made for one of the parent's deferred leaves, which shares
+    // the parent's triangles.
+    KDTree(const KDTree& parent, gsl::span<const uint32_t> parentIndices,
+        const std::vector<std::unique_ptr<Triangle<SurfaceData>>>& triangles,
+        const MapNode<Triangle<SurfaceData>>& root, const AxisAlignedBoundingBox& boundingBox)
+        : Base(parent, parentIndices, triangles, root, boundingBox)
     {
-        glm::vec3 normal = getNormal();
-        float t = glm::dot(normal, (vertices[0] - sphere.center));
-        if (sphere.radius < abs(t)) {
-            // Closest point to the triangle is outside the sphere.
-            return std::nullopt;
-        }
-
-        glm::vec3 closestPoint = sphere.center - (normal * t);
-        glm::vec2 cpBary = cartesianToBarycentric(closestPoint);
-        size_t outsideCount = 0;
-        glm::bvec3 isOutside{};
-        if (cpBary[0] < 0.0f) {
-            outsideCount++;
-            isOutside[0] = true;
-        }
+        packLeafTriangles();
+    }
 
-        if (cpBary[1] < 0.0f) {
-            outsideCount++;
-            isOutside[1] = true;
-        }
+    // Uses arrays that another tree was built into, which storage keeps alive.
+    KDTree(const KDTreeArrays<SurfaceData>& arrays, std::shared_ptr<void> storage)
+        : Base(arrays.triangles, arrays.nodes, arrays.triangleIndices, arrays.boundingBox,
+            std::move(storage))
+    {
+        setLeafTriangles(arrays.leafTriangles);
+    }
 
-        if ((1.0f - (cpBary[0] + cpBary[1])) < 0.0f) {
-            outsideCount++;
-            isOutside[2] = true;
-        }
+    KDTree(const KDTree&) = delete;
+    KDTree(KDTree&&) = default;
+    KDTree& operator=(const KDTree&) = delete;
+    KDTree& operator=(KDTree&&) = default;
 
-        if (outsideCount == 0) {
-            // Closest point is inside the triangle and inside the sphere.
-            return t;
-        }
+    KDTreeArrays<SurfaceData> getArrays() const
+    {
+        return { _primitives, _nodes, _primitiveIndices, _leafTriangleComponents, _boundingBox };
+    }
 
-        // Calculate the square of the radius of the cross section of the sphere passing through
-        // the triangle's plane.
-        float r2 = (sphere.radius * sphere.radius) - (t * t);
+    struct Hit {
+        Triangle<SurfaceData>* triangle;
+        glm::vec2 uv;
+        float t;
+    };
 
-        if (outsideCount == 1) {
-            // We need to find the distance to the edge (squared) here.
-            glm::vec3 edge;
-            glm::vec3 toVertex;
-            if (isOutside[0]) {
-                edge = vertices[2] - vertices[1];
-                toVertex = closestPoint - vertices[1];
-            } else if (isOutside[1]) {
-                edge = vertices[2] - vertices[0];
-                toVertex = closestPoint - vertices[0];
-            } else {
-                edge = vertices[1] - vertices[0];
-                toVertex = closestPoint - vertices[0];
-            }
+    std::optional<Hit> castRay(
+        const Ray& ray, float maxDistance = std::numeric_limits<float>::infinity()) const
+    {
+        KDTreeQueryCounter counter;
+        auto hit = findClosestHit(ray, maxDistance, counter);
+        counter.countHits(hit.has_value());
+        _queryStats->add(counter);
+        return hit;
+    }
 
-            float toVertexLength = glm::length(toVertex);
-            float legLength = glm::dot(edge, toVertex) / toVertexLength;
+    // Finds out whether anything lies within maxDistance along the ray. This stops at the first
+    // hit it finds rather than looking for the closest one, which makes it the cheaper choice
+    // for line of sight and shadow tests.
+    bool occluded(const Ray& ray, float maxDistance) const
+    {
+        KDTreeQueryCounter counter;
+        bool isOccluded = findAnyHit(ray, maxDistance, counter).has_value();
+        counter.countHits(isOccluded);
+        _queryStats->add(counter);
+        return isOccluded;
+    }
 
-            return ((toVertexLength * toVertexLength) - (legLength * legLength)) < r2;
-        }
+    // Casts several rays through the tree together, testing each node and triangle against all of
+    // them at once. This pays off for coherent rays, like a grid of picking rays or probes fanned
+    // out from one origin. Rays whose directions don't share a sign along every axis can't share
+    // a traversal order, so they fall back to being cast one at a time.
+    template <size_t Width>
+    std::array<std::optional<Hit>, Width> castRayPacket(const std::array<Ray, Width>& rays,
+        float maxDistance = std::numeric_limits<float>::infinity()) const
+    {
+        KDTreeQueryCounter counter(Width);
+        auto hits = tracePacket<HitMode::Closest>(rays, maxDistance, counter);
+        counter.countHits(std::count_if(
+            hits.begin(), hits.end(), [](const auto& hit) { return hit.has_value(); }));
+        _queryStats->add(counter);
+        return hits;
+    }
 
-        // Otherwise, one of the vertices is actually the closest point on the triangle.
-        glm::vec3 toVertex;
-        if (!isOutside[0]) {
-            toVertex = closestPoint - vertices[0];
-        } else if (!isOutside[1]) {
-            toVertex = closestPoint - vertices[1];
-        } else {
-            toVertex = closestPoint - vertices[2];
+    // The packet version of occluded.
+    template <size_t Width>
+    std::array<bool, Width> occludedPacket(
+        const std::array<Ray, Width>& rays, float maxDistance) const
+    {
+        KDTreeQueryCounter counter(Width);
+        auto hits = tracePacket<HitMode::Any>(rays, maxDistance, counter);
+        std::array<bool, Width> occluded;
+        for (size_t i = 0; i < Width; i++) {
+            occluded[i] = hits[i].has_value();
+            counter.countHits(occluded[i]);
         }
+        _queryStats->add(counter);
+        return occluded;
+    }
 
-        return glm::dot(toVertex, toVertex) < r2;
+    // Casts a batch of rays, writing the closest hit of each ray into hits. Neighboring rays are
+    // traced together as packets, so batches benefit from being ordered coherently.
+    void castRays(gsl::span<const Ray> rays, gsl::span<std::optional<Hit>> hits,
+        float maxDistance = std::numeric_limits<float>::infinity()) const
+    {
+        Expects(rays.size() == hits.size());
+        castRayRange(rays, hits, maxDistance, 0, static_cast<size_t>(rays.size()));
     }
-};
 
-template <typename SurfaceData>
-struct LeafNode {
-    std::unordered_set<Triangle<SurfaceData>*> triangles;
-};
+    // Like castRays above, but splits large batches across the worker pool. Small batches are
+    // still cast on the calling thread.
+    void castRays(WorkerPool& pool, gsl::span<const Ray> rays, gsl::span<std::optional<Hit>> hits,
+        float maxDistance = std::numeric_limits<float>::infinity()) const
+    {
+        Expects(rays.size() == hits.size());
+        parallelFor(pool, static_cast<size_t>(rays.size()), kRayBatchGrainSize,
+            [this, rays, hits, maxDistance](size_t begin, size_t end) {
+                castRayRange(rays, hits, maxDistance, begin, end);
+            });
+    }
 
-template <typename SurfaceData>
-struct BranchNode;
+    // Finds out whether anything lies within maxDistance along each of a batch of rays.
+    void castOcclusionRays(gsl::span<const Ray> rays, gsl::span<bool> occluded,
+        float maxDistance = std::numeric_limits<float>::infinity()) const
+    {
+        Expects(rays.size() == occluded.size());
+        castOcclusionRayRange(rays, occluded, maxDistance, 0, static_cast<size_t>(rays.size()));
+    }
 
-template <typename SurfaceData>
-using MapNode = std::variant<LeafNode<SurfaceData>, BranchNode<SurfaceData>>;
+    void castOcclusionRays(WorkerPool& pool, gsl::span<const Ray> rays, gsl::span<bool> occluded,
+        float maxDistance = std::numeric_limits<float>::infinity()) const
+    {
+        Expects(rays.size() == occluded.size());
+        parallelFor(pool, static_cast<size_t>(rays.size()), kRayBatchGrainSize,
+            [this, rays, occluded, maxDistance](size_t begin, size_t end) {
+                castOcclusionRayRange(rays, occluded, maxDistance, begin, end);
+            });
+    }
 
-template <typename SurfaceData>
-struct BranchNode {
-    AxisAlignedPlane split;
+    // Visits each triangle that reaches into the sphere once, along with the distance from the
+    // sphere's center to the triangle's plane.
+    template <typename Visitor>
+    void visitTrianglesIntersectingSphere(const Sphere& sphere, Visitor&& visitor) const
+    {
+        this->visitPrimitivesIntersectingSphere(
+            sphere, [&sphere, &visitor](Triangle<SurfaceData>& triangle) {
+                visitor(triangle,
+                    glm::dot(triangle.getNormal(), triangle.vertices[0] - sphere.center));
+            });
+    }
 
-    std::unique_ptr<MapNode<SurfaceData>> left;
-    std::unique_ptr<MapNode<SurfaceData>> right;
-};
+    // Visits each triangle that may lie in the convex region on the inner side of all the planes,
+    // such as a view frustum, once. Triangles are only rejected when all their vertices lie
+    // outside one plane, so some near the region's edges are visited although they're outside.
+    template <typename Visitor>
+    void visitTrianglesInFrustum(gsl::span<const Plane> planes, Visitor&& visitor) const
+    {
+        this->visitPrimitivesInRegion(
+            [planes](const AxisAlignedBoundingBox& box) { return box.getOverlap(planes); },
+            [planes](Triangle<SurfaceData>& triangle) {
+                for (const auto& plane : planes) {
+                    auto isOutside = [&plane](const glm::vec3& vertex) {
+                        return plane.getSignedDistance(vertex) < 0.0f;
+                    };
+                    const auto& vertices = triangle.vertices;
+                    if (std::all_of(vertices.begin(), vertices.end(), isOutside)) {
+                        return false;
+                    }
+                }
+                return true;
+            },
+            std::forward<Visitor>(visitor));
+    }
 
-template <typename SurfaceData>
-class KDTree {
-public:
-    KDTree(std::vector<std::unique_ptr<Triangle<SurfaceData>>> triangles,
-        std::unique_ptr<MapNode<SurfaceData>> root, const AxisAlignedBoundingBox boundingBox)
-        : _triangles(std::move(triangles))
-        , _root(std::move(root))
-        , _boundingBox(boundingBox)
+    // Visits each triangle that intersects the box once.
+    template <typename Visitor>
+    void visitTrianglesInBox(const AxisAlignedBoundingBox& box, Visitor&& visitor) const
     {
+        this->visitPrimitivesInBox(box, std::forward<Visitor>(visitor));
     }
 
-    struct Hit {
+    struct NearestTriangle {
         Triangle<SurfaceData>* triangle;
-        glm::vec2 uv;
-        float t;
+        // The point of the triangle closest to the query point.
+        glm::vec3 point;
+        float distance;
     };
 
-    std::optional<Hit> castRay(
-        const Ray& ray, float maxDistance = std::numeric_limits<float>::infinity()) const
+    // Finds the point of the tree's surface closest to the given point, looking no farther than
+    // maxRadius.
+    std::optional<NearestTriangle> closestPoint(const glm::vec3& point,
+        float maxRadius = std::numeric_limits<float>::infinity()) const
     {
-        if (_boundingBox.containsPoint(ray.origin)) {
-            AxisAlignedBoundingBox::Hit entryPoint{ ray.origin, 0.0f, 0 };
-            return getHit(*_root, ray, _boundingBox, entryPoint, maxDistance);
-        } else {
-            auto hit = _boundingBox.castExternalRay(ray);
-            if (!hit || (hit->t > maxDistance)) {
-                return std::nullopt;
-            }
-            return getHit(*_root, ray, _boundingBox, *hit, maxDistance);
+        std::optional<NearestTriangle> closest;
+        PrimitiveMailbox mailbox;
+        KDTreeQueryCounter counter;
+        traverseNearestLeaves(point, maxRadius, counter,
+            [this, &point, &closest, &mailbox, &counter](
+                const KDTreeNodes& tree, const KDTreeNode& leaf, float& maxRadius) {
+                for (auto triangleIndex : asKDTree(tree).getLeafPrimitives(leaf)) {
+                    if (!mailbox.add(triangleIndex)) {
+                        continue;
+                    }
+                    counter.countTriangles(1);
+                    auto& triangle = _primitives[triangleIndex];
+                    glm::vec3 candidate = triangle.getClosestPoint(point);
+                    float distance = glm::length(candidate - point);
+                    if ((distance <= maxRadius) && (!closest || (distance < closest->distance))) {
+                        closest = NearestTriangle{ &triangle, candidate, distance };
+                        maxRadius = distance;
+                    }
+                }
+            });
+        counter.countHits(closest.has_value());
+        _queryStats->add(counter);
+        return closest;
+    }
+
+    // Finds up to count triangles within maxRadius of the point, nearest first.
+    std::vector<NearestTriangle> kNearestTriangles(const glm::vec3& point, size_t count,
+        float maxRadius = std::numeric_limits<float>::infinity()) const
+    {
+        auto isNearer = [](const NearestTriangle& a, const NearestTriangle& b) {
+            return a.distance < b.distance;
+        };
+
+        // Kept as a heap with the farthest triangle on top, which is the one the next nearer
+        // triangle replaces.
+        std::vector<NearestTriangle> nearest;
+        if (!count) {
+            return nearest;
         }
+        nearest.reserve(count);
+        PrimitiveMailbox mailbox;
+        KDTreeQueryCounter counter;
+        traverseNearestLeaves(point, maxRadius, counter,
+            [this, &point, count, &nearest, &isNearer, &mailbox, &counter](
+                const KDTreeNodes& tree, const KDTreeNode& leaf, float& maxRadius) {
+                for (auto triangleIndex : asKDTree(tree).getLeafPrimitives(leaf)) {
+                    if (!mailbox.add(triangleIndex)) {
+                        continue;
+                    }
+                    counter.countTriangles(1);
+                    auto& triangle = _primitives[triangleIndex];
+                    glm::vec3 candidate = triangle.getClosestPoint(point);
+                    float distance = glm::length(candidate - point);
+                    bool isFull = nearest.size() == count;
+                    if ((distance > maxRadius) || (isFull && !(distance < maxRadius))) {
+                        continue;
+                    }
+                    // The mailbox can forget triangles, so duplicates still have to be caught.
+                    auto isSame = [&triangle](const NearestTriangle& other) {
+                        return other.triangle == &triangle;
+                    };
+                    if (std::any_of(nearest.begin(), nearest.end(), isSame)) {
+                        continue;
+                    }
+
+                    if (isFull) {
+                        std::pop_heap(nearest.begin(), nearest.end(), isNearer);
+                        nearest.pop_back();
+                    }
+                    nearest.push_back({ &triangle, candidate, distance });
+                    std::push_heap(nearest.begin(), nearest.end(), isNearer);
+                    if (nearest.size() == count) {
+                        maxRadius = nearest.front().distance;
+                    }
+                }
+            });
+
+        std::sort_heap(nearest.begin(), nearest.end(), isNearer);
+        counter.countHits(nearest.size());
+        _queryStats->add(counter);
+        return nearest;
     }
 
-    template <typename Visitor>
-    void visitTrianglesIntersectingSphere(const Sphere& sphere, Visitor&& visitor) const
+    struct SphereHit {
+        Triangle<SurfaceData>* triangle;
+        // The fraction of the displacement travelled before touching the triangle.
+        float t;
+        glm::vec3 point;
+        // The triangle's normal, turned to face the sphere.
+        glm::vec3 normal;
+    };
+
+    // Moves a sphere along the displacement and finds the first triangle it touches. Nodes are
+    // pruned against the volume the sphere sweeps out, so this costs little more than a ray cast.
+    std::optional<SphereHit> sweepSphere(const Sphere& sphere, const glm::vec3& displacement) const
     {
-        std::visit(
-            [this, &sphere, &visitor](const auto& node) {
-                visitTrianglesIntersectingSphereInNode(
-                    sphere, std::forward<Visitor>(visitor), _boundingBox, node);
-            },
-            *_root);
+        std::optional<SphereHit> bestHit;
+        PrimitiveMailbox mailbox;
+        KDTreeQueryCounter counter;
+        float maxT = 1.0f;
+        traverseSweptSphere(sphere, displacement, maxT, counter,
+            [this, &sphere, &displacement, &bestHit, &mailbox, &counter](
+                const KDTreeNodes& tree, const KDTreeNode& leaf, float& maxT) {
+                for (auto triangleIndex : asKDTree(tree).getLeafPrimitives(leaf)) {
+                    if (!mailbox.add(triangleIndex)) {
+                        continue;
+                    }
+                    counter.countTriangles(1);
+                    auto& triangle = _primitives[triangleIndex];
+                    auto hit = triangle.sweepSphere(sphere, displacement, maxT);
+                    if (hit && (!bestHit || (hit->t < bestHit->t))) {
+                        bestHit = SphereHit{ &triangle, hit->t, hit->point, triangle.getNormal() };
+                        maxT = hit->t;
+                    }
+                }
+            });
+
+        if (bestHit) {
+            glm::vec3 center = sphere.center + (displacement * bestHit->t);
+            if (glm::dot(bestHit->normal, center - bestHit->point) < 0.0f) {
+                bestHit->normal = -bestHit->normal;
+            }
+        }
+        counter.countHits(bestHit.has_value());
+        _queryStats->add(counter);
+        return bestHit;
     }
 
     void dump() const
     {
         std::cout << "[KDTree]{" << std::endl;
         printBoundingBox(_boundingBox, 2);
-        std::visit([this](const auto& root) { printNode(_boundingBox, root, 2); }, *_root);
+        printNode(_boundingBox, 0, 2);
         std::cout << "}" << std::endl;
     }
 
 private:
-    std::optional<Hit> getHit(const MapNode<SurfaceData>& node, const Ray& ray,
-        const AxisAlignedBoundingBox& box, AxisAlignedBoundingBox::Hit& entryPoint,
-        float maxDistance) const
+    using Base::_primitives;
+    using KDTreeNodes::_boundingBox;
+    using KDTreeNodes::_buildTime;
+    using KDTreeNodes::_nodes;
+    using KDTreeNodes::_primitiveIndices;
+    using KDTreeNodes::_queryStats;
+    using KDTreeNodes::getDeferredSubtree;
+    using KDTreeNodes::getLeafPrimitives;
+    using KDTreeNodes::traverseNearestLeaves;
+    using KDTreeNodes::traverseRay;
+    using KDTreeNodes::traverseSweptSphere;
+
+    void packLeafTriangles()
     {
-        return std::visit(
-            [this, &ray, &box, &entryPoint, maxDistance](
-                const auto& node) { return getHit(node, ray, box, entryPoint, maxDistance); },
-            node);
+        std::vector<std::array<glm::vec3, 3>> leafTriangles;
+        leafTriangles.reserve(static_cast<size_t>(_primitiveIndices.size()));
+        for (auto triangleIndex : _primitiveIndices) {
+            leafTriangles.push_back(_primitives[triangleIndex].vertices);
+        }
+        auto storage = std::make_shared<std::vector<float>>(PackedTriangles::pack(leafTriangles));
+        setLeafTriangles(*storage);
+        _leafTriangleStorage = std::move(storage);
     }
 
-    std::optional<Hit> getHit(const BranchNode<SurfaceData>& node, const Ray& ray,
-        const AxisAlignedBoundingBox& box, AxisAlignedBoundingBox::Hit& entryPoint,
-        float maxDistance) const
-    {
-        auto [leftBox, rightBox] = box.split(node.split);
-        float position = entryPoint.intersectionPoint[node.split.dimensionIndex];
-        bool goLeft;
-        if (position < node.split.boundary) {
-            goLeft = true;
-        } else if (position > node.split.boundary) {
-            goLeft = false;
-        } else if (ray.direction[node.split.dimensionIndex] < 0.0f) {
-            goLeft = false;
-        } else if (ray.direction[node.split.dimensionIndex] > 0.0f) {
-            goLeft = true;
-        } else {
-            return std::nullopt;
-        }
+    void setLeafTriangles(gsl::span<const float> leafTriangles)
+    {
+        _leafTriangleComponents = leafTriangles;
+        _leafTriangles
+            = PackedTriangles(leafTriangles, static_cast<size_t>(_primitiveIndices.size()));
+    }
+
+    // The trees that traversals hand to leaf visitors are this one and its subtrees, which are
+    // all KDTrees.
+    static const KDTree& asKDTree(const KDTreeNodes& tree)
+    {
+        return static_cast<const KDTree&>(tree);
+    }
+
+    enum class HitMode {
+        Closest,
+        Any,
+    };
+
+    std::optional<Hit> findClosestHit(
+        const Ray& ray, float maxDistance, KDTreeQueryCounter& counter) const
+    {
+        std::optional<Hit> bestHit;
+        PrimitiveMailbox mailbox;
+        traverseRay(ray, maxDistance, counter,
+            [&ray, &bestHit, &mailbox, &counter](
+                const KDTreeNodes& tree, const KDTreeNode& leaf, float& maxDistance) {
+                return asKDTree(tree).template castRayAtLeaf<HitMode::Closest>(
+                    ray, leaf, maxDistance, bestHit, mailbox, counter);
+            });
+        return bestHit;
+    }
+
+    std::optional<Hit> findAnyHit(
+        const Ray& ray, float maxDistance, KDTreeQueryCounter& counter) const
+    {
+        std::optional<Hit> anyHit;
+        PrimitiveMailbox mailbox;
+        traverseRay(ray, maxDistance, counter,
+            [&ray, &anyHit, &mailbox, &counter](
+                const KDTreeNodes& tree, const KDTreeNode& leaf, float& maxDistance) {
+                return asKDTree(tree).template castRayAtLeaf<HitMode::Any>(
+                    ray, leaf, maxDistance, anyHit, mailbox, counter);
+            });
+        return anyHit;
+    }
+
+    // Tests one ray against a leaf's triangles, several triangles at a time. Triangles the
+    // mailbox has seen in earlier leaves are masked out, and groups of them are skipped entirely.
+    // Returns true once the search is over, which only happens when any hit will do.
+    template <HitMode Mode>
+    bool castRayAtLeaf(const Ray& ray, const KDTreeNode& leaf, float& maxDistance,
+        std::optional<Hit>& hit, PrimitiveMailbox& mailbox, KDTreeQueryCounter& counter) const
+    {
+        constexpr size_t Width = kLeafKernelWidth;
+        using Vec3 = simd::Vec3<Width>;
+
+        Vec3 origin = Vec3::broadcast(ray.origin);
+        Vec3 direction = Vec3::broadcast(ray.direction);
+        uint32_t firstTriangle = leaf.getFirstTriangle();
+        uint32_t triangleCount = leaf.getTriangleCount();
+        for (uint32_t i = 0; i < triangleCount; i += Width) {
+            size_t first = firstTriangle + i;
+            size_t laneCount = std::min<size_t>(Width, triangleCount - i);
+            uint32_t untestedBits = 0;
+            for (size_t lane = 0; lane < laneCount; lane++) {
+                if (mailbox.add(_primitiveIndices[first + lane])) {
+                    untestedBits |= uint32_t{ 1 } << lane;
+                }
+            }
+            if (!untestedBits) {
+                continue;
+            }
+
+            counter.countTriangles(std::bitset<Width>(untestedBits).count());
+            auto lanes = castRayAtTriangles(origin, direction,
+                _leafTriangles.loadVertex0<Width>(first), _leafTriangles.loadEdge1<Width>(first),
+                _leafTriangles.loadEdge2<Width>(first), simd::Float<Width>::broadcast(maxDistance));
+            uint32_t hitBits = lanes.hitLanes.toBits() & untestedBits;
+            if (!hitBits) {
+                continue;
+            }
+
+            std::array<float, Width> u;
+            std::array<float, Width> v;
+            std::array<float, Width> t;
+            lanes.u.store(u.data());
+            lanes.v.store(v.data());
+            lanes.t.store(t.data());
+
+            // Ties go to the later triangle, as they would when testing one triangle at a time.
+            size_t bestLane = Width;
+            for (size_t lane = 0; lane < Width; lane++) {
+                if ((hitBits & (uint32_t{ 1 } << lane))
+                    && ((bestLane == Width) || !(t[lane] > t[bestLane]))) {
+                    bestLane = lane;
+                    if (Mode == HitMode::Any) {
+                        break;
+                    }
+                }
+            }
 
-        MapNode<SurfaceData>* childNode = goLeft ? node.left.get() : node.right.get();
-        auto hit = getHit(*childNode, ray, (goLeft ? leftBox : rightBox), entryPoint, maxDistance);
-        if (hit) {
-            return hit;
+            auto* triangle = &_primitives[_primitiveIndices[first + bestLane]];
+            hit = Hit{ triangle, { u[bestLane], v[bestLane] }, t[bestLane] };
+            if (Mode == HitMode::Any) {
+                return true;
+            }
+            maxDistance = t[bestLane];
         }
-        if (entryPoint.t > maxDistance) {
-            return std::nullopt;
+        return false;
+    }
+
+    // Batches are handed out to workers in chunks of this many rays, and batches no bigger than
+    // this are cast on the calling thread.
+    static constexpr size_t kRayBatchGrainSize = 256;
+    static constexpr size_t kRayBatchPacketWidth = 4;
+    // Single rays are tested against this many of a leaf's triangles at once.
+    static constexpr size_t kLeafKernelWidth = 4;
+
+    void castRayRange(gsl::span<const Ray> rays, gsl::span<std::optional<Hit>> hits,
+        float maxDistance, size_t begin, size_t end) const
+    {
+        size_t i = begin;
+        for (; i + kRayBatchPacketWidth <= end; i += kRayBatchPacketWidth) {
+            std::array<Ray, kRayBatchPacketWidth> packet;
+            std::copy_n(rays.begin() + i, kRayBatchPacketWidth, packet.begin());
+            auto packetHits = castRayPacket(packet, maxDistance);
+            std::copy(packetHits.begin(), packetHits.end(), hits.begin() + i);
         }
-        if (entryPoint.planeDimension != node.split.dimensionIndex) {
-            return std::nullopt;
+        for (; i < end; i++) {
+            hits[i] = castRay(rays[i], maxDistance);
         }
+    }
 
-        bool shouldTryOtherChild;
-        if (goLeft) {
-            shouldTryOtherChild = (ray.direction[node.split.dimensionIndex] > 0.0f);
-        } else {
-            shouldTryOtherChild = (ray.direction[node.split.dimensionIndex] < 0.0f);
+    void castOcclusionRayRange(gsl::span<const Ray> rays, gsl::span<bool> occluded,
+        float maxDistance, size_t begin, size_t end) const
+    {
+        size_t i = begin;
+        for (; i + kRayBatchPacketWidth <= end; i += kRayBatchPacketWidth) {
+            std::array<Ray, kRayBatchPacketWidth> packet;
+            std::copy_n(rays.begin() + i, kRayBatchPacketWidth, packet.begin());
+            auto packetOccluded = occludedPacket(packet, maxDistance);
+            std::copy(packetOccluded.begin(), packetOccluded.end(), occluded.begin() + i);
         }
-
-        if (shouldTryOtherChild) {
-            childNode = goLeft ? node.right.get() : node.left.get();
-            return getHit(*childNode, ray, (goLeft ? rightBox : leftBox), entryPoint, maxDistance);
+        for (; i < end; i++) {
+            occluded[i] = this->occluded(rays[i], maxDistance);
         }
-        return std::nullopt;
     }
 
-    std::optional<Hit> getHit(const LeafNode<SurfaceData>& node, const Ray& ray,
-        const AxisAlignedBoundingBox& box, AxisAlignedBoundingBox::Hit& entryPoint,
-        float maxDistance) const
+    template <HitMode Mode, size_t Width>
+    std::array<std::optional<Hit>, Width> tracePacket(const std::array<Ray, Width>& rays,
+        float maxDistance, KDTreeQueryCounter& counter) const
     {
-        float t = std::numeric_limits<float>::infinity();
-        std::optional<Hit> bestHit;
-        for (const auto& triangle : node.triangles) {
-            auto hit = triangle->castRay(ray);
-            if (hit) {
-                if (!bestHit || (hit->t < bestHit->t)) {
-                    bestHit = Hit{ triangle, hit->uv, hit->t };
+        static_assert(Width <= 32, "Ray packet lanes must fit in a 32 bit mask.");
+        using Float = simd::Float<Width>;
+        using Mask = simd::Mask<Width>;
+        using Vec3 = simd::Vec3<Width>;
+
+        std::array<std::optional<Hit>, Width> hits;
+
+        std::array<std::array<float, Width>, 3> origins;
+        std::array<std::array<float, Width>, 3> directions;
+        std::array<std::array<float, Width>, 3> inverseDirections;
+        std::array<bool, 3> isNegative;
+        for (uint8_t k = 0; k < 3; k++) {
+            isNegative[k] = rays[0].direction[k] < 0.0f;
+            for (size_t i = 0; i < Width; i++) {
+                float direction = rays[i].direction[k];
+                if ((direction < 0.0f) != isNegative[k]) {
+                    for (size_t j = 0; j < Width; j++) {
+                        hits[j] = (Mode == HitMode::Closest)
+                            ? findClosestHit(rays[j], maxDistance, counter)
+                            : findAnyHit(rays[j], maxDistance, counter);
+                    }
+                    return hits;
                 }
+                origins[k][i] = rays[i].origin[k];
+                directions[k][i] = direction;
+                // Flush negative zero so that its inverse matches the packet's positive sign.
+                inverseDirections[k][i] = 1.0f / ((direction == 0.0f) ? 0.0f : direction);
             }
         }
-
-        if (bestHit && !(bestHit->t > maxDistance)) {
-            return bestHit;
+        Vec3 origin{ Float::load(origins[0].data()), Float::load(origins[1].data()),
+            Float::load(origins[2].data()) };
+        Vec3 direction{ Float::load(directions[0].data()), Float::load(directions[1].data()),
+            Float::load(directions[2].data()) };
+        std::array<Float, 3> inverseDirection{ Float::load(inverseDirections[0].data()),
+            Float::load(inverseDirections[1].data()), Float::load(inverseDirections[2].data()) };
+        std::array<Float, 3> originLanes{ origin.x, origin.y, origin.z };
+
+        auto interval = clipRays(_boundingBox,
+            SlabRayPacket<Width>{ origin,
+                { inverseDirection[0], inverseDirection[1], inverseDirection[2] } });
+        Float entryDistance = interval.entryDistance;
+        Float exitDistance = interval.exitDistance;
+
+        Float bestDistance = Float::broadcast(maxDistance);
+        Mask active = (entryDistance <= exitDistance) & (entryDistance <= bestDistance);
+        if (simd::none(active)) {
+            return hits;
         }
 
-        auto boxHit = box.castInternalRay(ray);
-        entryPoint = boxHit;
+        struct StackEntry {
+            uint32_t nodeIndex;
+            Float entryDistance;
+            Float exitDistance;
+            Mask active;
+        };
+        std::array<StackEntry, kMaxKDTreeDepth> stack;
+        size_t stackSize = 0;
+
+        uint32_t nodeIndex = 0;
+        while (true) {
+            const KDTreeNode& node = _nodes[nodeIndex];
+            counter.countNode();
+            if (!node.isLeaf()) {
+                uint8_t dimension = node.getSplitDimension();
+                Float splitDistance
+                    = (Float::broadcast(node.getSplitPosition()) - originLanes[dimension])
+                    * inverseDirection[dimension];
+
+                uint32_t nearChild = nodeIndex + 1;
+                uint32_t farChild = node.getRightChildIndex();
+                if (isNegative[dimension]) {
+                    std::swap(nearChild, farChild);
+                }
 
-        return std::nullopt;
-    }
+                // A NaN split distance means the ray lies in the split plane, so it visits both.
+                Mask needsNear = simd::andNot(active, splitDistance < entryDistance);
+                Mask needsFar = simd::andNot(active, splitDistance > exitDistance);
+                Float nearExitDistance
+                    = simd::select(splitDistance < exitDistance, splitDistance, exitDistance);
+                Float farEntryDistance
+                    = simd::select(splitDistance > entryDistance, splitDistance, entryDistance);
+
+                if (simd::none(needsFar)) {
+                    nodeIndex = nearChild;
+                    exitDistance = nearExitDistance;
+                    active = needsNear;
+                } else if (simd::none(needsNear)) {
+                    nodeIndex = farChild;
+                    entryDistance = farEntryDistance;
+                    active = needsFar;
+                } else {
+                    stack[stackSize++] = { farChild, farEntryDistance, exitDistance, needsFar };
+                    nodeIndex = nearChild;
+                    exitDistance = nearExitDistance;
+                    active = needsNear;
+                }
+                continue;
+            }
 
-    template <typename Visitor>
-    void visitTrianglesIntersectingSphereInNode(const Sphere& sphere, Visitor&& visitor,
-        const AxisAlignedBoundingBox& box, const LeafNode<SurfaceData>& node) const
-    {
-        if (!box.intersectsSphere(sphere)) {
-            return;
-        }
+            if (node.isDeferred()) {
+                // Subtrees have their own bounds, so each ray enters them on its own.
+                const auto& subtree = asKDTree(getDeferredSubtree(node));
+                std::array<float, Width> laneDistances;
+                bestDistance.store(laneDistances.data());
+                uint32_t activeBits = active.toBits();
+                for (size_t i = 0; i < Width; i++) {
+                    if (!(activeBits & (uint32_t{ 1 } << i))) {
+                        continue;
+                    }
+                    auto hit = (Mode == HitMode::Closest)
+                        ? subtree.findClosestHit(rays[i], laneDistances[i], counter)
+                        : subtree.findAnyHit(rays[i], laneDistances[i], counter);
+                    if (hit) {
+                        hits[i] = hit;
+                        laneDistances[i] = (Mode == HitMode::Closest)
+                            ? hit->t
+                            : -std::numeric_limits<float>::infinity();
+                    }
+                }
+                bestDistance = Float::load(laneDistances.data());
+                active = active & (entryDistance <= bestDistance);
+            } else {
+                // Packets don't keep a mailbox: lanes that were inactive when a triangle was first
+                // tested may still need to test it in a later leaf.
+                uint32_t firstTriangle = node.getFirstTriangle();
+                for (uint32_t i = firstTriangle; i < firstTriangle + node.getTriangleCount(); i++) {
+                    if (simd::none(active)) {
+                        break;
+                    }
+                    counter.countTriangles(std::bitset<Width>(active.toBits()).count());
+                    auto* triangle = &_primitives[_primitiveIndices[i]];
+                    auto hit = castRayAtTriangles(origin, direction,
+                        Vec3::broadcast(_leafTriangles.getVertex0(i)),
+                        Vec3::broadcast(_leafTriangles.getEdge1(i)),
+                        Vec3::broadcast(_leafTriangles.getEdge2(i)), bestDistance);
+                    Mask hitLanes = hit.hitLanes & active;
+                    if (simd::none(hitLanes)) {
+                        continue;
+                    }
 
-        for (const auto& triangle : node.triangles) {
-            auto hit = triangle->intersectsSphere(sphere);
-            if (hit) {
-                visitor(*triangle, *hit);
+                    if (Mode == HitMode::Any) {
+                        // Lanes with a hit are finished, so shut them out of every remaining node.
+                        bestDistance = simd::select(hitLanes,
+                            Float::broadcast(-std::numeric_limits<float>::infinity()),
+                            bestDistance);
+                        active = simd::andNot(active, hitLanes);
+                    } else {
+                        bestDistance = simd::select(hitLanes, hit.t, bestDistance);
+                    }
+                    std::array<float, Width> u;
+                    std::array<float, Width> v;
+                    std::array<float, Width> t;
+                    hit.u.store(u.data());
+                    hit.v.store(v.data());
+                    hit.t.store(t.data());
+                    uint32_t hitBits = hitLanes.toBits();
+                    for (size_t i = 0; i < Width; i++) {
+                        if (hitBits & (uint32_t{ 1 } << i)) {
+                            hits[i] = Hit{ triangle, { u[i], v[i] }, t[i] };
+                        }
+                    }
+                }
             }
+
+            do {
+                if (!stackSize) {
+                    return hits;
+                }
+                stackSize--;
+                nodeIndex = stack[stackSize].nodeIndex;
+                entryDistance = stack[stackSize].entryDistance;
+                exitDistance = stack[stackSize].exitDistance;
+                active = stack[stackSize].active & (entryDistance <= bestDistance);
+            } while (simd::none(active));
         }
     }
 
-    template <typename Visitor>
-    void visitTrianglesIntersectingSphereInNode(const Sphere& sphere, Visitor&& visitor,
-        const AxisAlignedBoundingBox& box, const BranchNode<SurfaceData>& node) const
+    template <size_t Width>
+    struct PacketHit {
+        simd::Mask<Width> hitLanes;
+        simd::Float<Width> u;
+        simd::Float<Width> v;
+        simd::Float<Width> t;
+    };
+
+    // The same Möller–Trumbore test as Triangle::castRay, run on every lane. Lanes may hold
+    // different rays, different triangles, or both.
+    template <size_t Width>
+    static PacketHit<Width> castRayAtTriangles(const simd::Vec3<Width>& origin,
+        const simd::Vec3<Width>& direction, const simd::Vec3<Width>& vertex0,
+        const simd::Vec3<Width>& edge1, const simd::Vec3<Width>& edge2,
+        const simd::Float<Width>& maxDistance)
     {
-        if (!box.intersectsSphere(sphere)) {
-            return;
-        }
+        using Float = simd::Float<Width>;
+        using Vec3 = simd::Vec3<Width>;
 
-        auto [leftBox, rightBox] = box.split(node.split);
-        std::visit(
-            [this, leftBox = leftBox, &sphere, &visitor](const auto& node) {
-                visitTrianglesIntersectingSphereInNode(
-                    sphere, std::forward<Visitor>(visitor), leftBox, node);
-            },
-            *node.left);
-        std::visit(
-            [this, rightBox = rightBox, &sphere, &visitor](const auto& node) {
-                visitTrianglesIntersectingSphereInNode(
-                    sphere, std::forward<Visitor>(visitor), rightBox, node);
-            },
-            *node.right);
+        Vec3 p = simd::cross(direction, edge2);
+        Float determinant = simd::dot(edge1, p);
+        auto hitLanes
+            = simd::abs(determinant) >= Float::broadcast(std::numeric_limits<float>::epsilon());
+
+        Float zero = Float::broadcast(0.0f);
+        Float one = Float::broadcast(1.0f);
+        Vec3 fromV0 = origin - vertex0;
+        Float u = simd::dot(fromV0, p) / determinant;
+        hitLanes = simd::andNot(hitLanes, (u < zero) | (u > one));
+
+        Vec3 q = simd::cross(fromV0, edge1);
+        Float v = simd::dot(direction, q) / determinant;
+        hitLanes = simd::andNot(hitLanes, (v < zero) | ((u + v) > one));
+
+        Float t = simd::dot(edge2, q) / determinant;
+        hitLanes = simd::andNot(hitLanes, (t < zero) | (t > maxDistance));
+
+        return { hitLanes, u, v, t };
     }
 
     void printIndent(size_t indent = 0) const
@@ -469,83 +2088,82 @@ private:
         std::cout << "}" << std::endl;
     }
 
-    void printNode(const AxisAlignedBoundingBox& box, const LeafNode<SurfaceData>& node,
-        size_t indent = 0) const
+    void printNode(const AxisAlignedBoundingBox& box, uint32_t nodeIndex, size_t indent = 0) const
     {
+        const KDTreeNode& node = _nodes[nodeIndex];
         printIndent(indent);
-        std::cout << "[Leaf]{" << std::endl;
-        printBoundingBox(box, indent + 2);
-        for (const auto& triangle : node.triangles) {
-            printTriangle(*triangle, indent + 2);
+        if (node.isLeaf()) {
+            std::cout << (node.isDeferred() ? "[DeferredLeaf]{" : "[Leaf]{") << std::endl;
+            printBoundingBox(box, indent + 2);
+            for (auto triangleIndex : getLeafPrimitives(node)) {
+                printTriangle(_primitives[triangleIndex], indent + 2);
+            }
+        } else {
+            std::cout << "[Branch]{" << std::endl;
+            printBoundingBox(box, indent + 2);
+            auto [leftBox, rightBox] = box.split(node.getSplitPlane());
+            printNode(leftBox, nodeIndex + 1, indent + 2);
+            printNode(rightBox, node.getRightChildIndex(), indent + 2);
         }
         printIndent(indent);
         std::cout << "}" << std::endl;
     }
 
-    void printNode(const AxisAlignedBoundingBox& box, const BranchNode<SurfaceData>& node,
-        size_t indent = 0) const
-    {
-        printIndent(indent);
-        std::cout << "[Branch]{" << std::endl;
-        printBoundingBox(box, indent + 2);
-        auto [leftBox, rightBox] = box.split(node.split);
-        std::visit([this, indent, leftBox = leftBox](
-                       const auto& childNode) { printNode(leftBox, childNode, indent + 2); },
-            *node.left);
-        std::visit([this, indent, rightBox = rightBox](
-                       const auto& childNode) { printNode(rightBox, childNode, indent + 2); },
-            *node.right);
-        printIndent(indent);
-        std::cout << "}" << std::endl;
-    }
+    // Keeps the packed triangles alive when the tree was built in memory rather than loaded from
+    // a file.
+    std::shared_ptr<const std::vector<float>> _leafTriangleStorage;
+    gsl::span<const float> _leafTriangleComponents;
+    PackedTriangles _leafTriangles;
+};
 
-    std::vector<std::unique_ptr<Triangle<SurfaceData>>> _triangles;
-    std::unique_ptr<MapNode<SurfaceData>> _root;
-    AxisAlignedBoundingBox _boundingBox;
+// The tree a builder makes for each kind of primitive.
+template <typename Primitive>
+struct KDTreeForPrimitive {
+    using Type = BasicKDTree<Primitive>;
 };
 
 template <typename SurfaceData>
-class KDTreeBuilder {
+struct KDTreeForPrimitive<Triangle<SurfaceData>> {
+    using Type = KDTree<SurfaceData>;
+};
+
+template <typename Primitive>
+using KDTreeFor = typename KDTreeForPrimitive<Primitive>::Type;
+
+// Builds a tree over primitives with the surface area heuristic. Straddling primitives are split
+// between both children using their clipped bounding boxes.
+template <typename Primitive>
+class BasicKDTreeBuilder {
 public:
-    void addTriangle(std::array<glm::vec3, 3> vertices, SurfaceData data)
+    void addPrimitive(Primitive primitive)
     {
-        Expects(!glm::any(glm::isnan(vertices[0])));
-        Expects(!glm::any(glm::isnan(vertices[1])));
-        Expects(!glm::any(glm::isnan(vertices[2])));
-
-        auto triangle
-            = std::make_unique<Triangle<SurfaceData>>(Triangle<SurfaceData>{ vertices, data });
-        auto boundingBox = smallestBoxContainingVertices(vertices);
+        auto boundingBox = primitive.getBoundingBox();
         _boundingBox.expandToBox(boundingBox);
 
-        for (const auto& event : buildTriangleEvents(boundingBox, triangle.get())) {
+        auto ownedPrimitive = std::make_unique<Primitive>(std::move(primitive));
+        for (const auto& event : buildEvents(boundingBox, ownedPrimitive.get())) {
             _events.insert(event);
         }
-        _triangles.push_back(std::move(triangle));
+        _primitives.push_back(std::move(ownedPrimitive));
     }
 
-    KDTree<SurfaceData> build()
+    KDTreeFor<Primitive> build()
     {
-        Expects(!_triangles.empty());
+        Expects(!_primitives.empty());
         Expects(!_events.empty());
+        auto buildStart = std::chrono::steady_clock::now();
 
-        std::unordered_set<Triangle<SurfaceData>*> triangleSet;
-        for (const auto& triangle : _triangles) {
-            triangleSet.insert(triangle.get());
+        std::unordered_set<Primitive*> primitiveSet;
+        for (const auto& primitive : _primitives) {
+            primitiveSet.insert(primitive.get());
         }
-        auto rootNode = createNode(_boundingBox, std::move(_events), triangleSet);
-        return KDTree<SurfaceData>{ std::move(_triangles), std::move(rootNode), _boundingBox };
+        auto rootNode = createNode(_boundingBox, std::move(_events), primitiveSet, 0);
+        return KDTreeFor<Primitive>{ std::move(_primitives), std::move(rootNode), _boundingBox,
+            buildStart };
     }
 
 private:
-    static constexpr float kTraversalCost = 15.0f;
-    static constexpr float kIntersectionCost = 20.0f;
-    static constexpr float kEmptySplitDiscount = 0.8f;
-
-    enum class Side {
-        Left,
-        Right,
-    };
+    using Side = KDTreeSplitSide;
 
     struct Event {
         enum class Type {
@@ -558,26 +2176,26 @@ private:
         {
             auto tuplify = [](const Event& event) {
                 return std::tie(event.separationPlane.boundary,
-                    event.separationPlane.dimensionIndex, event.type, event.triangle);
+                    event.separationPlane.dimensionIndex, event.type, event.primitive);
             };
             return tuplify(*this) < tuplify(other);
         }
 
-        Triangle<SurfaceData>* triangle;
+        Primitive* primitive;
         AxisAlignedPlane separationPlane;
         Type type;
     };
 
-    std::unique_ptr<MapNode<SurfaceData>> createNode(const AxisAlignedBoundingBox& box,
-        std::set<Event> events, std::unordered_set<Triangle<SurfaceData>*> triangles)
+    std::unique_ptr<MapNode<Primitive>> createNode(const AxisAlignedBoundingBox& box,
+        std::set<Event> events, std::unordered_set<Primitive*> primitives, size_t depth)
     {
-        size_t triangleCount = triangles.size();
-        if (triangleCount > 0) {
-            auto [plane, side, cost] = findBestSplit(box, events, triangleCount);
-            float terminateCost = static_cast<float>(triangleCount) * kIntersectionCost;
+        size_t primitiveCount = primitives.size();
+        if ((primitiveCount > 0) && (depth + 1 < kMaxKDTreeDepth)) {
+            auto [plane, side, cost] = findBestSplit(box, events, primitiveCount);
+            float terminateCost = static_cast<float>(primitiveCount) * kKDTreeIntersectionCost;
             if (terminateCost > cost) {
-                std::unordered_set<Triangle<SurfaceData>*> leftTriangles;
-                std::unordered_set<Triangle<SurfaceData>*> rightTriangles;
+                std::unordered_set<Primitive*> leftPrimitives;
+                std::unordered_set<Primitive*> rightPrimitives;
 
                 for (const auto& event : events) {
                     const auto& eventPlane = event.separationPlane;
@@ -587,38 +2205,38 @@ private:
 
                     if (eventPlane.boundary < plane.boundary) {
                         if (event.type != Event::Type::Starting) {
-                            size_t erased = triangles.erase(event.triangle);
+                            size_t erased = primitives.erase(event.primitive);
                             Expects(erased == 1);
-                            leftTriangles.insert(event.triangle);
+                            leftPrimitives.insert(event.primitive);
 
-                            Expects(event.triangle->isLeftOfPlane(plane));
+                            Expects(event.primitive->getBoundingBox().isLeftOfPlane(plane));
                         }
                     } else if (eventPlane.boundary > plane.boundary) {
                         if (event.type != Event::Type::Ending) {
-                            size_t erased = triangles.erase(event.triangle);
+                            size_t erased = primitives.erase(event.primitive);
                             Expects(erased == 1);
-                            rightTriangles.insert(event.triangle);
+                            rightPrimitives.insert(event.primitive);
 
-                            Expects(event.triangle->isRightOfPlane(plane));
+                            Expects(event.primitive->getBoundingBox().isRightOfPlane(plane));
                         }
                     } else {
                         // On the boundary
-                        size_t erased = triangles.erase(event.triangle);
+                        size_t erased = primitives.erase(event.primitive);
                         Expects(erased == 1);
                         switch (event.type) {
                         case Event::Type::Starting:
-                            rightTriangles.insert(event.triangle);
-                            Expects(event.triangle->isRightOfPlane(plane));
+                            rightPrimitives.insert(event.primitive);
+                            Expects(event.primitive->getBoundingBox().isRightOfPlane(plane));
                             break;
                         case Event::Type::Ending:
-                            leftTriangles.insert(event.triangle);
-                            Expects(event.triangle->isLeftOfPlane(plane));
+                            leftPrimitives.insert(event.primitive);
+                            Expects(event.primitive->getBoundingBox().isLeftOfPlane(plane));
                             break;
                         case Event::Type::Planar:
                             if (side == Side::Left) {
-                                leftTriangles.insert(event.triangle);
+                                leftPrimitives.insert(event.primitive);
                             } else {
-                                rightTriangles.insert(event.triangle);
+                                rightPrimitives.insert(event.primitive);
                             }
                             break;
                         }
@@ -628,55 +2246,53 @@ private:
                 std::set<Event> leftEvents;
                 std::set<Event> rightEvents;
                 for (const auto& event : events) {
-                    if (leftTriangles.count(event.triangle)) {
+                    if (leftPrimitives.count(event.primitive)) {
                         leftEvents.insert(event);
-                    } else if (rightTriangles.count(event.triangle)) {
+                    } else if (rightPrimitives.count(event.primitive)) {
                         rightEvents.insert(event);
                     }
                 }
 
                 auto [leftBox, rightBox] = box.split(plane);
-                // Overlapping triangles remain
-                for (const auto& triangle : triangles) {
-                    Expects(triangle->isLeftOfPlane(plane));
-                    Expects(triangle->isRightOfPlane(plane));
+                // Overlapping primitives remain
+                for (const auto& primitive : primitives) {
+                    Expects(primitive->getBoundingBox().isLeftOfPlane(plane));
+                    Expects(primitive->getBoundingBox().isRightOfPlane(plane));
 
-                    auto leftClipBox = triangle->clippedBoundingBox(leftBox);
+                    auto leftClipBox = primitive->clippedBoundingBox(leftBox);
                     if (leftClipBox) {
-                        for (const auto& event : buildTriangleEvents(*leftClipBox, triangle))
-                        {
+                        for (const auto& event : buildEvents(*leftClipBox, primitive)) {
                             leftEvents.insert(event);
                         }
-                        leftTriangles.insert(triangle);
+                        leftPrimitives.insert(primitive);
                     }
 
-                    auto rightClipBox = triangle->clippedBoundingBox(rightBox);
+                    auto rightClipBox = primitive->clippedBoundingBox(rightBox);
                     if (rightClipBox) {
-                        for (const auto& event : buildTriangleEvents(*rightClipBox, triangle))
-                        {
+                        for (const auto& event : buildEvents(*rightClipBox, primitive)) {
                             rightEvents.insert(event);
                         }
-                        rightTriangles.insert(triangle);
+                        rightPrimitives.insert(primitive);
                     }
                 }
-                triangles.clear();
+                primitives.clear();
                 events.clear();
 
-                return std::make_unique<MapNode<SurfaceData>>(BranchNode<SurfaceData>{
+                return std::make_unique<MapNode<Primitive>>(BranchNode<Primitive>{
                     plane,
-                    createNode(leftBox, std::move(leftEvents), std::move(leftTriangles)),
-                    createNode(rightBox, std::move(rightEvents), std::move(rightTriangles)),
+                    createNode(
+                        leftBox, std::move(leftEvents), std::move(leftPrimitives), depth + 1),
+                    createNode(
+                        rightBox, std::move(rightEvents), std::move(rightPrimitives), depth + 1),
                 });
             }
         }
-        return std::make_unique<MapNode<SurfaceData>>(
-            LeafNode<SurfaceData>{ std::move(triangles) });
+        return std::make_unique<MapNode<Primitive>>(LeafNode<Primitive>{ std::move(primitives) });
     }
 
-    std::set<Event> buildTriangleEvents(
-        const AxisAlignedBoundingBox& boundingBox, Triangle<SurfaceData>* triangle)
+    std::set<Event> buildEvents(const AxisAlignedBoundingBox& boundingBox, Primitive* primitive)
     {
-        AxisAlignedBoundingBox actualBox = triangle->getBoundingBox();
+        AxisAlignedBoundingBox actualBox = primitive->getBoundingBox();
         std::set<Event> events;
         for (uint8_t k = 0; k < 3; k++) {
             float minimum = boundingBox.minimum[k];
@@ -685,99 +2301,90 @@ private:
             Expects(!(maximum > actualBox.maximum[k]));
             if (minimum < maximum) {
                 events.insert(
-                    Event{ triangle, AxisAlignedPlane{ k, maximum }, Event::Type::Ending });
+                    Event{ primitive, AxisAlignedPlane{ k, maximum }, Event::Type::Ending });
                 events.insert(
-                    Event{ triangle, AxisAlignedPlane{ k, minimum }, Event::Type::Starting });
+                    Event{ primitive, AxisAlignedPlane{ k, minimum }, Event::Type::Starting });
             } else {
                 events.insert(
-                    Event{ triangle, AxisAlignedPlane{ k, minimum }, Event::Type::Planar });
+                    Event{ primitive, AxisAlignedPlane{ k, minimum }, Event::Type::Planar });
             }
         }
         return events;
     }
 
     std::tuple<AxisAlignedPlane, Side, float> findBestSplit(
-        const AxisAlignedBoundingBox& box, const std::set<Event>& events, size_t triangleCount)
+        const AxisAlignedBoundingBox& box, const std::set<Event>& events, size_t primitiveCount)
     {
         float bestCost = std::numeric_limits<float>::infinity();
         AxisAlignedPlane bestPlane;
         Side bestSide;
 
-        std::array<size_t, 3> leftTriangleCounts{ 0 };
-        std::array<size_t, 3> rightTriangleCounts{ triangleCount, triangleCount, triangleCount };
+        std::array<size_t, 3> leftPrimitiveCounts{ 0 };
+        std::array<size_t, 3> rightPrimitiveCounts{
+            primitiveCount, primitiveCount, primitiveCount };
         auto iter = events.begin();
         auto eventsEnd = events.end();
         while (iter != eventsEnd) {
             const AxisAlignedPlane& candidatePlane = iter->separationPlane;
             uint8_t dimension = candidatePlane.dimensionIndex;
-            size_t endingTriangleCount = 0;
-            size_t planarTriangleCount = 0;
-            size_t startingTriangleCount = 0;
+            size_t endingPrimitiveCount = 0;
+            size_t planarPrimitiveCount = 0;
+            size_t startingPrimitiveCount = 0;
             auto validate = [&eventsEnd, &candidatePlane, dimension](const auto& iter) {
                 return (iter != eventsEnd)
                     && !(iter->separationPlane.boundary > candidatePlane.boundary)
                     && (iter->separationPlane.dimensionIndex == dimension);
             };
             while (validate(iter) && (iter->type == Event::Type::Ending)) {
-                endingTriangleCount++;
+                endingPrimitiveCount++;
                 iter++;
             }
             while (validate(iter) && (iter->type == Event::Type::Planar)) {
-                planarTriangleCount++;
+                planarPrimitiveCount++;
                 iter++;
             }
             while (validate(iter) && (iter->type == Event::Type::Starting)) {
-                startingTriangleCount++;
+                startingPrimitiveCount++;
                 iter++;
             }
-            rightTriangleCounts[dimension] -= planarTriangleCount;
-            rightTriangleCounts[dimension] -= endingTriangleCount;
-            auto [side, cost] = surfaceAreaCostHeuristic(box, candidatePlane,
-                leftTriangleCounts[dimension], planarTriangleCount, rightTriangleCounts[dimension]);
+            rightPrimitiveCounts[dimension] -= planarPrimitiveCount;
+            rightPrimitiveCounts[dimension] -= endingPrimitiveCount;
+            auto [side, cost] = evaluateKDTreeSplit(box, candidatePlane,
+                leftPrimitiveCounts[dimension], planarPrimitiveCount,
+                rightPrimitiveCounts[dimension]);
             if (cost < bestCost) {
                 bestCost = cost;
                 bestPlane = candidatePlane;
                 bestSide = side;
             }
-            leftTriangleCounts[dimension] += planarTriangleCount;
-            leftTriangleCounts[dimension] += startingTriangleCount;
+            leftPrimitiveCounts[dimension] += planarPrimitiveCount;
+            leftPrimitiveCounts[dimension] += startingPrimitiveCount;
         }
         return { bestPlane, bestSide, bestCost };
     }
 
-    std::pair<Side, float> surfaceAreaCostHeuristic(const AxisAlignedBoundingBox& box,
-        const AxisAlignedPlane& splitPlane, size_t leftTriangleCount, size_t planarTriangleCount,
-        size_t rightTriangleCount)
-    {
-        auto [leftBox, rightBox] = box.split(splitPlane);
-        float boxSurfaceArea = box.getSurfaceArea();
-
-        float leftArea = leftBox.getSurfaceArea() / boxSurfaceArea;
-        float rightArea = rightBox.getSurfaceArea() / boxSurfaceArea;
-        bool removesVolume = (leftBox.getVolume() > 0.0f) && (rightBox.getVolume() > 0.0f);
+    AxisAlignedBoundingBox _boundingBox;
+    std::vector<std::unique_ptr<Primitive>> _primitives;
+    std::set<Event> _events;
+};
 
-        auto cost = [leftArea, rightArea, removesVolume](
-                        size_t leftTriangleCount, size_t rightTriangleCount) {
-            float cost = static_cast<float>(leftTriangleCount) * leftArea
-                + static_cast<float>(rightTriangleCount) * rightArea;
-            if (removesVolume && (!leftTriangleCount || !rightTriangleCount)) {
-                // We slightly prefer splits that remove empty space.
-                cost *= kEmptySplitDiscount;
-            }
-            return cost;
-        };
+template <typename SurfaceData>
+class KDTreeBuilder : public BasicKDTreeBuilder<Triangle<SurfaceData>> {
+public:
+    void addTriangle(std::array<glm::vec3, 3> vertices, SurfaceData data)
+    {
+        Expects(!glm::any(glm::isnan(vertices[0])));
+        Expects(!glm::any(glm::isnan(vertices[1])));
+        Expects(!glm::any(glm::isnan(vertices[2])));
 
-        float leftCost = cost(leftTriangleCount + planarTriangleCount, rightTriangleCount);
-        float rightCost = cost(leftTriangleCount, planarTriangleCount + rightTriangleCount);
-        if (leftCost < rightCost) {
-            return { Side::Left, (kIntersectionCost * leftCost) + kTraversalCost };
-        } else {
-            return { Side::Right, (kIntersectionCost * rightCost) + kTraversalCost };
-        }
+        _contentHash.add(vertices, data);
+        this->addPrimitive(Triangle<SurfaceData>{ vertices, std::move(data) });
     }
 
-    AxisAlignedBoundingBox _boundingBox;
-    std::vector<std::unique_ptr<Triangle<SurfaceData>>> _triangles;
-    std::set<Event> _events;
+    // Identifies the triangles added so far, for matching them against a saved tree.
+    uint64_t getContentHash() const { return _contentHash.get(); }
+
+private:
+    TriangleContentHash _contentHash;
 };
 }
\ No newline at end of file
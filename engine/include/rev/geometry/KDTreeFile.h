@@ -0,0 +1,268 @@
+#pragma once
+
+#include "rev/MappedFile.h"
+#include "rev/geometry/KDTree.h"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+namespace rev {
+
+// Saved trees are only loaded by builds with the same file version, so bump this whenever the
+// layout of the file or of any of the arrays in it changes.
+constexpr uint32_t kKDTreeFileVersion = 2;
+
+namespace detail {
+    constexpr std::array<char, 8> kKDTreeFileMagic{ 'r', 'e', 'v', 'k', 'd', 't', 'r', 'e' };
+
+    // Written in the machine's own byte order, so it reads back differently on a machine whose
+    // byte order differs from the one that saved the file.
+    constexpr uint32_t kKDTreeFileByteOrderMark = 0x01020304;
+
+    // Every array starts on a boundary of this many bytes, which satisfies the alignment of
+    // everything stored and keeps SIMD loads from straddling cache lines.
+    constexpr size_t kKDTreeFileAlignment = 64;
+
+    struct KDTreeFileHeader {
+        std::array<char, 8> magic;
+        uint32_t version;
+        uint32_t byteOrderMark;
+        // Catches surface data changing shape between builds.
+        uint32_t triangleSize;
+        uint64_t contentHash;
+        uint64_t triangleCount;
+        uint64_t nodeCount;
+        uint64_t triangleIndexCount;
+        glm::vec3 boundingBoxMinimum;
+        glm::vec3 boundingBoxMaximum;
+    };
+
+    struct KDTreeFileLayout {
+        size_t trianglesOffset;
+        size_t nodesOffset;
+        size_t triangleIndicesOffset;
+        size_t leafTrianglesOffset;
+        size_t size;
+    };
+
+    inline size_t alignKDTreeFileOffset(size_t offset)
+    {
+        return (offset + kKDTreeFileAlignment - 1) & ~(kKDTreeFileAlignment - 1);
+    }
+
+    inline KDTreeFileLayout getKDTreeFileLayout(const KDTreeFileHeader& header)
+    {
+        KDTreeFileLayout layout;
+        layout.trianglesOffset = alignKDTreeFileOffset(sizeof(KDTreeFileHeader));
+        layout.nodesOffset = alignKDTreeFileOffset(
+            layout.trianglesOffset + (header.triangleCount * header.triangleSize));
+        layout.triangleIndicesOffset = alignKDTreeFileOffset(
+            layout.nodesOffset + (header.nodeCount * sizeof(KDTreeNode)));
+        layout.leafTrianglesOffset = alignKDTreeFileOffset(
+            layout.triangleIndicesOffset + (header.triangleIndexCount * sizeof(uint32_t)));
+        layout.size = layout.leafTrianglesOffset
+            + (PackedTriangles::getComponentCount(header.triangleIndexCount) * sizeof(float));
+        return layout;
+    }
+
+    // Checks that every index in the arrays is in range and that the nodes form a tree no deeper
+    // than traversal supports, so a damaged file can't send queries outside the arrays.
+    template <typename SurfaceData>
+    bool isValidKDTree(const KDTreeArrays<SurfaceData>& arrays)
+    {
+        auto nodeCount = static_cast<size_t>(arrays.nodes.size());
+        auto triangleIndexCount = static_cast<size_t>(arrays.triangleIndices.size());
+        for (auto triangleIndex : arrays.triangleIndices) {
+            if (triangleIndex >= static_cast<size_t>(arrays.triangles.size())) {
+                return false;
+            }
+        }
+
+        struct StackEntry {
+            size_t nodeIndex;
+            size_t depth;
+        };
+        std::array<StackEntry, kMaxKDTreeDepth> stack;
+        size_t stackSize = 0;
+        size_t visitedCount = 0;
+
+        StackEntry entry{ 0, 1 };
+        while (true) {
+            // Flattened trees are stored in depth-first order, left child first, so the walk has
+            // to reach the nodes in storage order. That rules out children pointing backwards or
+            // shared between parents, either of which could make traversal loop.
+            if ((entry.nodeIndex >= nodeCount) || (entry.nodeIndex != visitedCount)
+                || (entry.depth > kMaxKDTreeDepth)) {
+                return false;
+            }
+            visitedCount++;
+
+            const KDTreeNode& node = arrays.nodes[entry.nodeIndex];
+            if (!node.isLeaf()) {
+                if ((node.getRightChildIndex() <= entry.nodeIndex + 1)
+                    || (node.getRightChildIndex() >= nodeCount)) {
+                    return false;
+                }
+                stack[stackSize++] = { node.getRightChildIndex(), entry.depth + 1 };
+                entry = { entry.nodeIndex + 1, entry.depth + 1 };
+                continue;
+            }
+
+            // Deferred leaves point at subtrees that only exist in memory.
+            if (node.isDeferred()) {
+                return false;
+            }
+            if (static_cast<size_t>(node.getFirstTriangle()) + node.getTriangleCount()
+                > triangleIndexCount) {
+                return false;
+            }
+            if (!stackSize) {
+                return visitedCount == nodeCount;
+            }
+            entry = stack[--stackSize];
+        }
+    }
+} // namespace detail
+
+// Writes a built tree to a file that loadKDTree can map back into memory. The content hash
+// should identify the triangles the tree was built from, and is checked when loading. Throws
+// std::runtime_error if the file can't be written, or if the tree was built lazily and still has
+// subtrees left to build.
+template <typename SurfaceData>
+void saveKDTree(const KDTree<SurfaceData>& tree, uint64_t contentHash, const std::string& path)
+{
+    static_assert(std::is_trivially_copyable_v<Triangle<SurfaceData>>,
+        "Only trees with trivially copyable surface data can be saved.");
+
+    auto arrays = tree.getArrays();
+    auto isDeferred = [](const KDTreeNode& node) { return node.isDeferred(); };
+    if (std::any_of(arrays.nodes.begin(), arrays.nodes.end(), isDeferred)) {
+        throw std::runtime_error("Unable to save a KD-tree with unbuilt subtrees.");
+    }
+    detail::KDTreeFileHeader header{};
+    header.magic = detail::kKDTreeFileMagic;
+    header.version = kKDTreeFileVersion;
+    header.byteOrderMark = detail::kKDTreeFileByteOrderMark;
+    header.triangleSize = sizeof(Triangle<SurfaceData>);
+    header.contentHash = contentHash;
+    header.triangleCount = arrays.triangles.size();
+    header.nodeCount = arrays.nodes.size();
+    header.triangleIndexCount = arrays.triangleIndices.size();
+    header.boundingBoxMinimum = arrays.boundingBox.minimum;
+    header.boundingBoxMaximum = arrays.boundingBox.maximum;
+    auto layout = detail::getKDTreeFileLayout(header);
+
+    std::ofstream file{ path, std::ios::binary | std::ios::trunc };
+    if (!file) {
+        throw std::runtime_error("Unable to open KD-tree file for writing.");
+    }
+    auto writeAt = [&file](size_t offset, const void* data, size_t size) {
+        static const std::array<char, detail::kKDTreeFileAlignment> padding{};
+        auto position = static_cast<size_t>(file.tellp());
+        file.write(padding.data(), static_cast<std::streamsize>(offset - position));
+        file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+    };
+    writeAt(0, &header, sizeof(header));
+    writeAt(layout.trianglesOffset, arrays.triangles.data(), arrays.triangles.size_bytes());
+    writeAt(layout.nodesOffset, arrays.nodes.data(), arrays.nodes.size_bytes());
+    writeAt(layout.triangleIndicesOffset, arrays.triangleIndices.data(),
+        arrays.triangleIndices.size_bytes());
+    writeAt(
+        layout.leafTrianglesOffset, arrays.leafTriangles.data(), arrays.leafTriangles.size_bytes());
+
+    file.close();
+    if (!file) {
+        throw std::runtime_error("Unable to write KD-tree file.");
+    }
+}
+
+// Maps a tree saved by saveKDTree straight into memory. Returns nothing if the file is missing,
+// was written by a different file version or on a machine with a different byte order, or was
+// built from triangles with a different content hash.
+template <typename SurfaceData>
+std::optional<KDTree<SurfaceData>> loadKDTree(const std::string& path, uint64_t contentHash)
+{
+    static_assert(std::is_trivially_copyable_v<Triangle<SurfaceData>>,
+        "Only trees with trivially copyable surface data can be loaded.");
+
+    std::shared_ptr<MappedFile> file;
+    try {
+        file = std::make_shared<MappedFile>(path);
+    } catch (const std::runtime_error&) {
+        return std::nullopt;
+    }
+
+    auto bytes = file->getBytes();
+    detail::KDTreeFileHeader header;
+    if (static_cast<size_t>(bytes.size()) < sizeof(header)) {
+        return std::nullopt;
+    }
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    if ((header.magic != detail::kKDTreeFileMagic) || (header.version != kKDTreeFileVersion)
+        || (header.byteOrderMark != detail::kKDTreeFileByteOrderMark)
+        || (header.triangleSize != sizeof(Triangle<SurfaceData>))
+        || (header.contentHash != contentHash) || !header.nodeCount) {
+        return std::nullopt;
+    }
+    // Counts this large could only come from a damaged file, and would overflow the layout.
+    constexpr uint64_t kMaxCount = std::numeric_limits<uint32_t>::max();
+    if ((header.triangleCount > kMaxCount) || (header.nodeCount > kMaxCount)
+        || (header.triangleIndexCount > kMaxCount)) {
+        return std::nullopt;
+    }
+    auto layout = detail::getKDTreeFileLayout(header);
+    if (static_cast<size_t>(bytes.size()) != layout.size) {
+        return std::nullopt;
+    }
+
+    auto* data = bytes.data();
+    KDTreeArrays<SurfaceData> arrays{
+        gsl::span<Triangle<SurfaceData>>(
+            reinterpret_cast<Triangle<SurfaceData>*>(data + layout.trianglesOffset),
+            static_cast<std::ptrdiff_t>(header.triangleCount)),
+        gsl::span<const KDTreeNode>(
+            reinterpret_cast<const KDTreeNode*>(data + layout.nodesOffset),
+            static_cast<std::ptrdiff_t>(header.nodeCount)),
+        gsl::span<const uint32_t>(
+            reinterpret_cast<const uint32_t*>(data + layout.triangleIndicesOffset),
+            static_cast<std::ptrdiff_t>(header.triangleIndexCount)),
+        gsl::span<const float>(
+            reinterpret_cast<const float*>(data + layout.leafTrianglesOffset),
+            static_cast<std::ptrdiff_t>(
+                PackedTriangles::getComponentCount(header.triangleIndexCount))),
+        { header.boundingBoxMinimum, header.boundingBoxMaximum },
+    };
+    if (!detail::isValidKDTree(arrays)) {
+        return std::nullopt;
+    }
+    return KDTree<SurfaceData>{ arrays, std::move(file) };
+}
+
+// Loads the tree for the builder's triangles from a file saved by an earlier run, or builds it
+// and saves it for next time when the file is missing or stale.
+template <template <typename> class TreeBuilder, typename SurfaceData>
+KDTree<SurfaceData> loadOrBuildKDTree(TreeBuilder<SurfaceData>& builder, const std::string& path)
+{
+    uint64_t contentHash = builder.getContentHash();
+    if (auto tree = loadKDTree<SurfaceData>(path, contentHash)) {
+        return std::move(*tree);
+    }
+
+    auto tree = builder.build();
+    try {
+        saveKDTree(tree, contentHash, path);
+    } catch (const std::runtime_error&) {
+        // Failing to save only costs the next run a rebuild.
+    }
+    return tree;
+}
+
+} // namespace rev
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Query counters cost an atomic update per query, so they're only collected in builds that ask
+// for them, normally through the REV_ENABLE_KDTREE_QUERY_STATS CMake option.
+#ifndef REV_KDTREE_QUERY_STATS
+#define REV_KDTREE_QUERY_STATS 0
+#endif
+
+namespace rev {
+
+constexpr bool kKDTreeQueryStatsEnabled = REV_KDTREE_QUERY_STATS;
+
+// Describes the shape of a built tree, for tuning the builders' cost constants.
+struct KDTreeBuildStats {
+    size_t nodeCount = 0;
+    size_t leafCount = 0;
+    size_t emptyLeafCount = 0;
+    // Leaves standing in for subtrees a lazy build hasn't built yet. They count as leaves, with
+    // all the triangles of their subtree.
+    size_t deferredLeafCount = 0;
+    size_t triangleCount = 0;
+    // The number of triangles in all the leaves together. Triangles straddling a split are
+    // counted once for each leaf they're in.
+    size_t leafTriangleCount = 0;
+    size_t maxLeafTriangleCount = 0;
+    // The number of leaves at each depth, with the root at depth zero.
+    std::vector<size_t> leafDepthHistogram;
+    float surfaceAreaCost = 0.0f;
+    // Zero for trees that weren't built in this process, such as those loaded from a file.
+    std::chrono::duration<double> buildTime{};
+
+    // How many leaves each triangle ends up in, on average.
+    float getDuplicationFactor() const
+    {
+        return triangleCount ? static_cast<float>(leafTriangleCount) / triangleCount : 0.0f;
+    }
+};
+
+struct KDTreeQueryStats {
+    uint64_t queryCount = 0;
+    uint64_t nodesVisited = 0;
+    // Counts each test of one ray or other query shape against one triangle.
+    uint64_t trianglesTested = 0;
+    // Counts the triangles each query reported, such as the closest hit of a ray or the triangles
+    // visited by a region query.
+    uint64_t hits = 0;
+};
+
+// Counts the work done by a single query. When query stats are disabled it's empty, and counting
+// compiles to nothing.
+class KDTreeQueryCounter {
+public:
+#if REV_KDTREE_QUERY_STATS
+    explicit KDTreeQueryCounter(size_t queryCount = 1) { _stats.queryCount = queryCount; }
+
+    void countNode() { _stats.nodesVisited++; }
+    void countTriangles(size_t count) { _stats.trianglesTested += count; }
+    void countHits(size_t count) { _stats.hits += count; }
+
+    KDTreeQueryStats get() const { return _stats; }
+
+private:
+    KDTreeQueryStats _stats;
+#else
+    explicit KDTreeQueryCounter(size_t = 1) {}
+
+    void countNode() {}
+    void countTriangles(size_t) {}
+    void countHits(size_t) {}
+
+    KDTreeQueryStats get() const { return {}; }
+#endif
+};
+
+// Totals the counters of queries that may run on several threads at once.
+class KDTreeQueryStatsTotals {
+public:
+    void add(const KDTreeQueryCounter& counter)
+    {
+        if constexpr (kKDTreeQueryStatsEnabled) {
+            auto stats = counter.get();
+            _queryCount.fetch_add(stats.queryCount, std::memory_order_relaxed);
+            _nodesVisited.fetch_add(stats.nodesVisited, std::memory_order_relaxed);
+            _trianglesTested.fetch_add(stats.trianglesTested, std::memory_order_relaxed);
+            _hits.fetch_add(stats.hits, std::memory_order_relaxed);
+        }
+    }
+
+    KDTreeQueryStats get() const
+    {
+        return { _queryCount.load(std::memory_order_relaxed),
+            _nodesVisited.load(std::memory_order_relaxed),
+            _trianglesTested.load(std::memory_order_relaxed),
+            _hits.load(std::memory_order_relaxed) };
+    }
+
+    void reset()
+    {
+        _queryCount = 0;
+        _nodesVisited = 0;
+        _trianglesTested = 0;
+        _hits = 0;
+    }
+
+private:
+    std::atomic<uint64_t> _queryCount{ 0 };
+    std::atomic<uint64_t> _nodesVisited{ 0 };
+    std::atomic<uint64_t> _trianglesTested{ 0 };
+    std::atomic<uint64_t> _hits{ 0 };
+};
+
+} // namespace rev
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "rev/geometry/Simd.h"
+#include "rev/geometry/Tools.h"
+#include <array>
+#include <gsl/gsl_assert>
+#include <gsl/span>
+#include <limits>
+
+namespace rev {
+
+// Where the ray in each lane enters and leaves the box in that lane.
+template <size_t Width>
+struct RayIntervalPacket {
+    // Lanes whose rays miss their box leave it before they enter it.
+    simd::Mask<Width> getHitLanes() const { return entryDistance <= exitDistance; }
+
+    simd::Float<Width> entryDistance;
+    simd::Float<Width> exitDistance;
+};
+
+// Several boxes stored as structure-of-arrays, so that one ray can be tested against all of them
+// at once.
+template <size_t Width>
+struct BoxPacket {
+    // Lanes past the last box hold empty boxes, which no ray enters.
+    static BoxPacket pack(gsl::span<const AxisAlignedBoundingBox> boxes)
+    {
+        Expects(static_cast<size_t>(boxes.size()) <= Width);
+        std::array<std::array<float, Width>, 3> minimums;
+        std::array<std::array<float, Width>, 3> maximums;
+        for (size_t k = 0; k < 3; k++) {
+            minimums[k].fill(std::numeric_limits<float>::infinity());
+            maximums[k].fill(-std::numeric_limits<float>::infinity());
+            for (size_t i = 0; i < static_cast<size_t>(boxes.size()); i++) {
+                minimums[k][i] = boxes[i].minimum[k];
+                maximums[k][i] = boxes[i].maximum[k];
+            }
+        }
+
+        using Float = simd::Float<Width>;
+        return { { Float::load(minimums[0].data()), Float::load(minimums[1].data()),
+                     Float::load(minimums[2].data()) },
+            { Float::load(maximums[0].data()), Float::load(maximums[1].data()),
+                Float::load(maximums[2].data()) } };
+    }
+
+    simd::Vec3<Width> minimum;
+    simd::Vec3<Width> maximum;
+};
+
+// Several rays set up for slab tests, the packet version of SlabRay.
+template <size_t Width>
+struct SlabRayPacket {
+    static SlabRayPacket pack(const std::array<Ray, Width>& rays)
+    {
+        std::array<std::array<float, Width>, 3> origins;
+        std::array<std::array<float, Width>, 3> inverseDirections;
+        for (size_t k = 0; k < 3; k++) {
+            for (size_t i = 0; i < Width; i++) {
+                origins[k][i] = rays[i].origin[k];
+                inverseDirections[k][i] = 1.0f / rays[i].direction[k];
+            }
+        }
+
+        using Float = simd::Float<Width>;
+        return { { Float::load(origins[0].data()), Float::load(origins[1].data()),
+                     Float::load(origins[2].data()) },
+            { Float::load(inverseDirections[0].data()), Float::load(inverseDirections[1].data()),
+                Float::load(inverseDirections[2].data()) } };
+    }
+
+    simd::Vec3<Width> origin;
+    simd::Vec3<Width> inverseDirection;
+};
+
+// The packet versions of AxisAlignedBoundingBox::clipRay. Every lane gives the same result as the
+// scalar test would for its ray and box.
+
+// Tests one ray against several boxes, as when choosing among the children of a wide tree node.
+template <size_t Width>
+RayIntervalPacket<Width> clipRay(const BoxPacket<Width>& boxes, const SlabRay& ray,
+    float minDistance = 0.0f, float maxDistance = std::numeric_limits<float>::infinity())
+{
+    using Float = simd::Float<Width>;
+
+    std::array<Float, 3> minimums{ boxes.minimum.x, boxes.minimum.y, boxes.minimum.z };
+    std::array<Float, 3> maximums{ boxes.maximum.x, boxes.maximum.y, boxes.maximum.z };
+    RayIntervalPacket<Width> interval{ Float::broadcast(minDistance),
+        Float::broadcast(maxDistance) };
+    for (size_t k = 0; k < 3; k++) {
+        // The ray's direction is shared by every lane, so the near faces are too.
+        bool isNegative = ray.inverseDirection[k] < 0.0f;
+        Float origin = Float::broadcast(ray.origin[k]);
+        Float inverseDirection = Float::broadcast(ray.inverseDirection[k]);
+        Float nearDistance = ((isNegative ? maximums[k] : minimums[k]) - origin) * inverseDirection;
+        Float farDistance = ((isNegative ? minimums[k] : maximums[k]) - origin) * inverseDirection;
+        // Rays lying in a slab boundary produce NaN, which min and max skip in this order.
+        interval.entryDistance = simd::max(nearDistance, interval.entryDistance);
+        interval.exitDistance = simd::min(farDistance, interval.exitDistance);
+    }
+    return interval;
+}
+
+// Tests several rays against one box, as when a packet of rays enters a tree.
+template <size_t Width>
+RayIntervalPacket<Width> clipRays(const AxisAlignedBoundingBox& box,
+    const SlabRayPacket<Width>& rays, float minDistance = 0.0f,
+    float maxDistance = std::numeric_limits<float>::infinity())
+{
+    using Float = simd::Float<Width>;
+
+    std::array<Float, 3> origins{ rays.origin.x, rays.origin.y, rays.origin.z };
+    std::array<Float, 3> inverseDirections{ rays.inverseDirection.x, rays.inverseDirection.y,
+        rays.inverseDirection.z };
+    RayIntervalPacket<Width> interval{ Float::broadcast(minDistance),
+        Float::broadcast(maxDistance) };
+    for (size_t k = 0; k < 3; k++) {
+        auto isNegative = inverseDirections[k] < Float::broadcast(0.0f);
+        Float minimum = Float::broadcast(box.minimum[k]);
+        Float maximum = Float::broadcast(box.maximum[k]);
+        Float nearDistance
+            = (simd::select(isNegative, maximum, minimum) - origins[k]) * inverseDirections[k];
+        Float farDistance
+            = (simd::select(isNegative, minimum, maximum) - origins[k]) * inverseDirections[k];
+        interval.entryDistance = simd::max(nearDistance, interval.entryDistance);
+        interval.exitDistance = simd::min(farDistance, interval.exitDistance);
+    }
+    return interval;
+}
+
+} // namespace rev
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "rev/geometry/Simd.h"
+#include <array>
+#include <glm/glm.hpp>
+#include <gsl/gsl_assert>
+#include <gsl/span>
+#include <vector>
+
+namespace rev {
+
+// Triangles stored as structure-of-arrays, with the first vertex and the two edges leaving it
+// precomputed. Intersection tests can then load the same component of several consecutive
+// triangles into one SIMD register, instead of gathering it from scattered triangle objects.
+//
+// This only views the components, which pack() lays out in a single flat array of floats. That
+// keeps them easy to write to a file and use again straight from memory.
+class PackedTriangles {
+public:
+    // Reads past the last triangle are allowed for up to this many lanes, so kernels can always
+    // load full registers and mask off the lanes they don't need.
+    static constexpr size_t kMaxLoadWidth = 8;
+
+    static size_t getComponentCount(size_t triangleCount)
+    {
+        return kComponentCount * getStride(triangleCount);
+    }
+
+    static std::vector<float> pack(gsl::span<const std::array<glm::vec3, 3>> triangles)
+    {
+        auto triangleCount = static_cast<size_t>(triangles.size());
+        size_t stride = getStride(triangleCount);
+        // The padding is zeroed, which makes it a degenerate triangle that no ray can hit.
+        std::vector<float> components(getComponentCount(triangleCount), 0.0f);
+        for (size_t i = 0; i < triangleCount; i++) {
+            const auto& vertices = triangles[i];
+            std::array<glm::vec3, 3> values{ vertices[0], vertices[1] - vertices[0],
+                vertices[2] - vertices[0] };
+            for (size_t j = 0; j < kComponentCount; j++) {
+                components[(j * stride) + i] = values[j / 3][j % 3];
+            }
+        }
+        return components;
+    }
+
+    PackedTriangles() = default;
+
+    PackedTriangles(gsl::span<const float> components, size_t triangleCount)
+        : _components(components.data())
+        , _size(triangleCount)
+        , _stride(getStride(triangleCount))
+    {
+        Expects(static_cast<size_t>(components.size()) == getComponentCount(triangleCount));
+    }
+
+    size_t size() const { return _size; }
+
+    glm::vec3 getVertex0(size_t index) const { return get(kVertex0, index); }
+    glm::vec3 getEdge1(size_t index) const { return get(kEdge1, index); }
+    glm::vec3 getEdge2(size_t index) const { return get(kEdge2, index); }
+
+    // Loads Width consecutive triangles starting at the given index.
+    template <size_t Width>
+    simd::Vec3<Width> loadVertex0(size_t index) const
+    {
+        return load<Width>(kVertex0, index);
+    }
+
+    template <size_t Width>
+    simd::Vec3<Width> loadEdge1(size_t index) const
+    {
+        return load<Width>(kEdge1, index);
+    }
+
+    template <size_t Width>
+    simd::Vec3<Width> loadEdge2(size_t index) const
+    {
+        return load<Width>(kEdge2, index);
+    }
+
+private:
+    static constexpr size_t kComponentCount = 9;
+    static constexpr size_t kVertex0 = 0;
+    static constexpr size_t kEdge1 = 3;
+    static constexpr size_t kEdge2 = 6;
+
+    static size_t getStride(size_t triangleCount) { return triangleCount + kMaxLoadWidth - 1; }
+
+    const float* getComponent(size_t component) const
+    {
+        return _components + (component * _stride);
+    }
+
+    glm::vec3 get(size_t firstComponent, size_t index) const
+    {
+        return { getComponent(firstComponent)[index], getComponent(firstComponent + 1)[index],
+            getComponent(firstComponent + 2)[index] };
+    }
+
+    template <size_t Width>
+    simd::Vec3<Width> load(size_t firstComponent, size_t index) const
+    {
+        static_assert(Width <= kMaxLoadWidth);
+        Expects(index < _size);
+        return { simd::Float<Width>::load(getComponent(firstComponent) + index),
+            simd::Float<Width>::load(getComponent(firstComponent + 1) + index),
+            simd::Float<Width>::load(getComponent(firstComponent + 2) + index) };
+    }
+
+    const float* _components = nullptr;
+    size_t _size = 0;
+    size_t _stride = 0;
+};
+
+} // namespace rev
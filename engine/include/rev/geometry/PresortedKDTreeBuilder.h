@@ -0,0 +1,455 @@
+#pragma once
+
+#include "rev/WorkerPool.h"
+#include "rev/geometry/KDTree.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <gsl/gsl_assert>
+#include <gsl/span>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <tuple>
+#include <vector>
+
+namespace rev {
+
+struct KDTreeBuildOptions {
+    // When set, large nodes are built with tasks on this pool. The resulting tree is identical to
+    // the one built on a single thread.
+    std::shared_ptr<WorkerPool> workerPool;
+
+    // Nodes holding more primitives than this build their two subtrees as parallel tasks.
+    size_t parallelSubtreeThreshold = 2048;
+
+    // Nodes holding more primitives than this search the three dimensions for their best split in
+    // parallel. Only nodes near the root are that large.
+    size_t parallelSplitSearchThreshold = 32768;
+
+    // When nonzero, nodes holding no more primitives than this are left unbuilt, and kept as
+    // deferred leaves until a query first reaches them. This cuts the startup cost of large
+    // scenes that are only ever queried in part. Primitives must be copyable, since each subtree
+    // is built from copies of its primitives.
+    size_t lazySubtreeThreshold = 0;
+};
+
+// Builds the same surface area heuristic tree as BasicKDTreeBuilder, but in O(N log N) time,
+// following Wald and Havran's "On building fast kd-trees for ray tracing, and on doing that in
+// O(N log N)". Split candidates are sorted once up front. Each node then partitions its already
+// sorted event lists in linear time, and only re-sorts the events of primitives that straddle its
+// split plane.
+template <typename Primitive>
+class BasicPresortedKDTreeBuilder {
+public:
+    BasicPresortedKDTreeBuilder() = default;
+
+    explicit BasicPresortedKDTreeBuilder(KDTreeBuildOptions options)
+        : _options(std::move(options))
+    {
+    }
+
+    void addPrimitive(Primitive primitive)
+    {
+        _boundingBox.expandToBox(primitive.getBoundingBox());
+        _primitives.push_back(std::make_unique<Primitive>(std::move(primitive)));
+    }
+
+    KDTreeFor<Primitive> build()
+    {
+        Expects(!_primitives.empty());
+        auto buildStart = std::chrono::steady_clock::now();
+
+        NodeContents root;
+        for (size_t i = 0; i < _primitives.size(); i++) {
+            const auto& primitive = *_primitives[i];
+            root.primitives.push_back(static_cast<uint32_t>(i));
+            appendEvents(
+                root.events, static_cast<uint32_t>(i), primitive.getBoundingBox(), primitive);
+        }
+        for (auto& events : root.events) {
+            std::sort(events.begin(), events.end());
+        }
+
+        auto rootNode = createNode(_boundingBox, std::move(root), 0);
+        KDTreeNodes::SubtreeBuilder buildSubtree;
+        if (_options.lazySubtreeThreshold) {
+            buildSubtree = makeSubtreeBuilder(_options);
+        }
+        return KDTreeFor<Primitive>{ std::move(_primitives), std::move(rootNode), _boundingBox,
+            buildStart, std::move(buildSubtree) };
+    }
+
+private:
+    struct Event {
+        enum class Type : uint8_t {
+            Ending = 0,
+            Planar = 1,
+            Starting = 2,
+        };
+
+        bool operator<(const Event& other) const
+        {
+            return std::tie(position, type) < std::tie(other.position, other.type);
+        }
+
+        float position;
+        // Index into the primitive list of the node that owns the event.
+        uint32_t primitive;
+        Type type;
+    };
+
+    // Events are kept in one list per dimension, each sorted by position.
+    using EventLists = std::array<std::vector<Event>, 3>;
+
+    struct NodeContents {
+        // Indexes into _primitives.
+        std::vector<uint32_t> primitives;
+        EventLists events;
+    };
+
+    struct Split {
+        AxisAlignedPlane plane;
+        KDTreeSplitSide side;
+        float cost;
+    };
+
+    enum class Placement : uint8_t {
+        Both,
+        Left,
+        Right,
+    };
+
+    static constexpr uint32_t kNotInChild = std::numeric_limits<uint32_t>::max();
+
+    // Deferred subtrees are built in full on the thread of the query that reaches them. They
+    // don't use the worker pool: a query waiting on a task could be handed another query's task,
+    // which may need the very subtree that's being built.
+    static KDTreeNodes::SubtreeBuilder makeSubtreeBuilder(KDTreeBuildOptions options)
+    {
+        options.workerPool = nullptr;
+        options.lazySubtreeThreshold = 0;
+        return [options](const KDTreeNodes& tree, gsl::span<const uint32_t> primitiveIndices,
+                   const AxisAlignedBoundingBox& box) {
+            BasicPresortedKDTreeBuilder builder(options);
+            return builder.buildSubtree(
+                static_cast<const KDTreeFor<Primitive>&>(tree), primitiveIndices, box);
+        };
+    }
+
+    std::shared_ptr<const KDTreeNodes> buildSubtree(const KDTreeFor<Primitive>& parent,
+        gsl::span<const uint32_t> parentIndices, const AxisAlignedBoundingBox& box)
+    {
+        NodeContents root;
+        std::vector<uint32_t> keptIndices;
+        for (auto parentIndex : parentIndices) {
+            const auto& primitive = parent.getPrimitive(parentIndex);
+            // As with primitives straddling a split, one that only touches the box is left out
+            // when clipping finds nothing of it inside.
+            auto clippedBox = primitive.clippedBoundingBox(box);
+            if (!clippedBox) {
+                continue;
+            }
+            auto primitiveIndex = static_cast<uint32_t>(_primitives.size());
+            _primitives.push_back(std::make_unique<Primitive>(primitive));
+            keptIndices.push_back(parentIndex);
+            root.primitives.push_back(primitiveIndex);
+            appendEvents(root.events, primitiveIndex, *clippedBox, primitive);
+        }
+        for (auto& events : root.events) {
+            std::sort(events.begin(), events.end());
+        }
+
+        auto rootNode = createNode(box, std::move(root), 0);
+        return std::make_shared<KDTreeFor<Primitive>>(
+            parent, keptIndices, _primitives, *rootNode, box);
+    }
+
+    std::unique_ptr<MapNode<Primitive>> createNode(
+        const AxisAlignedBoundingBox& box, NodeContents contents, size_t depth)
+    {
+        size_t primitiveCount = contents.primitives.size();
+        if ((primitiveCount > 0) && (depth + 1 < kMaxKDTreeDepth)) {
+            // Small nodes are deferred before searching for a split, which leaves that search to
+            // the subtree build, if a query ever reaches it.
+            if (primitiveCount <= _options.lazySubtreeThreshold) {
+                return createLeaf(contents, box);
+            }
+
+            Split split = findBestSplit(box, contents.events, primitiveCount);
+            float terminateCost = static_cast<float>(primitiveCount) * kKDTreeIntersectionCost;
+            if (terminateCost > split.cost) {
+                auto boxes = box.split(split.plane);
+                auto children = partition(contents, split, boxes[0], boxes[1]);
+                contents = {};
+
+                BranchNode<Primitive> branch{ split.plane };
+                if (_options.workerPool && (primitiveCount > _options.parallelSubtreeThreshold)) {
+                    TaskGroup group(*_options.workerPool);
+                    group.run([this, &branch, &boxes, &children, depth]() {
+                        branch.left = createNode(boxes[0], std::move(children.first), depth + 1);
+                    });
+                    branch.right = createNode(boxes[1], std::move(children.second), depth + 1);
+                    group.wait();
+                } else {
+                    branch.left = createNode(boxes[0], std::move(children.first), depth + 1);
+                    branch.right = createNode(boxes[1], std::move(children.second), depth + 1);
+                }
+                return std::make_unique<MapNode<Primitive>>(std::move(branch));
+            }
+        }
+
+        return createLeaf(contents);
+    }
+
+    // Leaves given a box are deferred, with their subtree built over that box later.
+    std::unique_ptr<MapNode<Primitive>> createLeaf(const NodeContents& contents,
+        std::optional<AxisAlignedBoundingBox> deferredBox = std::nullopt) const
+    {
+        LeafNode<Primitive> leaf;
+        for (auto primitiveIndex : contents.primitives) {
+            leaf.primitives.insert(_primitives[primitiveIndex].get());
+        }
+        leaf.deferredBox = deferredBox;
+        return std::make_unique<MapNode<Primitive>>(std::move(leaf));
+    }
+
+    Split findBestSplit(
+        const AxisAlignedBoundingBox& box, const EventLists& events, size_t primitiveCount) const
+    {
+        std::array<Split, 3> splits;
+        if (_options.workerPool && (primitiveCount > _options.parallelSplitSearchThreshold)) {
+            TaskGroup group(*_options.workerPool);
+            for (uint8_t dimension = 1; dimension < 3; dimension++) {
+                group.run([this, &splits, &box, &events, primitiveCount, dimension]() {
+                    splits[dimension] = findBestSplit(box, events, primitiveCount, dimension);
+                });
+            }
+            splits[0] = findBestSplit(box, events, primitiveCount, 0);
+            group.wait();
+        } else {
+            for (uint8_t dimension = 0; dimension < 3; dimension++) {
+                splits[dimension] = findBestSplit(box, events, primitiveCount, dimension);
+            }
+        }
+
+        Split best = splits[0];
+        for (uint8_t dimension = 1; dimension < 3; dimension++) {
+            if (isBetterSplit(splits[dimension], best)) {
+                best = splits[dimension];
+            }
+        }
+        return best;
+    }
+
+    // Sweeps a dimension's sorted events, keeping running counts of the primitives on either side
+    // of the candidate plane.
+    Split findBestSplit(const AxisAlignedBoundingBox& box, const EventLists& events,
+        size_t primitiveCount, uint8_t dimension) const
+    {
+        Split best{ {}, KDTreeSplitSide::Left, std::numeric_limits<float>::infinity() };
+        size_t leftPrimitiveCount = 0;
+        size_t rightPrimitiveCount = primitiveCount;
+
+        auto iter = events[dimension].begin();
+        auto eventsEnd = events[dimension].end();
+        while (iter != eventsEnd) {
+            float position = iter->position;
+            auto countEvents = [&iter, eventsEnd, position](typename Event::Type type) {
+                size_t count = 0;
+                while ((iter != eventsEnd) && (iter->position == position)
+                    && (iter->type == type)) {
+                    count++;
+                    iter++;
+                }
+                return count;
+            };
+            size_t endingPrimitiveCount = countEvents(Event::Type::Ending);
+            size_t planarPrimitiveCount = countEvents(Event::Type::Planar);
+            size_t startingPrimitiveCount = countEvents(Event::Type::Starting);
+
+            rightPrimitiveCount -= planarPrimitiveCount;
+            rightPrimitiveCount -= endingPrimitiveCount;
+            AxisAlignedPlane candidatePlane{ dimension, position };
+            auto [side, cost] = evaluateKDTreeSplit(box, candidatePlane, leftPrimitiveCount,
+                planarPrimitiveCount, rightPrimitiveCount);
+            Split candidate{ candidatePlane, side, cost };
+            if (isBetterSplit(candidate, best)) {
+                best = candidate;
+            }
+            leftPrimitiveCount += planarPrimitiveCount;
+            leftPrimitiveCount += startingPrimitiveCount;
+        }
+        return best;
+    }
+
+    // Ties are broken the same way BasicKDTreeBuilder breaks them, in favor of the lowest plane
+    // and then the lowest dimension, so both builders pick identical planes. Candidates must be
+    // offered in order of dimension.
+    static bool isBetterSplit(const Split& candidate, const Split& best)
+    {
+        return (candidate.cost < best.cost)
+            || ((candidate.cost == best.cost) && (candidate.plane.boundary < best.plane.boundary));
+    }
+
+    std::pair<NodeContents, NodeContents> partition(const NodeContents& contents,
+        const Split& split, const AxisAlignedBoundingBox& leftBox,
+        const AxisAlignedBoundingBox& rightBox)
+    {
+        size_t primitiveCount = contents.primitives.size();
+        const AxisAlignedPlane& plane = split.plane;
+
+        // Only the events along the split dimension are needed to place each primitive. Anything
+        // that neither ends before the plane nor starts after it straddles the plane.
+        std::vector<Placement> placements(primitiveCount, Placement::Both);
+        for (const auto& event : contents.events[plane.dimensionIndex]) {
+            switch (event.type) {
+            case Event::Type::Ending:
+                if (!(event.position > plane.boundary)) {
+                    placements[event.primitive] = Placement::Left;
+                }
+                break;
+            case Event::Type::Starting:
+                if (!(event.position < plane.boundary)) {
+                    placements[event.primitive] = Placement::Right;
+                }
+                break;
+            case Event::Type::Planar:
+                if (event.position < plane.boundary) {
+                    placements[event.primitive] = Placement::Left;
+                } else if (event.position > plane.boundary) {
+                    placements[event.primitive] = Placement::Right;
+                } else {
+                    placements[event.primitive] = (split.side == KDTreeSplitSide::Left)
+                        ? Placement::Left
+                        : Placement::Right;
+                }
+                break;
+            }
+        }
+
+        NodeContents left;
+        NodeContents right;
+        EventLists leftStraddlingEvents;
+        EventLists rightStraddlingEvents;
+        std::vector<uint32_t> leftIndices(primitiveCount, kNotInChild);
+        std::vector<uint32_t> rightIndices(primitiveCount, kNotInChild);
+        for (size_t i = 0; i < primitiveCount; i++) {
+            uint32_t primitiveIndex = contents.primitives[i];
+            switch (placements[i]) {
+            case Placement::Left:
+                leftIndices[i] = static_cast<uint32_t>(left.primitives.size());
+                left.primitives.push_back(primitiveIndex);
+                break;
+            case Placement::Right:
+                rightIndices[i] = static_cast<uint32_t>(right.primitives.size());
+                right.primitives.push_back(primitiveIndex);
+                break;
+            case Placement::Both: {
+                auto& primitive = *_primitives[primitiveIndex];
+                Expects(primitive.getBoundingBox().isLeftOfPlane(plane));
+                Expects(primitive.getBoundingBox().isRightOfPlane(plane));
+
+                auto leftClipBox = primitive.clippedBoundingBox(leftBox);
+                if (leftClipBox) {
+                    auto localIndex = static_cast<uint32_t>(left.primitives.size());
+                    left.primitives.push_back(primitiveIndex);
+                    appendEvents(leftStraddlingEvents, localIndex, *leftClipBox, primitive);
+                }
+
+                auto rightClipBox = primitive.clippedBoundingBox(rightBox);
+                if (rightClipBox) {
+                    auto localIndex = static_cast<uint32_t>(right.primitives.size());
+                    right.primitives.push_back(primitiveIndex);
+                    appendEvents(rightStraddlingEvents, localIndex, *rightClipBox, primitive);
+                }
+                break;
+            }
+            }
+        }
+
+        for (uint8_t k = 0; k < 3; k++) {
+            std::vector<Event> leftEvents;
+            std::vector<Event> rightEvents;
+            for (const auto& event : contents.events[k]) {
+                switch (placements[event.primitive]) {
+                case Placement::Left:
+                    leftEvents.push_back(
+                        { event.position, leftIndices[event.primitive], event.type });
+                    break;
+                case Placement::Right:
+                    rightEvents.push_back(
+                        { event.position, rightIndices[event.primitive], event.type });
+                    break;
+                case Placement::Both:
+                    // Replaced by the events of the clipped bounding boxes.
+                    break;
+                }
+            }
+
+            left.events[k] = mergeEvents(leftEvents, leftStraddlingEvents[k]);
+            right.events[k] = mergeEvents(rightEvents, rightStraddlingEvents[k]);
+        }
+
+        return { std::move(left), std::move(right) };
+    }
+
+    static std::vector<Event> mergeEvents(
+        const std::vector<Event>& sortedEvents, std::vector<Event>& unsortedEvents)
+    {
+        std::sort(unsortedEvents.begin(), unsortedEvents.end());
+
+        std::vector<Event> merged;
+        merged.reserve(sortedEvents.size() + unsortedEvents.size());
+        std::merge(sortedEvents.begin(), sortedEvents.end(), unsortedEvents.begin(),
+            unsortedEvents.end(), std::back_inserter(merged));
+        return merged;
+    }
+
+    static void appendEvents(EventLists& events, uint32_t localIndex,
+        const AxisAlignedBoundingBox& boundingBox, const Primitive& primitive)
+    {
+        AxisAlignedBoundingBox actualBox = primitive.getBoundingBox();
+        for (uint8_t k = 0; k < 3; k++) {
+            float minimum = boundingBox.minimum[k];
+            float maximum = boundingBox.maximum[k];
+            Expects(!(minimum < actualBox.minimum[k]));
+            Expects(!(maximum > actualBox.maximum[k]));
+            if (minimum < maximum) {
+                events[k].push_back(Event{ maximum, localIndex, Event::Type::Ending });
+                events[k].push_back(Event{ minimum, localIndex, Event::Type::Starting });
+            } else {
+                events[k].push_back(Event{ minimum, localIndex, Event::Type::Planar });
+            }
+        }
+    }
+
+    KDTreeBuildOptions _options;
+    AxisAlignedBoundingBox _boundingBox;
+    std::vector<std::unique_ptr<Primitive>> _primitives;
+};
+
+template <typename SurfaceData>
+class PresortedKDTreeBuilder : public BasicPresortedKDTreeBuilder<Triangle<SurfaceData>> {
+public:
+    using BasicPresortedKDTreeBuilder<Triangle<SurfaceData>>::BasicPresortedKDTreeBuilder;
+
+    void addTriangle(std::array<glm::vec3, 3> vertices, SurfaceData data)
+    {
+        Expects(!glm::any(glm::isnan(vertices[0])));
+        Expects(!glm::any(glm::isnan(vertices[1])));
+        Expects(!glm::any(glm::isnan(vertices[2])));
+
+        _contentHash.add(vertices, data);
+        this->addPrimitive(Triangle<SurfaceData>{ vertices, std::move(data) });
+    }
+
+    // Identifies the triangles added so far, for matching them against a saved tree.
+    uint64_t getContentHash() const { return _contentHash.get(); }
+
+private:
+    TriangleContentHash _contentHash;
+};
+}
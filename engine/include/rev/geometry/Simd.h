@@ -0,0 +1,428 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define REV_SIMD_SSE 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX__)
+#define REV_SIMD_AVX 1
+#include <immintrin.h>
+#endif
+
+namespace rev::simd {
+
+// A fixed number of floats processed in lock step. Four lanes map onto SSE registers and eight
+// lanes onto AVX registers when the target supports them. Other widths, and targets without those
+// instruction sets, use plain loops that the compiler is free to vectorize.
+template <size_t Width>
+struct Float {
+    static constexpr size_t kWidth = Width;
+
+    static Float broadcast(float value)
+    {
+        Float result;
+        result.lanes.fill(value);
+        return result;
+    }
+
+    static Float load(const float* values)
+    {
+        Float result;
+        for (size_t i = 0; i < Width; i++) {
+            result.lanes[i] = values[i];
+        }
+        return result;
+    }
+
+    void store(float* values) const
+    {
+        for (size_t i = 0; i < Width; i++) {
+            values[i] = lanes[i];
+        }
+    }
+
+    std::array<float, Width> lanes;
+};
+
+// The result of comparing two Floats lane by lane.
+template <size_t Width>
+struct Mask {
+    static constexpr size_t kWidth = Width;
+
+    static Mask fromBits(uint32_t bits) { return { bits }; }
+
+    // One bit per lane, with lane 0 in the lowest bit.
+    uint32_t toBits() const { return bits; }
+
+    uint32_t bits;
+};
+
+namespace detail {
+    template <size_t Width, typename Operation>
+    Float<Width> mapLanes(const Float<Width>& a, const Float<Width>& b, Operation&& operation)
+    {
+        Float<Width> result;
+        for (size_t i = 0; i < Width; i++) {
+            result.lanes[i] = operation(a.lanes[i], b.lanes[i]);
+        }
+        return result;
+    }
+
+    template <size_t Width, typename Comparison>
+    Mask<Width> compareLanes(const Float<Width>& a, const Float<Width>& b, Comparison&& comparison)
+    {
+        uint32_t bits = 0;
+        for (size_t i = 0; i < Width; i++) {
+            bits |= static_cast<uint32_t>(comparison(a.lanes[i], b.lanes[i])) << i;
+        }
+        return { bits };
+    }
+} // namespace detail
+
+template <size_t Width>
+Float<Width> operator+(const Float<Width>& a, const Float<Width>& b)
+{
+    return detail::mapLanes(a, b, [](float x, float y) { return x + y; });
+}
+
+template <size_t Width>
+Float<Width> operator-(const Float<Width>& a, const Float<Width>& b)
+{
+    return detail::mapLanes(a, b, [](float x, float y) { return x - y; });
+}
+
+template <size_t Width>
+Float<Width> operator*(const Float<Width>& a, const Float<Width>& b)
+{
+    return detail::mapLanes(a, b, [](float x, float y) { return x * y; });
+}
+
+template <size_t Width>
+Float<Width> operator/(const Float<Width>& a, const Float<Width>& b)
+{
+    return detail::mapLanes(a, b, [](float x, float y) { return x / y; });
+}
+
+// Like the SSE instructions, min and max return the second operand when either one is NaN.
+template <size_t Width>
+Float<Width> min(const Float<Width>& a, const Float<Width>& b)
+{
+    return detail::mapLanes(a, b, [](float x, float y) { return (x < y) ? x : y; });
+}
+
+template <size_t Width>
+Float<Width> max(const Float<Width>& a, const Float<Width>& b)
+{
+    return detail::mapLanes(a, b, [](float x, float y) { return (x > y) ? x : y; });
+}
+
+template <size_t Width>
+Float<Width> abs(const Float<Width>& a)
+{
+    return detail::mapLanes(a, a, [](float x, float) { return (x < 0.0f) ? -x : x; });
+}
+
+template <size_t Width>
+Mask<Width> operator<(const Float<Width>& a, const Float<Width>& b)
+{
+    return detail::compareLanes(a, b, [](float x, float y) { return x < y; });
+}
+
+template <size_t Width>
+Mask<Width> operator<=(const Float<Width>& a, const Float<Width>& b)
+{
+    return detail::compareLanes(a, b, [](float x, float y) { return x <= y; });
+}
+
+template <size_t Width>
+Mask<Width> operator>(const Float<Width>& a, const Float<Width>& b)
+{
+    return detail::compareLanes(a, b, [](float x, float y) { return x > y; });
+}
+
+template <size_t Width>
+Mask<Width> operator>=(const Float<Width>& a, const Float<Width>& b)
+{
+    return detail::compareLanes(a, b, [](float x, float y) { return x >= y; });
+}
+
+template <size_t Width>
+Mask<Width> operator&(const Mask<Width>& a, const Mask<Width>& b)
+{
+    return { a.bits & b.bits };
+}
+
+template <size_t Width>
+Mask<Width> operator|(const Mask<Width>& a, const Mask<Width>& b)
+{
+    return { a.bits | b.bits };
+}
+
+// Lanes set in a but not in b.
+template <size_t Width>
+Mask<Width> andNot(const Mask<Width>& a, const Mask<Width>& b)
+{
+    return { a.bits & ~b.bits };
+}
+
+// Picks lanes from a where the mask is set, and from b elsewhere.
+template <size_t Width>
+Float<Width> select(const Mask<Width>& mask, const Float<Width>& a, const Float<Width>& b)
+{
+    Float<Width> result;
+    for (size_t i = 0; i < Width; i++) {
+        result.lanes[i] = ((mask.bits >> i) & 1) ? a.lanes[i] : b.lanes[i];
+    }
+    return result;
+}
+
+#if REV_SIMD_SSE
+template <>
+struct Float<4> {
+    static constexpr size_t kWidth = 4;
+
+    static Float broadcast(float value) { return { _mm_set1_ps(value) }; }
+    static Float load(const float* values) { return { _mm_loadu_ps(values) }; }
+    void store(float* values) const { _mm_storeu_ps(values, value); }
+
+    __m128 value;
+};
+
+template <>
+struct Mask<4> {
+    static constexpr size_t kWidth = 4;
+
+    static Mask fromBits(uint32_t bits)
+    {
+        __m128i laneBits = _mm_set_epi32(8, 4, 2, 1);
+        __m128i selected = _mm_and_si128(_mm_set1_epi32(static_cast<int>(bits)), laneBits);
+        return { _mm_castsi128_ps(_mm_cmpeq_epi32(selected, laneBits)) };
+    }
+
+    uint32_t toBits() const { return static_cast<uint32_t>(_mm_movemask_ps(value)); }
+
+    __m128 value;
+};
+
+inline Float<4> operator+(Float<4> a, Float<4> b) { return { _mm_add_ps(a.value, b.value) }; }
+inline Float<4> operator-(Float<4> a, Float<4> b) { return { _mm_sub_ps(a.value, b.value) }; }
+inline Float<4> operator*(Float<4> a, Float<4> b) { return { _mm_mul_ps(a.value, b.value) }; }
+inline Float<4> operator/(Float<4> a, Float<4> b) { return { _mm_div_ps(a.value, b.value) }; }
+inline Float<4> min(Float<4> a, Float<4> b) { return { _mm_min_ps(a.value, b.value) }; }
+inline Float<4> max(Float<4> a, Float<4> b) { return { _mm_max_ps(a.value, b.value) }; }
+inline Float<4> abs(Float<4> a) { return { _mm_andnot_ps(_mm_set1_ps(-0.0f), a.value) }; }
+
+inline Mask<4> operator<(Float<4> a, Float<4> b) { return { _mm_cmplt_ps(a.value, b.value) }; }
+inline Mask<4> operator<=(Float<4> a, Float<4> b) { return { _mm_cmple_ps(a.value, b.value) }; }
+inline Mask<4> operator>(Float<4> a, Float<4> b) { return { _mm_cmpgt_ps(a.value, b.value) }; }
+inline Mask<4> operator>=(Float<4> a, Float<4> b) { return { _mm_cmpge_ps(a.value, b.value) }; }
+
+inline Mask<4> operator&(Mask<4> a, Mask<4> b) { return { _mm_and_ps(a.value, b.value) }; }
+inline Mask<4> operator|(Mask<4> a, Mask<4> b) { return { _mm_or_ps(a.value, b.value) }; }
+inline Mask<4> andNot(Mask<4> a, Mask<4> b) { return { _mm_andnot_ps(b.value, a.value) }; }
+
+inline Float<4> select(Mask<4> mask, Float<4> a, Float<4> b)
+{
+    return { _mm_or_ps(_mm_and_ps(mask.value, a.value), _mm_andnot_ps(mask.value, b.value)) };
+}
+#endif
+
+#if REV_SIMD_AVX
+template <>
+struct Float<8> {
+    static constexpr size_t kWidth = 8;
+
+    static Float broadcast(float value) { return { _mm256_set1_ps(value) }; }
+    static Float load(const float* values) { return { _mm256_loadu_ps(values) }; }
+    void store(float* values) const { _mm256_storeu_ps(values, value); }
+
+    __m256 value;
+};
+
+template <>
+struct Mask<8> {
+    static constexpr size_t kWidth = 8;
+
+    static Mask fromBits(uint32_t bits)
+    {
+        alignas(32) std::array<float, 8> lanes;
+        for (size_t i = 0; i < 8; i++) {
+            lanes[i] = ((bits >> i) & 1) ? -1.0f : 0.0f;
+        }
+        // Only the sign bit matters to movemask and blendv.
+        return { _mm256_load_ps(lanes.data()) };
+    }
+
+    uint32_t toBits() const { return static_cast<uint32_t>(_mm256_movemask_ps(value)); }
+
+    __m256 value;
+};
+
+inline Float<8> operator+(Float<8> a, Float<8> b) { return { _mm256_add_ps(a.value, b.value) }; }
+inline Float<8> operator-(Float<8> a, Float<8> b) { return { _mm256_sub_ps(a.value, b.value) }; }
+inline Float<8> operator*(Float<8> a, Float<8> b) { return { _mm256_mul_ps(a.value, b.value) }; }
+inline Float<8> operator/(Float<8> a, Float<8> b) { return { _mm256_div_ps(a.value, b.value) }; }
+inline Float<8> min(Float<8> a, Float<8> b) { return { _mm256_min_ps(a.value, b.value) }; }
+inline Float<8> max(Float<8> a, Float<8> b) { return { _mm256_max_ps(a.value, b.value) }; }
+inline Float<8> abs(Float<8> a) { return { _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.value) }; }
+
+inline Mask<8> operator<(Float<8> a, Float<8> b)
+{
+    return { _mm256_cmp_ps(a.value, b.value, _CMP_LT_OQ) };
+}
+
+inline Mask<8> operator<=(Float<8> a, Float<8> b)
+{
+    return { _mm256_cmp_ps(a.value, b.value, _CMP_LE_OQ) };
+}
+
+inline Mask<8> operator>(Float<8> a, Float<8> b)
+{
+    return { _mm256_cmp_ps(a.value, b.value, _CMP_GT_OQ) };
+}
+
+inline Mask<8> operator>=(Float<8> a, Float<8> b)
+{
+    return { _mm256_cmp_ps(a.value, b.value, _CMP_GE_OQ) };
+}
+
+inline Mask<8> operator&(Mask<8> a, Mask<8> b) { return { _mm256_and_ps(a.value, b.value) }; }
+inline Mask<8> operator|(Mask<8> a, Mask<8> b) { return { _mm256_or_ps(a.value, b.value) }; }
+inline Mask<8> andNot(Mask<8> a, Mask<8> b) { return { _mm256_andnot_ps(b.value, a.value) }; }
+
+inline Float<8> select(Mask<8> mask, Float<8> a, Float<8> b)
+{
+    return { _mm256_blendv_ps(b.value, a.value, mask.value) };
+}
+#endif
+
+#if REV_SIMD_SSE && !REV_SIMD_AVX
+// Without AVX, eight lanes are processed as two SSE halves.
+template <>
+struct Float<8> {
+    static constexpr size_t kWidth = 8;
+
+    static Float broadcast(float value)
+    {
+        return { Float<4>::broadcast(value), Float<4>::broadcast(value) };
+    }
+
+    static Float load(const float* values)
+    {
+        return { Float<4>::load(values), Float<4>::load(values + 4) };
+    }
+
+    void store(float* values) const
+    {
+        low.store(values);
+        high.store(values + 4);
+    }
+
+    Float<4> low;
+    Float<4> high;
+};
+
+template <>
+struct Mask<8> {
+    static constexpr size_t kWidth = 8;
+
+    static Mask fromBits(uint32_t bits)
+    {
+        return { Mask<4>::fromBits(bits & 0xf), Mask<4>::fromBits(bits >> 4) };
+    }
+
+    uint32_t toBits() const { return low.toBits() | (high.toBits() << 4); }
+
+    Mask<4> low;
+    Mask<4> high;
+};
+
+inline Float<8> operator+(Float<8> a, Float<8> b) { return { a.low + b.low, a.high + b.high }; }
+inline Float<8> operator-(Float<8> a, Float<8> b) { return { a.low - b.low, a.high - b.high }; }
+inline Float<8> operator*(Float<8> a, Float<8> b) { return { a.low * b.low, a.high * b.high }; }
+inline Float<8> operator/(Float<8> a, Float<8> b) { return { a.low / b.low, a.high / b.high }; }
+inline Float<8> min(Float<8> a, Float<8> b) { return { min(a.low, b.low), min(a.high, b.high) }; }
+inline Float<8> max(Float<8> a, Float<8> b) { return { max(a.low, b.low), max(a.high, b.high) }; }
+inline Float<8> abs(Float<8> a) { return { abs(a.low), abs(a.high) }; }
+
+inline Mask<8> operator<(Float<8> a, Float<8> b) { return { a.low < b.low, a.high < b.high }; }
+inline Mask<8> operator<=(Float<8> a, Float<8> b) { return { a.low <= b.low, a.high <= b.high }; }
+inline Mask<8> operator>(Float<8> a, Float<8> b) { return { a.low > b.low, a.high > b.high }; }
+inline Mask<8> operator>=(Float<8> a, Float<8> b) { return { a.low >= b.low, a.high >= b.high }; }
+
+inline Mask<8> operator&(Mask<8> a, Mask<8> b) { return { a.low & b.low, a.high & b.high }; }
+inline Mask<8> operator|(Mask<8> a, Mask<8> b) { return { a.low | b.low, a.high | b.high }; }
+inline Mask<8> andNot(Mask<8> a, Mask<8> b)
+{
+    return { andNot(a.low, b.low), andNot(a.high, b.high) };
+}
+
+inline Float<8> select(Mask<8> mask, Float<8> a, Float<8> b)
+{
+    return { select(mask.low, a.low, b.low), select(mask.high, a.high, b.high) };
+}
+#endif
+
+template <typename MaskType>
+bool any(const MaskType& mask)
+{
+    return mask.toBits() != 0;
+}
+
+template <typename MaskType>
+bool none(const MaskType& mask)
+{
+    return mask.toBits() == 0;
+}
+
+template <typename MaskType>
+bool all(const MaskType& mask)
+{
+    return mask.toBits() == ((uint32_t{ 1 } << MaskType::kWidth) - 1);
+}
+
+// A vector of three Floats, for working on several points or directions at once.
+template <size_t Width>
+struct Vec3 {
+    static Vec3 broadcast(const glm::vec3& value)
+    {
+        return { Float<Width>::broadcast(value.x), Float<Width>::broadcast(value.y),
+            Float<Width>::broadcast(value.z) };
+    }
+
+    Float<Width> x;
+    Float<Width> y;
+    Float<Width> z;
+};
+
+template <size_t Width>
+Vec3<Width> operator-(const Vec3<Width>& a, const Vec3<Width>& b)
+{
+    return { a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+// Matches the operation order of glm::dot and glm::cross, so lanes produce the same results as
+// the equivalent scalar code.
+template <size_t Width>
+Float<Width> dot(const Vec3<Width>& a, const Vec3<Width>& b)
+{
+    return (a.x * b.x) + (a.y * b.y) + (a.z * b.z);
+}
+
+template <size_t Width>
+Vec3<Width> cross(const Vec3<Width>& a, const Vec3<Width>& b)
+{
+    return {
+        (a.y * b.z) - (b.y * a.z),
+        (a.z * b.x) - (b.z * a.x),
+        (a.x * b.y) - (b.x * a.y),
+    };
+}
+
+} // namespace rev::simd
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <glm/glm.hpp>
 #include <gsl/gsl>
+#include <limits>
 #include <optional>
 
 namespace rev {
@@ -21,6 +25,45 @@ struct Sphere {
     float radius;
 };
 
+// A ray set up for slab tests against many boxes, with the inverse of its direction worked out
+// once. Zero direction components invert to infinity, which the slab tests handle.
+struct SlabRay {
+    explicit SlabRay(const Ray& ray)
+        : origin(ray.origin)
+        , inverseDirection(1.0f / ray.direction)
+    {
+    }
+
+    glm::vec3 origin;
+    glm::vec3 inverseDirection;
+};
+
+// The stretch of a ray that lies inside a box, between the distances where it enters and leaves.
+struct RayInterval {
+    // Rays that miss the box leave it before they enter it.
+    bool isHit() const { return entryDistance <= exitDistance; }
+
+    float entryDistance;
+    float exitDistance;
+};
+
+// The smaller root of a * x^2 + b * x + c, if it lies in [0, maxRoot]. When the quadratic measures
+// how far something is inside a shape over time, this is when it first enters the shape.
+inline std::optional<float> findSmallestQuadraticRoot(float a, float b, float c, float maxRoot)
+{
+    float discriminant = (b * b) - (4.0f * a * c);
+    if ((a == 0.0f) || (discriminant < 0.0f)) {
+        return std::nullopt;
+    }
+
+    float root = std::sqrt(discriminant);
+    float smallestRoot = std::min((-b - root) / (2.0f * a), (-b + root) / (2.0f * a));
+    if ((smallestRoot < 0.0f) || (smallestRoot > maxRoot)) {
+        return std::nullopt;
+    }
+    return smallestRoot;
+}
+
 template <typename VertexRange, typename SegmentVisitor>
 void iteratePolygonVertices(const VertexRange& vertices, SegmentVisitor&& visitor)
 {
@@ -141,6 +184,47 @@ struct AxisAlignedPlane {
     float boundary;
 };
 
+// A plane whose inner side holds the points with a non-negative signed distance.
+struct Plane {
+    glm::vec3 normal;
+    float distance;
+
+    float getSignedDistance(const glm::vec3& point) const
+    {
+        return glm::dot(normal, point) + distance;
+    }
+};
+
+// Extracts the six planes of the view frustum from a view-projection matrix, with their normals
+// pointing into the frustum.
+inline std::array<Plane, 6> getFrustumPlanes(const glm::mat4& viewProjection)
+{
+    auto getRow = [&viewProjection](int row) {
+        return glm::vec4(viewProjection[0][row], viewProjection[1][row], viewProjection[2][row],
+            viewProjection[3][row]);
+    };
+    glm::vec4 w = getRow(3);
+
+    std::array<Plane, 6> planes;
+    for (int k = 0; k < 3; k++) {
+        glm::vec4 row = getRow(k);
+        for (int side = 0; side < 2; side++) {
+            glm::vec4 coefficients = (side == 0) ? (w + row) : (w - row);
+            glm::vec3 normal(coefficients.x, coefficients.y, coefficients.z);
+            float length = glm::length(normal);
+            planes[(k * 2) + side] = { normal / length, coefficients.w / length };
+        }
+    }
+    return planes;
+}
+
+// How a box lies relative to a region of space.
+enum class RegionOverlap {
+    Outside,
+    Partial,
+    Inside,
+};
+
 struct AxisAlignedBoundingBox {
     void expandToVertex(const glm::vec3& vertex)
     {
@@ -208,12 +292,6 @@ struct AxisAlignedBoundingBox {
         return splitBoxes;
     }
 
-    struct Hit {
-        glm::vec3 intersectionPoint;
-        float t;
-        uint8_t planeDimension;
-    };
-
     bool containsPoint(const glm::vec3& point) const
     {
         for (int k = 0; k < 3; k++) {
@@ -228,66 +306,117 @@ struct AxisAlignedBoundingBox {
         return true;
     }
 
-    bool intersectsSphere(const Sphere& sphere) const
+    // Whether part of the box reaches past the plane on either side.
+    bool isLeftOfPlane(const AxisAlignedPlane& plane) const
     {
-        float r2 = sphere.radius * sphere.radius;
+        return minimum[plane.dimensionIndex] < plane.boundary;
+    }
+
+    bool isRightOfPlane(const AxisAlignedPlane& plane) const
+    {
+        return maximum[plane.dimensionIndex] > plane.boundary;
+    }
+
+    // The squared distance from the point to the nearest point of the box, which is zero inside it.
+    float getDistanceSquared(const glm::vec3& point) const
+    {
+        float distanceSquared = 0.0f;
         for (size_t k = 0; k < 3; k++) {
-            if (sphere.center[k] < minimum[k]) {
-                float diff = minimum[k] - sphere.center[k];
-                r2 -= diff * diff;
-            } else if (sphere.center[k] > maximum[k]) {
-                float diff = sphere.center[k] - maximum[k];
-                r2 -= diff * diff;
+            if (point[k] < minimum[k]) {
+                float diff = minimum[k] - point[k];
+                distanceSquared += diff * diff;
+            } else if (point[k] > maximum[k]) {
+                float diff = point[k] - maximum[k];
+                distanceSquared += diff * diff;
             }
         }
-        return r2 > 0.0f;
+        return distanceSquared;
     }
 
-    std::optional<Hit> castExternalRay(const Ray& ray) const
+    // Where the box lies relative to the convex region on the inner side of all the planes. Boxes
+    // near the region's edges may be reported as partially inside when they're outside.
+    RegionOverlap getOverlap(gsl::span<const Plane> planes) const
     {
-        for (uint8_t k = 0; k < 3; k++) {
-            float d = ray.direction[k];
-            if (d < 0.0f) {
-                float boundary = maximum[k];
-                if (ray.origin[k] > boundary) {
-                    auto intersection = AxisAlignedPlane{ k, boundary }.intersect(ray);
-                    if (containsPoint(intersection.intersectionPoint)) {
-                        return Hit{ intersection.intersectionPoint, intersection.t, k };
-                    }
-                }
-            } else if (d > 0.0f) {
-                float boundary = minimum[k];
-                if (ray.origin[k] < boundary) {
-                    auto intersection = AxisAlignedPlane{ k, boundary }.intersect(ray);
-                    if (containsPoint(intersection.intersectionPoint)) {
-                        return Hit{ intersection.intersectionPoint, intersection.t, k };
-                    }
-                }
+        auto overlap = RegionOverlap::Inside;
+        for (const auto& plane : planes) {
+            // The corners farthest along and against the plane's normal.
+            glm::vec3 innerCorner;
+            glm::vec3 outerCorner;
+            for (int k = 0; k < 3; k++) {
+                bool isPositive = plane.normal[k] >= 0.0f;
+                innerCorner[k] = isPositive ? maximum[k] : minimum[k];
+                outerCorner[k] = isPositive ? minimum[k] : maximum[k];
+            }
+
+            if (plane.getSignedDistance(innerCorner) < 0.0f) {
+                return RegionOverlap::Outside;
+            }
+            if (plane.getSignedDistance(outerCorner) < 0.0f) {
+                overlap = RegionOverlap::Partial;
             }
         }
-        return std::nullopt;
+        return overlap;
     }
 
-    Hit castInternalRay(const Ray& ray) const
+    // Where the box lies relative to the region covered by another box.
+    RegionOverlap getOverlap(const AxisAlignedBoundingBox& region) const
     {
-        for (uint8_t k = 0; k < 3; k++) {
-            float d = ray.direction[k];
-
-            float boundary;
-            if (d < 0.0f) {
-                boundary = minimum[k];
-            } else if (d > 0.0f) {
-                boundary = maximum[k];
-            } else {
-                continue;
+        auto overlap = RegionOverlap::Inside;
+        for (int k = 0; k < 3; k++) {
+            if ((maximum[k] < region.minimum[k]) || (minimum[k] > region.maximum[k])) {
+                return RegionOverlap::Outside;
             }
-
-            auto intersection = AxisAlignedPlane{ k, boundary }.intersect(ray);
-            if (containsPoint(intersection.intersectionPoint)) {
-                return Hit{ intersection.intersectionPoint, intersection.t, k };
+            if ((minimum[k] < region.minimum[k]) || (maximum[k] > region.maximum[k])) {
+                overlap = RegionOverlap::Partial;
             }
         }
-        throw std::runtime_error("Internal ray intersection not found.");
+        return overlap;
+    }
+
+    // Where the box lies relative to the region inside the sphere.
+    RegionOverlap getOverlap(const Sphere& sphere) const
+    {
+        float radiusSquared = sphere.radius * sphere.radius;
+        if (getDistanceSquared(sphere.center) > radiusSquared) {
+            return RegionOverlap::Outside;
+        }
+
+        // The box is inside when its corner farthest from the center is.
+        float farthestDistanceSquared = 0.0f;
+        for (int k = 0; k < 3; k++) {
+            float diff = std::max(sphere.center[k] - minimum[k], maximum[k] - sphere.center[k]);
+            farthestDistanceSquared += diff * diff;
+        }
+        return (farthestDistanceSquared <= radiusSquared) ? RegionOverlap::Inside
+                                                          : RegionOverlap::Partial;
+    }
+
+    bool intersectsSphere(const Sphere& sphere) const
+    {
+        return getDistanceSquared(sphere.center) < (sphere.radius * sphere.radius);
+    }
+
+    // Clips the stretch of the ray between minDistance and maxDistance to the box. Each axis
+    // narrows the interval to the slab between the box's faces, picking the near face from the
+    // sign of the direction rather than branching on the ray's position.
+    RayInterval clipRay(const SlabRay& ray, float minDistance = 0.0f,
+        float maxDistance = std::numeric_limits<float>::infinity()) const
+    {
+        RayInterval interval{ minDistance, maxDistance };
+        for (int k = 0; k < 3; k++) {
+            float inverseDirection = ray.inverseDirection[k];
+            bool isNegative = inverseDirection < 0.0f;
+            float nearDistance
+                = ((isNegative ? maximum[k] : minimum[k]) - ray.origin[k]) * inverseDirection;
+            float farDistance
+                = ((isNegative ? minimum[k] : maximum[k]) - ray.origin[k]) * inverseDirection;
+            // Rays lying in a slab boundary produce NaN, which these comparisons skip.
+            interval.entryDistance
+                = (nearDistance > interval.entryDistance) ? nearDistance : interval.entryDistance;
+            interval.exitDistance
+                = (farDistance < interval.exitDistance) ? farDistance : interval.exitDistance;
+        }
+        return interval;
     }
 
     glm::vec3 minimum{ std::numeric_limits<float>::infinity() };
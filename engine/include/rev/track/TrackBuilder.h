@@ -3,14 +3,28 @@
 #include "rev/NurbsCurve.h"
 #include "rev/track/ITrackElement.h"
 
+#include <optional>
+
 namespace rev {
 
+// How closely adaptively placed stamps follow the curve. Wherever the track bends, stamps are
+// placed closer together until the limits hold between every pair of them.
+struct TrackTolerances {
+    // The most the track may turn between one stamp and the next, in radians.
+    float maxTurnAngle;
+    // The farthest the curve may stray from the straight line between one stamp and the next.
+    float maxChordError;
+};
+
 struct TrackConfiguration {
     NurbsCurve<glm::vec3> curve;
     float width;
+    // Without tolerances, the track is cut into exactly this many segments of equal length. With
+    // them, segments are never longer than that but get shorter wherever the track bends.
     size_t segments;
+    std::optional<TrackTolerances> tolerances{};
 };
 
 void buildTrack(const TrackConfiguration& config, ITrackElement& element);
 
-}
\ No newline at end of file
+}
@@ -4,6 +4,7 @@
 #include "rev/Scene.h"
 #include "rev/SceneView.h"
 #include "rev/Window.h"
+#include "rev/WorkerPool.h"
 
 namespace rev {
 
@@ -35,6 +36,12 @@ std::shared_ptr<Environment> Engine::createEnvironment()
     return environment;
 }
 
+std::shared_ptr<WorkerPool> Engine::getWorkerPool()
+{
+    std::call_once(_workerPoolCreated, [this]() { _workerPool = std::make_shared<WorkerPool>(); });
+    return _workerPool;
+}
+
 void Engine::update()
 {
     _window->makeCurrent();
@@ -0,0 +1,87 @@
+#include "rev/MappedFile.h"
+
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace rev {
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& path)
+{
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("Unable to open file for mapping.");
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || (size.QuadPart <= 0)) {
+        CloseHandle(file);
+        throw std::runtime_error("Unable to map an empty file.");
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping) {
+        throw std::runtime_error("Unable to map file.");
+    }
+
+    void* data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!data) {
+        throw std::runtime_error("Unable to map file.");
+    }
+
+    _data = static_cast<std::byte*>(data);
+    _size = static_cast<size_t>(size.QuadPart);
+}
+
+MappedFile::~MappedFile() { UnmapViewOfFile(_data); }
+
+#else
+
+MappedFile::MappedFile(const std::string& path)
+{
+    int file = open(path.c_str(), O_RDONLY);
+    if (file < 0) {
+        throw std::runtime_error("Unable to open file for mapping.");
+    }
+
+    struct stat status;
+    if ((fstat(file, &status) != 0) || (status.st_size <= 0)) {
+        close(file);
+        throw std::runtime_error("Unable to map an empty file.");
+    }
+
+    auto size = static_cast<size_t>(status.st_size);
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("Unable to map file.");
+    }
+
+    _data = static_cast<std::byte*>(data);
+    _size = size;
+}
+
+MappedFile::~MappedFile() { munmap(_data, _size); }
+
+#endif
+
+gsl::span<std::byte> MappedFile::getBytes() const
+{
+    return gsl::span<std::byte>(_data, static_cast<std::ptrdiff_t>(_size));
+}
+
+} // namespace rev
@@ -0,0 +1,117 @@
+#include "rev/WorkerPool.h"
+
+#include <algorithm>
+#include <gsl/gsl_assert>
+#include <utility>
+
+namespace rev {
+
+WorkerPool::WorkerPool()
+    : WorkerPool(std::max<size_t>(std::thread::hardware_concurrency(), 1))
+{
+}
+
+WorkerPool::WorkerPool(size_t threadCount)
+{
+    Expects(threadCount > 0);
+    for (size_t i = 0; i < threadCount; i++) {
+        _threads.emplace_back([this]() { runWorker(); });
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _taskAvailable.notify_all();
+
+    for (auto& thread : _threads) {
+        thread.join();
+    }
+}
+
+size_t WorkerPool::getThreadCount() const { return _threads.size(); }
+
+void WorkerPool::enqueue(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _tasks.push_back(std::move(task));
+    }
+    _taskAvailable.notify_one();
+}
+
+bool WorkerPool::runPendingTask()
+{
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_tasks.empty()) {
+            return false;
+        }
+        task = std::move(_tasks.front());
+        _tasks.pop_front();
+    }
+    task();
+    return true;
+}
+
+void WorkerPool::runWorker()
+{
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _taskAvailable.wait(lock, [this]() { return _stopping || !_tasks.empty(); });
+            if (_tasks.empty()) {
+                return;
+            }
+            task = std::move(_tasks.front());
+            _tasks.pop_front();
+        }
+        task();
+    }
+}
+
+TaskGroup::TaskGroup(WorkerPool& pool)
+    : _pool(pool)
+{
+}
+
+TaskGroup::~TaskGroup() { runUntilFinished(); }
+
+void TaskGroup::wait()
+{
+    runUntilFinished();
+
+    std::lock_guard<std::mutex> lock(_exceptionMutex);
+    if (_exception) {
+        std::rethrow_exception(std::exchange(_exception, nullptr));
+    }
+}
+
+void TaskGroup::finishTask()
+{
+    // Notifying under the lock keeps the group alive until the waiter can see the count reach
+    // zero, since that's when it may return and destroy the group.
+    std::lock_guard<std::mutex> lock(_finishedMutex);
+    _pendingCount--;
+    _taskFinished.notify_all();
+}
+
+void TaskGroup::runUntilFinished()
+{
+    // Help with queued tasks while there are any. Once the queue is empty, every unfinished task
+    // of this group is already running on another thread, so there's nothing left but to sleep
+    // until they're done.
+    while (_pendingCount > 0) {
+        if (!_pool.runPendingTask()) {
+            std::unique_lock<std::mutex> lock(_finishedMutex);
+            _taskFinished.wait(lock, [this]() { return _pendingCount == 0; });
+        }
+    }
+}
+
+} // namespace rev
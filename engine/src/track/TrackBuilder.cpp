@@ -1,51 +1,173 @@
 #include "rev/track/TrackBuilder.h"
 
+#include "rev/ArcLengthTable.h"
+
+#include <algorithm>
+#include <cmath>
 #include <gsl/gsl_assert>
+#include <limits>
+#include <vector>
 
 namespace rev {
 
-void buildTrack(const TrackConfiguration& config, ITrackElement& element)
-{
-    Expects(config.segments > 0);
+namespace {
+    class TrackStamper {
+    public:
+        TrackStamper(const TrackConfiguration& config, ITrackElement& element)
+            : _config(config)
+            , _element(element)
+        {
+        }
+
+        // Stamps a cross-section facing along the curve's exact tangent, so the track's
+        // orientation doesn't depend on how finely it's cut up.
+        void stamp(const CurveDerivatives<glm::vec3>& derivatives)
+        {
+            // Where the curve stops for an instant, the track keeps facing the way it was going.
+            if (glm::dot(derivatives.firstDerivative, derivatives.firstDerivative) > 0.0f) {
+                _forward = glm::normalize(derivatives.firstDerivative);
+            }
+            glm::vec3 right = glm::cross(_forward, glm::vec3(0.0f, 1.0f, 0.0f));
+            glm::vec3 up = glm::cross(right, _forward);
+
+            glm::mat4 orientation{
+                { right * _config.width, 0.0f },
+                { up, 0.0f },
+                { _forward, 0.0f },
+                { derivatives.point, 1.0f },
+            };
+
+            _element.stamp(orientation);
+        }
+
+    private:
+        const TrackConfiguration& _config;
+        ITrackElement& _element;
+        glm::vec3 _forward{ 0.0f, 0.0f, 1.0f };
+    };
+
+    float getTurnAngle(const glm::vec3& from, const glm::vec3& to)
+    {
+        float lengths = glm::length(from) * glm::length(to);
+        if (!(lengths > 0.0f)) {
+            return 0.0f;
+        }
+        return std::acos(std::clamp(glm::dot(from, to) / lengths, -1.0f, 1.0f));
+    }
 
-    float start = config.curve.getStart();
-    float end = config.curve.getEnd();
-    float curveLength = end - start;
-    float segmentLength = curveLength / static_cast<float>(config.segments);
+    // How far the point is from the line through the ends of a chord.
+    float getChordError(const glm::vec3& start, const glm::vec3& end, const glm::vec3& point)
+    {
+        glm::vec3 chord = end - start;
+        float chordLength = glm::length(chord);
+        if (!(chordLength > 0.0f)) {
+            return glm::length(point - start);
+        }
+        return glm::length(glm::cross(point - start, chord)) / chordLength;
+    }
 
-    std::vector<glm::vec3> guidePoints;
-    for (float current = start; current < end; current += segmentLength) {
-        guidePoints.push_back(config.curve[current]);
+    // The longest segment a bend this sharp allows, treating it as an arc of a circle: an arc of
+    // length s turns by s times the curvature, and strays from its chord by s^2 / 8 times it.
+    float getSegmentLengthForCurvature(float curvature, const TrackTolerances& tolerances)
+    {
+        if (!(curvature > 0.0f)) {
+            return std::numeric_limits<float>::infinity();
+        }
+        float turnLimit = tolerances.maxTurnAngle / curvature;
+        float chordLimit = std::sqrt(8.0f * tolerances.maxChordError / curvature);
+        return std::min(turnLimit, chordLimit);
     }
 
-    auto firstGuidePoint = guidePoints.begin();
-    auto secondGuidePoint = firstGuidePoint + 1;
-    auto guidePointsEnd = guidePoints.end();
-    glm::vec3 previousLeftPosition;
-    glm::vec3 previousRightPosition;
-    size_t previousLeftIndex;
-    size_t previousRightIndex;
+    void buildUniformTrack(const TrackConfiguration& config,
+        const ArcLengthTable<glm::vec3>& arcLengths, TrackStamper& stamper)
+    {
+        // One stamp at each end of every segment, the last at the very end of the curve. The
+        // positions come in order, so the curve evaluates them all in one pass.
+        float segmentLength = arcLengths.getLength() / static_cast<float>(config.segments);
+        std::vector<float> positions(config.segments + 1);
+        for (size_t i = 0; i < config.segments; i++) {
+            positions[i] = arcLengths.parameterAtDistance(segmentLength * static_cast<float>(i));
+        }
+        positions.back() = config.curve.getEnd();
+
+        std::vector<CurveDerivatives<glm::vec3>> derivatives(positions.size());
+        config.curve.getDerivatives(positions, derivatives);
+        for (const auto& stampDerivatives : derivatives) {
+            stamper.stamp(stampDerivatives);
+        }
+    }
 
-    while (secondGuidePoint != guidePointsEnd) {
-        glm::vec3 forward = glm::normalize(*secondGuidePoint - *firstGuidePoint);
-        glm::vec3 right = glm::cross(forward, glm::vec3(0.0f, 1.0f, 0.0f));
-        glm::vec3 up = glm::cross(right, forward);
+    // Steps along the track by as far as the curvature at each stamp allows, then checks the
+    // step against the tolerances at its middle and end, halving it until it passes. The turn is
+    // measured through the middle so that an S-bend whose ends face the same way still counts.
+    //
+    // Segments are never cut shorter than twice the chord tolerance. A stretch that short can't
+    // stray further than the tolerance from its chord, and if it still turns too far, it's
+    // crossing a kink that no amount of splitting would smooth.
+    void buildAdaptiveTrack(const TrackConfiguration& config,
+        const ArcLengthTable<glm::vec3>& arcLengths, const TrackTolerances& tolerances,
+        TrackStamper& stamper)
+    {
+        const auto& curve = config.curve;
+        float length = arcLengths.getLength();
+        float maxSegmentLength = length / static_cast<float>(config.segments);
+        float minSegmentLength = std::min(2.0f * tolerances.maxChordError, maxSegmentLength);
 
-        glm::vec3 midPoint = (*firstGuidePoint + *secondGuidePoint) / 2.0f;
+        float distance = 0.0f;
+        auto derivatives = curve.getDerivatives(curve.getStart());
+        stamper.stamp(derivatives);
+        while (distance < length) {
+            float segmentLength = std::clamp(
+                getSegmentLengthForCurvature(derivatives.getCurvature(), tolerances),
+                minSegmentLength, maxSegmentLength);
+            bool isLast = false;
+            CurveDerivatives<glm::vec3> next;
+            while (true) {
+                isLast = !(distance + segmentLength < length);
+                if (isLast) {
+                    segmentLength = length - distance;
+                }
+                float nextPosition = isLast
+                    ? curve.getEnd()
+                    : arcLengths.parameterAtDistance(distance + segmentLength);
+                next = curve.getDerivatives(nextPosition);
 
-        glm::mat4 orientation{
-            { right * config.width, 0.0f },
-            { up, 0.0f },
-            { forward, 0.0f },
-            { midPoint, 1.0f },
-        };
+                auto middle = curve.getDerivatives(
+                    arcLengths.parameterAtDistance(distance + (segmentLength / 2.0f)));
+                float turnAngle = getTurnAngle(derivatives.firstDerivative, middle.firstDerivative)
+                    + getTurnAngle(middle.firstDerivative, next.firstDerivative);
+                float chordError = getChordError(derivatives.point, next.point, middle.point);
+                bool isWithinTolerances = (turnAngle <= tolerances.maxTurnAngle)
+                    && (chordError <= tolerances.maxChordError);
+                if (isWithinTolerances || !(segmentLength / 2.0f >= minSegmentLength)) {
+                    break;
+                }
+                segmentLength /= 2.0f;
+            }
+
+            // The end is stamped exactly once, however the distances round.
+            distance = isLast ? length : distance + segmentLength;
+            derivatives = next;
+            stamper.stamp(derivatives);
+        }
+    }
+}
 
-        element.stamp(orientation);
+void buildTrack(const TrackConfiguration& config, ITrackElement& element)
+{
+    Expects(config.segments > 0);
 
-        firstGuidePoint = secondGuidePoint;
-        secondGuidePoint++;
+    // Segments are measured in space, however unevenly the curve's parameter moves.
+    ArcLengthTable<glm::vec3> arcLengths(config.curve);
+    TrackStamper stamper(config, element);
+    if (config.tolerances) {
+        Expects(config.tolerances->maxTurnAngle > 0.0f);
+        Expects(config.tolerances->maxChordError > 0.0f);
+        buildAdaptiveTrack(config, arcLengths, *config.tolerances, stamper);
+    } else {
+        buildUniformTrack(config, arcLengths, stamper);
     }
     element.finish();
 }
 
-}
\ No newline at end of file
+}
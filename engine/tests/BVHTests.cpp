@@ -0,0 +1,180 @@
+#include "rev/geometry/BVH.h"
+
+#include <chrono>
+#include <gtest/gtest.h>
+#include <iostream>
+#include <random>
+
+using namespace rev;
+
+namespace {
+struct TestSurfaceData {
+    uint64_t id;
+};
+
+std::vector<Triangle<TestSurfaceData>> buildRandomTriangles(size_t count, uint32_t seed)
+{
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<float> position(-10.0f, 10.0f);
+    std::uniform_real_distribution<float> offset(-1.0f, 1.0f);
+
+    std::vector<Triangle<TestSurfaceData>> triangles;
+    for (size_t i = 0; i < count; i++) {
+        glm::vec3 center(position(generator), position(generator), position(generator));
+        std::array<glm::vec3, 3> vertices;
+        for (auto& vertex : vertices) {
+            vertex = center + glm::vec3(offset(generator), offset(generator), offset(generator));
+        }
+        triangles.push_back({ vertices, { i } });
+    }
+    return triangles;
+}
+
+std::vector<Ray> buildRandomRays(size_t count, uint32_t seed)
+{
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<float> position(-15.0f, 15.0f);
+    std::uniform_real_distribution<float> direction(-1.0f, 1.0f);
+
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < count; i++) {
+        glm::vec3 origin(position(generator), position(generator), position(generator));
+        glm::vec3 target(direction(generator), direction(generator), direction(generator));
+        rays.push_back(Ray{ origin, glm::normalize(target * 10.0f - origin) });
+    }
+    return rays;
+}
+
+std::optional<float> castRayBruteForce(const BVH<TestSurfaceData>& bvh, const Ray& ray)
+{
+    std::optional<float> closest;
+    for (size_t i = 0; i < bvh.getTriangleCount(); i++) {
+        auto hit = bvh.getTriangle(i).castRay(ray);
+        if (hit && (!closest || (hit->t < *closest))) {
+            closest = hit->t;
+        }
+    }
+    return closest;
+}
+
+void expectMatchesBruteForce(const BVH<TestSurfaceData>& bvh, const std::vector<Ray>& rays)
+{
+    for (const auto& ray : rays) {
+        auto expected = castRayBruteForce(bvh, ray);
+        auto hit = bvh.castRay(ray);
+        ASSERT_EQ(expected.has_value(), hit.has_value());
+        if (hit) {
+            EXPECT_EQ(*expected, hit->t);
+        }
+        EXPECT_EQ(bvh.occluded(ray, 5.0f), bvh.castRay(ray, 5.0f).has_value());
+    }
+}
+
+// Slides every triangle along a wave, as an animated piece of geometry would.
+void moveTriangles(BVH<TestSurfaceData>& bvh, float time)
+{
+    for (size_t i = 0; i < bvh.getTriangleCount(); i++) {
+        auto vertices = bvh.getTriangle(i).vertices;
+        glm::vec3 offset(std::sin(time + static_cast<float>(i)) * 0.5f, time * 0.1f, 0.0f);
+        for (auto& vertex : vertices) {
+            vertex += offset;
+        }
+        bvh.moveTriangle(i, vertices);
+    }
+}
+}
+
+TEST(BVHTests, CastRayMatchesBruteForce)
+{
+    BVH<TestSurfaceData> bvh(buildRandomTriangles(1000, 1));
+    expectMatchesBruteForce(bvh, buildRandomRays(500, 2));
+}
+
+TEST(BVHTests, RefitFollowsMovedTriangles)
+{
+    BVH<TestSurfaceData> bvh(buildRandomTriangles(1000, 3));
+    auto rays = buildRandomRays(500, 4);
+    for (float time : { 0.5f, 1.0f, 4.0f }) {
+        moveTriangles(bvh, time);
+        bvh.update();
+        expectMatchesBruteForce(bvh, rays);
+    }
+
+    bvh.addTriangle({ glm::vec3(-20.0f, -20.0f, 0.0f), glm::vec3(20.0f, -20.0f, 0.0f),
+                        glm::vec3(0.0f, 20.0f, 0.0f) },
+        { 1000 });
+    bvh.update();
+    expectMatchesBruteForce(bvh, rays);
+}
+
+TEST(BVHTests, UpdateRebuildsDegradedTrees)
+{
+    BVH<TestSurfaceData> bvh(buildRandomTriangles(1000, 5));
+    float builtCost = bvh.getSurfaceAreaCost();
+
+    // Scattering the triangles far from where the tree was built leaves huge overlapping boxes.
+    std::mt19937 generator(6);
+    std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+    for (size_t i = 0; i < bvh.getTriangleCount(); i++) {
+        auto vertices = bvh.getTriangle(i).vertices;
+        glm::vec3 offset(position(generator), position(generator), position(generator));
+        for (auto& vertex : vertices) {
+            vertex += offset;
+        }
+        bvh.moveTriangle(i, vertices);
+    }
+    bvh.update();
+
+    EXPECT_LE(bvh.getSurfaceAreaCost(), builtCost * kBVHRebuildCostRatio);
+    expectMatchesBruteForce(bvh, buildRandomRays(200, 7));
+}
+
+TEST(BVHTests, SphereQueryFindsNearbyTriangles)
+{
+    BVH<TestSurfaceData> bvh(buildRandomTriangles(500, 8));
+    Sphere sphere{ glm::vec3(1.0f, 2.0f, 3.0f), 4.0f };
+
+    std::vector<uint64_t> expected;
+    for (size_t i = 0; i < bvh.getTriangleCount(); i++) {
+        if (bvh.getTriangle(i).intersectsSphere(sphere)) {
+            expected.push_back(bvh.getTriangle(i).data.id);
+        }
+    }
+
+    std::vector<uint64_t> visited;
+    bvh.visitTrianglesIntersectingSphere(sphere,
+        [&visited](Triangle<TestSurfaceData>& triangle, float) {
+            visited.push_back(triangle.data.id);
+        });
+    std::sort(visited.begin(), visited.end());
+    EXPECT_EQ(expected, visited);
+}
+
+// Not a correctness test: reports how much cheaper refitting is than rebuilding, which is the
+// reason to refit at all.
+TEST(BVHTests, BenchmarkRefitAgainstRebuild)
+{
+    constexpr size_t kIterations = 10;
+    BVH<TestSurfaceData> bvh(buildRandomTriangles(20000, 9));
+
+    using Clock = std::chrono::steady_clock;
+    Clock::duration refitTime{};
+    Clock::duration rebuildTime{};
+    for (size_t i = 0; i < kIterations; i++) {
+        moveTriangles(bvh, static_cast<float>(i) * 0.1f);
+        auto start = Clock::now();
+        bvh.refit();
+        refitTime += Clock::now() - start;
+
+        start = Clock::now();
+        bvh.rebuild();
+        rebuildTime += Clock::now() - start;
+    }
+
+    auto toMilliseconds = [](Clock::duration duration) {
+        return std::chrono::duration<double, std::milli>(duration).count() / kIterations;
+    };
+    std::cout << "Refit: " << toMilliseconds(refitTime)
+              << " ms, rebuild: " << toMilliseconds(rebuildTime) << " ms" << std::endl;
+    EXPECT_LT(refitTime, rebuildTime);
+}
@@ -1,6 +1,8 @@
+#include "rev/geometry/PackedBoxes.h"
 #include "rev/geometry/Tools.h"
 
 #include <gtest/gtest.h>
+#include <random>
 
 using namespace rev;
 
@@ -134,3 +136,112 @@ TEST(GeometryTools, NullPolygonBuilder)
     AxisAlignedPlane plane{ 0, 2.0f };
     plane.splitConvexPolygon(triangle, NullPolygonBuilder{}, NullPolygonBuilder{});
 }
+
+TEST(GeometryTools, BoxOverlapsFrustum)
+{
+    // An identity view-projection makes the frustum the cube from -1 to 1.
+    auto planes = getFrustumPlanes(glm::mat4(1.0f));
+
+    AxisAlignedBoundingBox inside{ glm::vec3(-0.5f, -0.5f, -0.5f), glm::vec3(0.5f, 0.5f, 0.5f) };
+    AxisAlignedBoundingBox partial{ glm::vec3(0.5f, 0.5f, 0.5f), glm::vec3(1.5f, 1.5f, 1.5f) };
+    AxisAlignedBoundingBox outside{ glm::vec3(1.5f, -0.5f, -0.5f), glm::vec3(2.5f, 0.5f, 0.5f) };
+    EXPECT_EQ(RegionOverlap::Inside, inside.getOverlap(planes));
+    EXPECT_EQ(RegionOverlap::Partial, partial.getOverlap(planes));
+    EXPECT_EQ(RegionOverlap::Outside, outside.getOverlap(planes));
+
+    AxisAlignedBoundingBox region{ glm::vec3(-1.0f, -1.0f, -1.0f), glm::vec3(1.0f, 1.0f, 1.0f) };
+    EXPECT_EQ(RegionOverlap::Inside, inside.getOverlap(region));
+    EXPECT_EQ(RegionOverlap::Partial, partial.getOverlap(region));
+    EXPECT_EQ(RegionOverlap::Outside, outside.getOverlap(region));
+}
+
+TEST(GeometryTools, ClipRayToBox)
+{
+    AxisAlignedBoundingBox box{ glm::vec3(-1.0f, -1.0f, -1.0f), glm::vec3(1.0f, 2.0f, 3.0f) };
+    auto clip = [&box](const glm::vec3& origin, const glm::vec3& direction,
+                    float maxDistance = std::numeric_limits<float>::infinity()) {
+        return box.clipRay(SlabRay(Ray{ origin, direction }), 0.0f, maxDistance);
+    };
+
+    glm::vec3 right(1.0f, 0.0f, 0.0f);
+    auto interval = clip(glm::vec3(-5.0f, 0.0f, 0.0f), right);
+    EXPECT_TRUE(interval.isHit());
+    EXPECT_EQ(4.0f, interval.entryDistance);
+    EXPECT_EQ(6.0f, interval.exitDistance);
+    EXPECT_FALSE(clip(glm::vec3(-5.0f, 0.0f, 0.0f), right, 3.0f).isHit());
+
+    // Rays starting inside enter at the start of the interval.
+    interval = clip(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f));
+    EXPECT_EQ(0.0f, interval.entryDistance);
+    EXPECT_EQ(1.0f, interval.exitDistance);
+
+    // Rays parallel to a slab only hit when they start inside it, including on its faces.
+    EXPECT_FALSE(clip(glm::vec3(-5.0f, 2.5f, 0.0f), right).isHit());
+    EXPECT_TRUE(clip(glm::vec3(-5.0f, 2.0f, 0.0f), right).isHit());
+    EXPECT_TRUE(clip(glm::vec3(-5.0f, 0.0f, -1.0f), glm::vec3(1.0f, 0.0f, -0.0f)).isHit());
+}
+
+TEST(GeometryTools, PacketClipRayMatchesScalar)
+{
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<float> position(-5.0f, 5.0f);
+    std::uniform_real_distribution<float> size(0.0f, 3.0f);
+    auto randomRay = [&generator, &position]() {
+        glm::vec3 direction(position(generator), position(generator), position(generator));
+        // Some rays are parallel to an axis, and some start on a box face.
+        direction[generator() % 4 % 3] = (generator() % 2) ? 0.0f : -0.0f;
+        return Ray{ glm::vec3(position(generator), position(generator), position(generator)),
+            direction };
+    };
+    auto randomBox = [&generator, &position, &size]() {
+        glm::vec3 minimum(position(generator), position(generator), position(generator));
+        glm::vec3 extent(size(generator), size(generator), size(generator));
+        return AxisAlignedBoundingBox{ minimum, minimum + extent };
+    };
+
+    for (size_t i = 0; i < 1000; i++) {
+        std::array<AxisAlignedBoundingBox, 3> boxes{ randomBox(), randomBox(), randomBox() };
+        std::array<Ray, 4> rays{ randomRay(), randomRay(), randomRay(), randomRay() };
+        rays[1].origin.x = boxes[0].minimum.x;
+        float maxDistance = size(generator) * 4.0f;
+
+        // One ray against several boxes, with the last lane left empty.
+        SlabRay slabRay(rays[0]);
+        auto intervals = clipRay(BoxPacket<4>::pack(boxes), slabRay, 0.0f, maxDistance);
+        std::array<float, 4> entryDistances;
+        std::array<float, 4> exitDistances;
+        intervals.entryDistance.store(entryDistances.data());
+        intervals.exitDistance.store(exitDistances.data());
+        uint32_t hitBits = intervals.getHitLanes().toBits();
+        for (size_t j = 0; j < boxes.size(); j++) {
+            auto interval = boxes[j].clipRay(slabRay, 0.0f, maxDistance);
+            ASSERT_EQ(interval.isHit(), (hitBits >> j) & 1);
+            if (interval.isHit()) {
+                EXPECT_EQ(interval.entryDistance, entryDistances[j]);
+                EXPECT_EQ(interval.exitDistance, exitDistances[j]);
+            }
+        }
+        EXPECT_FALSE((hitBits >> 3) & 1);
+
+        // Several rays against one box.
+        intervals = clipRays(boxes[0], SlabRayPacket<4>::pack(rays), 0.0f, maxDistance);
+        intervals.entryDistance.store(entryDistances.data());
+        intervals.exitDistance.store(exitDistances.data());
+        hitBits = intervals.getHitLanes().toBits();
+        for (size_t j = 0; j < rays.size(); j++) {
+            auto interval = boxes[0].clipRay(SlabRay(rays[j]), 0.0f, maxDistance);
+            ASSERT_EQ(interval.isHit(), (hitBits >> j) & 1);
+            if (interval.isHit()) {
+                EXPECT_EQ(interval.entryDistance, entryDistances[j]);
+                EXPECT_EQ(interval.exitDistance, exitDistances[j]);
+
+                // The middle of the interval lies inside the box.
+                glm::vec3 middle = rays[j].origin
+                    + rays[j].direction * (0.5f * (entryDistances[j] + exitDistances[j]));
+                AxisAlignedBoundingBox grownBox{ boxes[0].minimum - 1e-4f,
+                    boxes[0].maximum + 1e-4f };
+                EXPECT_TRUE(grownBox.containsPoint(middle));
+            }
+        }
+    }
+}
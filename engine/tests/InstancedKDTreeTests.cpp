@@ -0,0 +1,150 @@
+#include "rev/geometry/InstancedKDTree.h"
+#include "rev/geometry/PresortedKDTreeBuilder.h"
+
+#include <cmath>
+#include <gtest/gtest.h>
+#include <random>
+
+using namespace rev;
+
+namespace {
+struct TestSurfaceData {
+    uint64_t id;
+};
+
+struct TestInstance {
+    glm::mat4 transform{ 1.0f };
+};
+
+std::vector<std::array<glm::vec3, 3>> buildRandomTriangles(size_t count, uint32_t seed)
+{
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<float> position(-2.0f, 2.0f);
+    std::uniform_real_distribution<float> offset(-0.5f, 0.5f);
+
+    std::vector<std::array<glm::vec3, 3>> triangles;
+    for (size_t i = 0; i < count; i++) {
+        glm::vec3 center(position(generator), position(generator), position(generator));
+        std::array<glm::vec3, 3> triangle;
+        for (auto& vertex : triangle) {
+            vertex = center + glm::vec3(offset(generator), offset(generator), offset(generator));
+        }
+        triangles.push_back(triangle);
+    }
+    return triangles;
+}
+
+// Spins around the y axis, then scales and moves.
+glm::mat4 buildTransform(float angle, float scale, const glm::vec3& translation)
+{
+    glm::mat4 transform(1.0f);
+    transform[0] = glm::vec4(std::cos(angle) * scale, 0.0f, -std::sin(angle) * scale, 0.0f);
+    transform[1] = glm::vec4(0.0f, scale, 0.0f, 0.0f);
+    transform[2] = glm::vec4(std::sin(angle) * scale, 0.0f, std::cos(angle) * scale, 0.0f);
+    transform[3] = glm::vec4(translation, 1.0f);
+    return transform;
+}
+
+void placeInstances(std::vector<std::shared_ptr<TestInstance>>& instances, float time)
+{
+    for (size_t i = 0; i < instances.size(); i++) {
+        float offset = static_cast<float>(i);
+        glm::vec3 translation(
+            std::fmod(offset * 7.0f, 40.0f) - 20.0f, std::sin(time + offset) * 3.0f,
+            std::fmod(offset * 13.0f, 40.0f) - 20.0f);
+        instances[i]->transform
+            = buildTransform(time + offset, 0.5f + std::fmod(offset, 3.0f) * 0.5f, translation);
+    }
+}
+
+// The same scene with every instance's triangles copied into one tree.
+KDTree<TestSurfaceData> buildFlattenedTree(const std::vector<std::array<glm::vec3, 3>>& triangles,
+    const std::vector<std::shared_ptr<TestInstance>>& instances)
+{
+    PresortedKDTreeBuilder<TestSurfaceData> builder;
+    for (size_t i = 0; i < instances.size(); i++) {
+        for (const auto& triangle : triangles) {
+            std::array<glm::vec3, 3> vertices;
+            for (size_t j = 0; j < 3; j++) {
+                vertices[j] = glm::vec3(instances[i]->transform * glm::vec4(triangle[j], 1.0f));
+            }
+            builder.addTriangle(vertices, { i });
+        }
+    }
+    return builder.build();
+}
+
+std::vector<Ray> buildRandomRays(size_t count, uint32_t seed)
+{
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<float> position(-25.0f, 25.0f);
+
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < count; i++) {
+        glm::vec3 origin(position(generator), position(generator), position(generator));
+        glm::vec3 target(position(generator), position(generator) * 0.1f, position(generator));
+        rays.push_back(Ray{ origin, glm::normalize(target - origin) });
+    }
+    return rays;
+}
+
+void expectMatchesFlattenedTree(const InstancedKDTree<TestSurfaceData, TestInstance>& tree,
+    const std::vector<std::array<glm::vec3, 3>>& triangles,
+    const std::vector<std::shared_ptr<TestInstance>>& instances)
+{
+    auto flattenedTree = buildFlattenedTree(triangles, instances);
+    for (const auto& ray : buildRandomRays(500, 3)) {
+        auto expected = flattenedTree.castRay(ray);
+        auto hit = tree.castRay(ray);
+        ASSERT_EQ(expected.has_value(), hit.has_value());
+        if (hit) {
+            EXPECT_NEAR(expected->t, hit->t, 1e-3f);
+            EXPECT_EQ(instances[expected->triangle->data.id].get(), hit->instance);
+        }
+        EXPECT_EQ(hit && (hit->t <= 10.0f), tree.occluded(ray, 10.0f));
+    }
+}
+}
+
+TEST(InstancedKDTreeTests, CastRayMatchesFlattenedTree)
+{
+    auto triangles = buildRandomTriangles(100, 1);
+    PresortedKDTreeBuilder<TestSurfaceData> builder;
+    for (size_t i = 0; i < triangles.size(); i++) {
+        builder.addTriangle(triangles[i], { i });
+    }
+    InstancedKDTree<TestSurfaceData, TestInstance> tree(
+        std::make_shared<KDTree<TestSurfaceData>>(builder.build()));
+
+    std::vector<std::shared_ptr<TestInstance>> instances;
+    for (size_t i = 0; i < 40; i++) {
+        instances.push_back(std::make_shared<TestInstance>());
+        tree.addInstance(instances.back());
+    }
+
+    for (float time : { 0.0f, 0.1f, 2.0f }) {
+        placeInstances(instances, time);
+        tree.update();
+        expectMatchesFlattenedTree(tree, triangles, instances);
+    }
+}
+
+TEST(InstancedKDTreeTests, TransformedBoxContainsTransformedCorners)
+{
+    AxisAlignedBoundingBox box;
+    box.minimum = glm::vec3(-1.0f, 0.0f, 2.0f);
+    box.maximum = glm::vec3(3.0f, 1.0f, 5.0f);
+    auto transform = buildTransform(0.7f, 2.0f, glm::vec3(1.0f, -4.0f, 9.0f));
+    auto transformedBox = transformBoundingBox(box, transform);
+
+    for (int corner = 0; corner < 8; corner++) {
+        glm::vec3 vertex((corner & 1) ? box.maximum.x : box.minimum.x,
+            (corner & 2) ? box.maximum.y : box.minimum.y,
+            (corner & 4) ? box.maximum.z : box.minimum.z);
+        glm::vec3 transformedVertex(transform * glm::vec4(vertex, 1.0f));
+        for (int k = 0; k < 3; k++) {
+            EXPECT_GE(transformedVertex[k], transformedBox.minimum[k] - 1e-4f);
+            EXPECT_LE(transformedVertex[k], transformedBox.maximum[k] + 1e-4f);
+        }
+    }
+}
@@ -1,6 +1,13 @@
 #include "rev/geometry/KDTree.h"
+#include "rev/geometry/KDTreeFile.h"
+#include "rev/geometry/PresortedKDTreeBuilder.h"
 
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
 #include <gtest/gtest.h>
+#include <numeric>
+#include <random>
 
 using namespace rev;
 
@@ -8,6 +15,149 @@ namespace {
 struct TestSurfaceData {
     uint64_t id;
 };
+
+std::vector<std::array<glm::vec3, 3>> buildRandomTriangles(size_t count, uint32_t seed)
+{
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<float> position(-10.0f, 10.0f);
+    std::uniform_real_distribution<float> offset(-1.0f, 1.0f);
+
+    std::vector<std::array<glm::vec3, 3>> triangles;
+    for (size_t i = 0; i < count; i++) {
+        glm::vec3 center(position(generator), position(generator), position(generator));
+        std::array<glm::vec3, 3> triangle;
+        for (auto& vertex : triangle) {
+            vertex = center + glm::vec3(offset(generator), offset(generator), offset(generator));
+        }
+        triangles.push_back(triangle);
+    }
+    return triangles;
+}
+
+// A bumpy height field, which produces lots of triangles sharing split planes.
+std::vector<std::array<glm::vec3, 3>> buildTerrainTriangles(size_t size)
+{
+    auto vertex = [](size_t x, size_t z) {
+        float height = static_cast<float>((x * 7 + z * 13) % 5) * 0.25f;
+        return glm::vec3(static_cast<float>(x), height, static_cast<float>(z));
+    };
+
+    std::vector<std::array<glm::vec3, 3>> triangles;
+    for (size_t x = 0; x < size; x++) {
+        for (size_t z = 0; z < size; z++) {
+            triangles.push_back({ vertex(x, z), vertex(x + 1, z), vertex(x, z + 1) });
+            triangles.push_back({ vertex(x + 1, z), vertex(x + 1, z + 1), vertex(x, z + 1) });
+        }
+    }
+    return triangles;
+}
+
+template <typename Builder>
+auto buildTree(const std::vector<std::array<glm::vec3, 3>>& triangles)
+{
+    Builder builder;
+    for (size_t i = 0; i < triangles.size(); i++) {
+        builder.addTriangle(triangles[i], { i });
+    }
+    return builder.build();
+}
+
+std::vector<Ray> buildRandomRays(size_t count, uint32_t seed)
+{
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<float> position(-15.0f, 15.0f);
+    std::uniform_real_distribution<float> direction(-1.0f, 1.0f);
+
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < count; i++) {
+        glm::vec3 origin(position(generator), position(generator), position(generator));
+        glm::vec3 target(direction(generator), direction(generator), direction(generator));
+        rays.push_back(Ray{ origin, glm::normalize(target * 10.0f - origin) });
+    }
+    return rays;
+}
+
+std::optional<float> castRayBruteForce(
+    const std::vector<std::array<glm::vec3, 3>>& triangles, const Ray& ray)
+{
+    std::optional<float> closest;
+    for (const auto& vertices : triangles) {
+        auto hit = Triangle<TestSurfaceData>{ vertices, { 0 } }.castRay(ray);
+        if (hit && (!closest || (hit->t < *closest))) {
+            closest = hit->t;
+        }
+    }
+    return closest;
+}
+
+// A primitive other than a triangle, for trees over arbitrary primitives.
+struct TestBall {
+    Sphere sphere;
+    uint64_t id;
+
+    AxisAlignedBoundingBox getBoundingBox() const
+    {
+        glm::vec3 extent(sphere.radius);
+        return { sphere.center - extent, sphere.center + extent };
+    }
+
+    std::optional<AxisAlignedBoundingBox> clippedBoundingBox(
+        const AxisAlignedBoundingBox& box) const
+    {
+        if (box.getDistanceSquared(sphere.center) > (sphere.radius * sphere.radius)) {
+            return std::nullopt;
+        }
+        auto clippedBox = getBoundingBox();
+        clippedBox.reduceToBox(box);
+        return clippedBox;
+    }
+
+    struct Hit {
+        float t;
+    };
+
+    std::optional<Hit> castRay(const Ray& ray) const
+    {
+        glm::vec3 fromCenter = ray.origin - sphere.center;
+        auto t = findSmallestQuadraticRoot(glm::dot(ray.direction, ray.direction),
+            2.0f * glm::dot(ray.direction, fromCenter),
+            glm::dot(fromCenter, fromCenter) - (sphere.radius * sphere.radius),
+            std::numeric_limits<float>::infinity());
+        if (!t) {
+            return std::nullopt;
+        }
+        return Hit{ *t };
+    }
+
+    bool intersectsSphere(const Sphere& other) const
+    {
+        return glm::length(other.center - sphere.center) <= (sphere.radius + other.radius);
+    }
+};
+
+std::vector<TestBall> buildRandomBalls(size_t count, uint32_t seed)
+{
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<float> position(-10.0f, 10.0f);
+    std::uniform_real_distribution<float> radius(0.1f, 1.0f);
+
+    std::vector<TestBall> balls;
+    for (size_t i = 0; i < count; i++) {
+        glm::vec3 center(position(generator), position(generator), position(generator));
+        balls.push_back({ { center, radius(generator) }, i });
+    }
+    return balls;
+}
+
+template <typename Builder>
+auto buildBallTree(const std::vector<TestBall>& balls)
+{
+    Builder builder;
+    for (const auto& ball : balls) {
+        builder.addPrimitive(ball);
+    }
+    return builder.build();
+}
 }
 
 TEST(KDTreeTests, BuildTreeWithSomeTriangles)
@@ -64,4 +214,670 @@ TEST(KDTreeTests, BuildTreeWithSomeTriangles)
 
     });
     tree.dump();
-}
\ No newline at end of file
+}
+
+TEST(KDTreeTests, CastRayMatchesBruteForce)
+{
+    auto triangles = buildRandomTriangles(500, 1);
+    auto tree = buildTree<KDTreeBuilder<TestSurfaceData>>(triangles);
+
+    size_t hitCount = 0;
+    for (const auto& ray : buildRandomRays(500, 2)) {
+        auto expected = castRayBruteForce(triangles, ray);
+        auto hit = tree.castRay(ray);
+        ASSERT_EQ(expected.has_value(), hit.has_value());
+        if (hit) {
+            EXPECT_FLOAT_EQ(*expected, hit->t);
+            hitCount++;
+        }
+    }
+    EXPECT_GT(hitCount, 0u);
+}
+
+TEST(KDTreeTests, PresortedBuilderMatchesSurfaceAreaCost)
+{
+    for (const auto& triangles : { buildRandomTriangles(300, 3), buildTerrainTriangles(12) }) {
+        auto referenceTree = buildTree<KDTreeBuilder<TestSurfaceData>>(triangles);
+        auto presortedTree = buildTree<PresortedKDTreeBuilder<TestSurfaceData>>(triangles);
+
+        float referenceCost = referenceTree.getSurfaceAreaCost();
+        EXPECT_NEAR(presortedTree.getSurfaceAreaCost(), referenceCost, referenceCost * 1e-4f);
+
+        for (const auto& ray : buildRandomRays(200, 4)) {
+            auto referenceHit = referenceTree.castRay(ray);
+            auto presortedHit = presortedTree.castRay(ray);
+            ASSERT_EQ(referenceHit.has_value(), presortedHit.has_value());
+            if (referenceHit) {
+                EXPECT_FLOAT_EQ(referenceHit->t, presortedHit->t);
+            }
+        }
+    }
+}
+
+TEST(KDTreeTests, ParallelBuildMatchesSerialBuild)
+{
+    auto triangles = buildTerrainTriangles(24);
+    auto serialTree = buildTree<PresortedKDTreeBuilder<TestSurfaceData>>(triangles);
+
+    KDTreeBuildOptions options;
+    options.workerPool = std::make_shared<WorkerPool>(4);
+    options.parallelSubtreeThreshold = 16;
+    options.parallelSplitSearchThreshold = 256;
+    PresortedKDTreeBuilder<TestSurfaceData> builder(options);
+    for (size_t i = 0; i < triangles.size(); i++) {
+        builder.addTriangle(triangles[i], { i });
+    }
+    auto parallelTree = builder.build();
+
+    EXPECT_EQ(serialTree.getSurfaceAreaCost(), parallelTree.getSurfaceAreaCost());
+    for (const auto& ray : buildRandomRays(500, 5)) {
+        auto serialHit = serialTree.castRay(ray);
+        auto parallelHit = parallelTree.castRay(ray);
+        ASSERT_EQ(serialHit.has_value(), parallelHit.has_value());
+        if (serialHit) {
+            EXPECT_EQ(serialHit->triangle->data.id, parallelHit->triangle->data.id);
+            EXPECT_EQ(serialHit->t, parallelHit->t);
+        }
+    }
+}
+
+template <size_t Width>
+void checkRayPacketsMatchSingleRays(const KDTree<TestSurfaceData>& tree, const glm::vec3& origin)
+{
+    std::mt19937 generator(6);
+    std::uniform_real_distribution<float> spread(-0.3f, 0.3f);
+    for (size_t packetIndex = 0; packetIndex < 100; packetIndex++) {
+        // A narrow fan of rays from one origin, like a picking grid.
+        glm::vec3 center = glm::normalize(glm::vec3(12.0f, 0.0f, 12.0f) - origin
+            + glm::vec3(spread(generator), spread(generator), spread(generator)) * 40.0f);
+        std::array<Ray, Width> rays;
+        for (auto& ray : rays) {
+            glm::vec3 offset(spread(generator), spread(generator), spread(generator));
+            ray = Ray{ origin, glm::normalize(center + offset * 0.1f) };
+        }
+
+        auto packetHits = tree.castRayPacket(rays);
+        for (size_t i = 0; i < Width; i++) {
+            auto hit = tree.castRay(rays[i]);
+            ASSERT_EQ(hit.has_value(), packetHits[i].has_value());
+            if (hit) {
+                EXPECT_FLOAT_EQ(hit->t, packetHits[i]->t);
+                EXPECT_EQ(hit->triangle, packetHits[i]->triangle);
+            }
+        }
+    }
+}
+
+TEST(KDTreeTests, CastRayPacketMatchesSingleRays)
+{
+    auto tree = buildTree<PresortedKDTreeBuilder<TestSurfaceData>>(buildTerrainTriangles(24));
+    for (const auto& origin : { glm::vec3(-5.0f, 6.0f, -5.0f), glm::vec3(12.0f, 4.0f, 12.0f),
+             glm::vec3(30.0f, 0.5f, 3.0f) }) {
+        checkRayPacketsMatchSingleRays<4>(tree, origin);
+        checkRayPacketsMatchSingleRays<8>(tree, origin);
+    }
+
+    // Incoherent rays fall back to single ray casts.
+    auto rays = buildRandomRays(4, 7);
+    std::array<Ray, 4> packet{ rays[0], rays[1], rays[2], rays[3] };
+    auto packetHits = tree.castRayPacket(packet);
+    for (size_t i = 0; i < packet.size(); i++) {
+        EXPECT_EQ(tree.castRay(packet[i]).has_value(), packetHits[i].has_value());
+    }
+}
+
+TEST(KDTreeTests, CastRaysMatchesSingleRays)
+{
+    auto tree = buildTree<PresortedKDTreeBuilder<TestSurfaceData>>(buildTerrainTriangles(24));
+    WorkerPool pool(3);
+
+    for (size_t rayCount : { 7, 1001 }) {
+        std::vector<Ray> rays;
+        for (size_t i = 0; i < rayCount; i++) {
+            float angle = static_cast<float>(i) * 0.01f;
+            glm::vec3 direction(std::cos(angle), -0.3f, std::sin(angle));
+            rays.push_back(Ray{ glm::vec3(12.0f, 3.0f, 12.0f), glm::normalize(direction) });
+        }
+
+        std::vector<std::optional<KDTree<TestSurfaceData>::Hit>> hits(rayCount);
+        std::unique_ptr<bool[]> occluded(new bool[rayCount]);
+        tree.castRays(pool, rays, hits);
+        tree.castOcclusionRays(pool, rays, gsl::span<bool>(occluded.get(), rayCount), 5.0f);
+
+        for (size_t i = 0; i < rayCount; i++) {
+            auto hit = tree.castRay(rays[i]);
+            ASSERT_EQ(hit.has_value(), hits[i].has_value());
+            if (hit) {
+                EXPECT_EQ(hit->triangle, hits[i]->triangle);
+            }
+            EXPECT_EQ(tree.castRay(rays[i], 5.0f).has_value(), occluded[i]);
+        }
+    }
+}
+
+TEST(KDTreeTests, OccludedMatchesCastRay)
+{
+    auto tree = buildTree<PresortedKDTreeBuilder<TestSurfaceData>>(buildRandomTriangles(500, 5));
+    auto rays = buildRandomRays(512, 6);
+
+    for (float maxDistance : { 0.5f, 2.0f, 10.0f }) {
+        for (size_t i = 0; i + 4 <= rays.size(); i += 4) {
+            std::array<Ray, 4> packet{ rays[i], rays[i + 1], rays[i + 2], rays[i + 3] };
+            auto occluded = tree.occludedPacket(packet, maxDistance);
+            for (size_t j = 0; j < 4; j++) {
+                bool expected = tree.castRay(packet[j], maxDistance).has_value();
+                EXPECT_EQ(expected, tree.occluded(packet[j], maxDistance));
+                EXPECT_EQ(expected, occluded[j]);
+            }
+        }
+    }
+}
+
+TEST(KDTreeTests, SavedTreeLoadsFromFile)
+{
+    auto path = (std::filesystem::temp_directory_path() / "rev_kdtree_test.kdtree").string();
+    std::filesystem::remove(path);
+
+    PresortedKDTreeBuilder<TestSurfaceData> builder;
+    auto triangles = buildRandomTriangles(300, 7);
+    for (size_t i = 0; i < triangles.size(); i++) {
+        builder.addTriangle(triangles[i], { i });
+    }
+    auto builtTree = loadOrBuildKDTree(builder, path);
+    auto loadedTree = loadKDTree<TestSurfaceData>(path, builder.getContentHash());
+    ASSERT_TRUE(loadedTree.has_value());
+    EXPECT_EQ(builtTree.getSurfaceAreaCost(), loadedTree->getSurfaceAreaCost());
+
+    for (const auto& ray : buildRandomRays(256, 8)) {
+        auto builtHit = builtTree.castRay(ray);
+        auto loadedHit = loadedTree->castRay(ray);
+        ASSERT_EQ(builtHit.has_value(), loadedHit.has_value());
+        if (builtHit) {
+            EXPECT_EQ(builtHit->triangle->data.id, loadedHit->triangle->data.id);
+            EXPECT_EQ(builtHit->t, loadedHit->t);
+        }
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST(KDTreeTests, StaleTreeFilesAreRejected)
+{
+    auto path = (std::filesystem::temp_directory_path() / "rev_kdtree_stale.kdtree").string();
+    std::filesystem::remove(path);
+    EXPECT_FALSE(loadKDTree<TestSurfaceData>(path, 0).has_value());
+
+    PresortedKDTreeBuilder<TestSurfaceData> builder;
+    for (const auto& triangle : buildRandomTriangles(50, 9)) {
+        builder.addTriangle(triangle, { 0 });
+    }
+    uint64_t contentHash = builder.getContentHash();
+    saveKDTree(builder.build(), contentHash, path);
+    EXPECT_TRUE(loadKDTree<TestSurfaceData>(path, contentHash).has_value());
+    EXPECT_FALSE(loadKDTree<TestSurfaceData>(path, contentHash + 1).has_value());
+
+    {
+        // A file saved on a machine with the other byte order.
+        std::fstream file{ path, std::ios::binary | std::ios::in | std::ios::out };
+        uint32_t swappedMark = 0x04030201;
+        file.seekp(offsetof(detail::KDTreeFileHeader, byteOrderMark));
+        file.write(reinterpret_cast<const char*>(&swappedMark), sizeof(swappedMark));
+    }
+    EXPECT_FALSE(loadKDTree<TestSurfaceData>(path, contentHash).has_value());
+
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 4);
+    EXPECT_FALSE(loadKDTree<TestSurfaceData>(path, contentHash).has_value());
+
+    std::filesystem::remove(path);
+}
+
+TEST(KDTreeTests, MalformedTreesAreRejected)
+{
+    auto isValid = [](const std::vector<KDTreeNode>& nodes) {
+        KDTreeArrays<TestSurfaceData> arrays{ {}, nodes, {}, {}, {} };
+        return detail::isValidKDTree(arrays);
+    };
+    AxisAlignedPlane split{ 0, 0.0f };
+    auto leaf = KDTreeNode::makeLeaf(0, 0);
+
+    EXPECT_TRUE(isValid({ KDTreeNode::makeBranch(split, 2), leaf, leaf }));
+    // Right children that point back at the branch or its left child.
+    EXPECT_FALSE(isValid({ KDTreeNode::makeBranch(split, 0), leaf }));
+    EXPECT_FALSE(isValid({ KDTreeNode::makeBranch(split, 1), leaf }));
+    // Two branches sharing a leaf, with a node left over.
+    EXPECT_FALSE(isValid({ KDTreeNode::makeBranch(split, 4), KDTreeNode::makeBranch(split, 4),
+        leaf, leaf, leaf }));
+    // Children stored out of depth-first order.
+    EXPECT_FALSE(isValid({ KDTreeNode::makeBranch(split, 2), KDTreeNode::makeBranch(split, 4),
+        KDTreeNode::makeBranch(split, 5), leaf, leaf, leaf, leaf }));
+}
+
+TEST(KDTreeTests, SweepSphereMatchesBruteForce)
+{
+    auto triangles = buildRandomTriangles(2000, 14);
+    auto tree = buildTree<PresortedKDTreeBuilder<TestSurfaceData>>(triangles);
+
+    std::mt19937 generator(15);
+    std::uniform_real_distribution<float> radius(0.05f, 1.5f);
+    std::uniform_real_distribution<float> length(1.0f, 30.0f);
+    size_t hitCount = 0;
+    for (const auto& ray : buildRandomRays(300, 16)) {
+        Sphere sphere{ ray.origin, radius(generator) };
+        glm::vec3 displacement = ray.direction * length(generator);
+
+        std::optional<float> expected;
+        for (size_t i = 0; i < triangles.size(); i++) {
+            Triangle<TestSurfaceData> triangle{ triangles[i], { i } };
+            auto hit = triangle.sweepSphere(sphere, displacement);
+            if (hit && (!expected || (hit->t < *expected))) {
+                expected = hit->t;
+            }
+        }
+
+        auto hit = tree.sweepSphere(sphere, displacement);
+        ASSERT_EQ(expected.has_value(), hit.has_value());
+        if (!hit) {
+            continue;
+        }
+        hitCount++;
+        EXPECT_EQ(*expected, hit->t);
+
+        // The sphere should just touch the triangle where it stopped, unless it started there.
+        glm::vec3 center = sphere.center + (displacement * hit->t);
+        glm::vec3 closestPoint = hit->triangle->getClosestPoint(center);
+        if (hit->t > 0.0f) {
+            EXPECT_NEAR(sphere.radius, glm::length(center - closestPoint), 1e-3f);
+        }
+        EXPECT_NEAR(0.0f, glm::length(closestPoint - hit->point), 1e-3f);
+        EXPECT_GE(glm::dot(hit->normal, center - hit->point), 0.0f);
+    }
+    EXPECT_GT(hitCount, 0u);
+}
+
+TEST(KDTreeTests, SweepSphereStopsAtThinWalls)
+{
+    // A fast sphere would step straight over this wall if it were only tested where it lands.
+    KDTreeBuilder<TestSurfaceData> builder;
+    builder.addTriangle({ glm::vec3(0.0f, -5.0f, -5.0f), glm::vec3(0.0f, 5.0f, -5.0f),
+                            glm::vec3(0.0f, -5.0f, 5.0f) },
+        { 0 });
+    builder.addTriangle({ glm::vec3(0.0f, 5.0f, -5.0f), glm::vec3(0.0f, 5.0f, 5.0f),
+                            glm::vec3(0.0f, -5.0f, 5.0f) },
+        { 1 });
+    auto tree = builder.build();
+
+    Sphere sphere{ glm::vec3(-10.0f, 1.0f, 2.0f), 0.5f };
+    auto hit = tree.sweepSphere(sphere, glm::vec3(100.0f, 0.0f, 0.0f));
+    ASSERT_TRUE(hit.has_value());
+    EXPECT_NEAR(0.095f, hit->t, 1e-6f);
+    EXPECT_NEAR(0.0f, glm::length(hit->point - glm::vec3(0.0f, 1.0f, 2.0f)), 1e-4f);
+    EXPECT_NEAR(-1.0f, hit->normal.x, 1e-6f);
+
+    // Passing beside the wall, the sphere should only catch its edge.
+    sphere.center = glm::vec3(-10.0f, 5.25f, 0.0f);
+    hit = tree.sweepSphere(sphere, glm::vec3(20.0f, 0.0f, 0.0f));
+    ASSERT_TRUE(hit.has_value());
+    EXPECT_NEAR((10.0f - std::sqrt(0.1875f)) / 20.0f, hit->t, 1e-5f);
+    EXPECT_NEAR(5.0f, hit->point.y, 1e-4f);
+    EXPECT_FALSE(tree.sweepSphere(sphere, glm::vec3(5.0f, 0.0f, 0.0f)).has_value());
+}
+
+TEST(KDTreeTests, ClosestPointMatchesBruteForce)
+{
+    auto triangles = buildRandomTriangles(2000, 17);
+    auto tree = buildTree<PresortedKDTreeBuilder<TestSurfaceData>>(triangles);
+
+    for (const auto& ray : buildRandomRays(300, 18)) {
+        std::vector<float> distances;
+        for (size_t i = 0; i < triangles.size(); i++) {
+            Triangle<TestSurfaceData> triangle{ triangles[i], { i } };
+            distances.push_back(glm::length(triangle.getClosestPoint(ray.origin) - ray.origin));
+        }
+        std::sort(distances.begin(), distances.end());
+
+        auto closest = tree.closestPoint(ray.origin);
+        ASSERT_TRUE(closest.has_value());
+        EXPECT_EQ(distances[0], closest->distance);
+        EXPECT_EQ(closest->point, closest->triangle->getClosestPoint(ray.origin));
+
+        // A radius short of the nearest triangle finds nothing.
+        EXPECT_FALSE(tree.closestPoint(ray.origin, distances[0] * 0.99f).has_value());
+
+        auto nearest = tree.kNearestTriangles(ray.origin, 8);
+        ASSERT_EQ(8u, nearest.size());
+        std::set<uint64_t> ids;
+        for (size_t i = 0; i < nearest.size(); i++) {
+            EXPECT_EQ(distances[i], nearest[i].distance);
+            ids.insert(nearest[i].triangle->data.id);
+        }
+        EXPECT_EQ(nearest.size(), ids.size());
+
+        nearest = tree.kNearestTriangles(ray.origin, 8, distances[3]);
+        EXPECT_EQ(4u, nearest.size());
+    }
+}
+
+TEST(KDTreeTests, IntersectsSphereMatchesClosestPoint)
+{
+    auto triangles = buildRandomTriangles(200, 19);
+    std::mt19937 generator(20);
+    std::uniform_real_distribution<float> radius(0.1f, 4.0f);
+    for (const auto& ray : buildRandomRays(100, 21)) {
+        Sphere sphere{ ray.origin * 0.5f, radius(generator) };
+        for (auto& vertices : triangles) {
+            Triangle<TestSurfaceData> triangle{ vertices, { 0 } };
+            float distance = glm::length(triangle.getClosestPoint(sphere.center) - sphere.center);
+            EXPECT_EQ(distance <= sphere.radius, triangle.intersectsSphere(sphere).has_value());
+        }
+    }
+}
+
+TEST(KDTreeTests, RegionQueriesMatchBruteForce)
+{
+    auto triangles = buildRandomTriangles(2000, 22);
+    auto tree = buildTree<PresortedKDTreeBuilder<TestSurfaceData>>(triangles);
+
+    auto checkRegion = [&](auto&& visitTriangles, auto&& isInRegion) {
+        std::vector<uint64_t> expected;
+        for (size_t i = 0; i < triangles.size(); i++) {
+            Triangle<TestSurfaceData> triangle{ triangles[i], { i } };
+            if (isInRegion(triangle)) {
+                expected.push_back(i);
+            }
+        }
+
+        std::vector<uint64_t> visited;
+        visitTriangles([&visited](Triangle<TestSurfaceData>& triangle) {
+            visited.push_back(triangle.data.id);
+        });
+        std::sort(visited.begin(), visited.end());
+        EXPECT_EQ(expected, visited);
+        return expected.size();
+    };
+
+    for (float size : { 0.5f, 3.0f, 8.0f, 30.0f }) {
+        AxisAlignedBoundingBox box{ glm::vec3(-size, -size * 0.5f, 1.0f - size),
+            glm::vec3(size * 0.7f, size, 1.0f + size) };
+        size_t count = checkRegion(
+            [&](auto&& visitor) { tree.visitTrianglesInBox(box, visitor); },
+            [&](Triangle<TestSurfaceData>& triangle) {
+                return triangle.clippedBoundingBox(box).has_value();
+            });
+        if (size == 30.0f) {
+            EXPECT_EQ(triangles.size(), count);
+        }
+
+        std::array<Plane, 4> planes{
+            Plane{ glm::normalize(glm::vec3(1.0f, 0.2f, 0.0f)), size },
+            Plane{ glm::normalize(glm::vec3(-1.0f, 0.0f, 0.3f)), size },
+            Plane{ glm::normalize(glm::vec3(0.0f, 1.0f, -0.1f)), size * 0.5f },
+            Plane{ glm::normalize(glm::vec3(0.1f, -1.0f, 0.0f)), size },
+        };
+        checkRegion(
+            [&](auto&& visitor) {
+                tree.visitTrianglesInFrustum(gsl::span<const Plane>(planes), visitor);
+            },
+            [&](Triangle<TestSurfaceData>& triangle) {
+                for (const auto& plane : planes) {
+                    if ((plane.getSignedDistance(triangle.vertices[0]) < 0.0f)
+                        && (plane.getSignedDistance(triangle.vertices[1]) < 0.0f)
+                        && (plane.getSignedDistance(triangle.vertices[2]) < 0.0f)) {
+                        return false;
+                    }
+                }
+                return true;
+            });
+    }
+}
+
+TEST(KDTreeTests, SphereQueryVisitsEachTriangleOnce)
+{
+    auto triangles = buildRandomTriangles(2000, 23);
+    auto tree = buildTree<PresortedKDTreeBuilder<TestSurfaceData>>(triangles);
+
+    for (float radius : { 0.5f, 2.0f, 6.0f, 40.0f }) {
+        Sphere sphere{ glm::vec3(1.0f, -2.0f, 0.5f), radius };
+        std::vector<uint64_t> expected;
+        for (size_t i = 0; i < triangles.size(); i++) {
+            Triangle<TestSurfaceData> triangle{ triangles[i], { i } };
+            if (triangle.intersectsSphere(sphere)) {
+                expected.push_back(i);
+            }
+        }
+
+        std::vector<uint64_t> visited;
+        tree.visitTrianglesIntersectingSphere(
+            sphere, [&visited, &sphere](Triangle<TestSurfaceData>& triangle, float distance) {
+                visited.push_back(triangle.data.id);
+                EXPECT_EQ(*triangle.intersectsSphere(sphere), distance);
+            });
+        std::sort(visited.begin(), visited.end());
+        EXPECT_EQ(expected, visited);
+    }
+}
+
+TEST(KDTreeTests, MailboxRemembersPrimitives)
+{
+    PrimitiveMailbox mailbox;
+    for (uint32_t i = 0; i < 8; i++) {
+        EXPECT_TRUE(mailbox.add(i * 3));
+    }
+    for (uint32_t i = 0; i < 8; i++) {
+        EXPECT_FALSE(mailbox.add(i * 3));
+    }
+}
+
+TEST(KDTreeTests, ExactMailboxRemembersEveryPrimitive)
+{
+    // Far more primitives than the mailbox has slots, so most of them overflow.
+    ExactPrimitiveMailbox mailbox;
+    for (uint32_t i = 0; i < 1000; i++) {
+        EXPECT_TRUE(mailbox.add(i * 7));
+    }
+    for (uint32_t i = 0; i < 1000; i++) {
+        EXPECT_FALSE(mailbox.add(i * 7));
+    }
+    EXPECT_TRUE(mailbox.add(1));
+}
+
+TEST(KDTreeTests, BuildStatsDescribeTree)
+{
+    auto triangles = buildRandomTriangles(2000, 24);
+    auto tree = buildTree<PresortedKDTreeBuilder<TestSurfaceData>>(triangles);
+    auto stats = tree.getBuildStats();
+
+    // Every branch has two children, so there's one more leaf than there are branches.
+    EXPECT_EQ(stats.nodeCount, (stats.leafCount * 2) - 1);
+    EXPECT_EQ(triangles.size(), stats.triangleCount);
+    EXPECT_GE(stats.leafTriangleCount, stats.triangleCount);
+    EXPECT_GE(stats.getDuplicationFactor(), 1.0f);
+    EXPECT_GT(stats.maxLeafTriangleCount, 0u);
+    EXPECT_LE(stats.leafDepthHistogram.size(), kMaxKDTreeDepth);
+    EXPECT_EQ(stats.leafCount,
+        std::accumulate(stats.leafDepthHistogram.begin(), stats.leafDepthHistogram.end(),
+            size_t{ 0 }));
+    EXPECT_EQ(tree.getSurfaceAreaCost(), stats.surfaceAreaCost);
+    EXPECT_GT(stats.buildTime.count(), 0.0);
+}
+
+TEST(KDTreeTests, QueryStatsCountWork)
+{
+    auto triangles = buildRandomTriangles(2000, 25);
+    auto tree = buildTree<PresortedKDTreeBuilder<TestSurfaceData>>(triangles);
+    auto rays = buildRandomRays(100, 26);
+
+    size_t hitCount = 0;
+    for (const auto& ray : rays) {
+        hitCount += tree.castRay(ray).has_value();
+    }
+    auto stats = tree.getQueryStats();
+    if (!kKDTreeQueryStatsEnabled) {
+        EXPECT_EQ(0u, stats.queryCount);
+        EXPECT_EQ(0u, stats.nodesVisited);
+        return;
+    }
+
+    EXPECT_EQ(rays.size(), stats.queryCount);
+    EXPECT_EQ(hitCount, stats.hits);
+    EXPECT_GE(stats.nodesVisited, rays.size());
+    EXPECT_GT(stats.trianglesTested, 0u);
+    EXPECT_LT(stats.trianglesTested, rays.size() * triangles.size() / 10);
+
+    tree.resetQueryStats();
+    tree.visitTrianglesInBox(tree.getBoundingBox(), [](Triangle<TestSurfaceData>&) {});
+    stats = tree.getQueryStats();
+    EXPECT_EQ(1u, stats.queryCount);
+    EXPECT_EQ(triangles.size(), stats.hits);
+    // The whole tree lies in the box, so no triangle needs testing.
+    EXPECT_EQ(0u, stats.trianglesTested);
+}
+
+TEST(KDTreeTests, PrimitiveTreeMatchesBruteForce)
+{
+    auto balls = buildRandomBalls(500, 34);
+    auto tree = buildBallTree<BasicPresortedKDTreeBuilder<TestBall>>(balls);
+    static_assert(std::is_same_v<decltype(tree), BasicKDTree<TestBall>>);
+    EXPECT_FLOAT_EQ(buildBallTree<BasicKDTreeBuilder<TestBall>>(balls).getSurfaceAreaCost(),
+        tree.getSurfaceAreaCost());
+
+    size_t hitCount = 0;
+    for (const auto& ray : buildRandomRays(300, 35)) {
+        std::optional<float> expected;
+        for (const auto& ball : balls) {
+            auto hit = ball.castRay(ray);
+            if (hit && (!expected || (hit->t < *expected))) {
+                expected = hit->t;
+            }
+        }
+
+        auto hit = tree.castRay(ray);
+        ASSERT_EQ(expected.has_value(), hit.has_value());
+        if (hit) {
+            EXPECT_EQ(*expected, hit->hit.t);
+            EXPECT_EQ(*expected, hit->primitive->castRay(ray)->t);
+            hitCount++;
+        }
+        EXPECT_EQ(tree.castRay(ray, 5.0f).has_value(), tree.occluded(ray, 5.0f));
+    }
+    EXPECT_GT(hitCount, 0u);
+
+    Sphere sphere{ glm::vec3(1.0f, 2.0f, 3.0f), 4.0f };
+    AxisAlignedBoundingBox box{ glm::vec3(-4.0f, -2.0f, -6.0f), glm::vec3(3.0f, 5.0f, 1.0f) };
+    std::vector<uint64_t> expectedInSphere;
+    std::vector<uint64_t> expectedInBox;
+    for (const auto& ball : balls) {
+        if (ball.intersectsSphere(sphere)) {
+            expectedInSphere.push_back(ball.id);
+        }
+        if (ball.clippedBoundingBox(box)) {
+            expectedInBox.push_back(ball.id);
+        }
+    }
+
+    std::vector<uint64_t> inSphere;
+    tree.visitPrimitivesIntersectingSphere(
+        sphere, [&inSphere](TestBall& ball) { inSphere.push_back(ball.id); });
+    std::vector<uint64_t> inBox;
+    tree.visitPrimitivesInBox(box, [&inBox](TestBall& ball) { inBox.push_back(ball.id); });
+    std::sort(inSphere.begin(), inSphere.end());
+    std::sort(inBox.begin(), inBox.end());
+    EXPECT_FALSE(inSphere.empty());
+    EXPECT_EQ(expectedInSphere, inSphere);
+    EXPECT_EQ(expectedInBox, inBox);
+}
+
+TEST(KDTreeTests, LazyBuildMatchesEagerBuild)
+{
+    auto triangles = buildRandomTriangles(2000, 36);
+    auto eagerTree = buildTree<PresortedKDTreeBuilder<TestSurfaceData>>(triangles);
+
+    KDTreeBuildOptions options;
+    options.lazySubtreeThreshold = 64;
+    PresortedKDTreeBuilder<TestSurfaceData> builder(options);
+    for (size_t i = 0; i < triangles.size(); i++) {
+        builder.addTriangle(triangles[i], { i });
+    }
+    auto lazyTree = builder.build();
+    auto stats = lazyTree.getBuildStats();
+    EXPECT_GT(stats.deferredLeafCount, 0u);
+    EXPECT_EQ(triangles.size(), stats.triangleCount);
+    EXPECT_LT(stats.nodeCount, eagerTree.getBuildStats().nodeCount);
+
+    // The first queries build subtrees on several threads at once.
+    auto rays = buildRandomRays(1000, 37);
+    std::vector<std::optional<KDTree<TestSurfaceData>::Hit>> hits(rays.size());
+    WorkerPool pool(4);
+    lazyTree.castRays(pool, rays, hits);
+    for (size_t i = 0; i < rays.size(); i++) {
+        auto expected = eagerTree.castRay(rays[i]);
+        ASSERT_EQ(expected.has_value(), hits[i].has_value());
+        if (expected) {
+            EXPECT_EQ(expected->t, hits[i]->t);
+            EXPECT_EQ(expected->triangle->data.id, hits[i]->triangle->data.id);
+        }
+        EXPECT_EQ(eagerTree.occluded(rays[i], 5.0f), lazyTree.occluded(rays[i], 5.0f));
+    }
+
+    for (const auto& ray : buildRandomRays(100, 38)) {
+        auto expected = eagerTree.closestPoint(ray.origin);
+        auto closest = lazyTree.closestPoint(ray.origin);
+        ASSERT_EQ(expected.has_value(), closest.has_value());
+        EXPECT_EQ(expected->distance, closest->distance);
+
+        Sphere sphere{ ray.origin, 0.5f };
+        auto expectedSweep = eagerTree.sweepSphere(sphere, ray.direction * 20.0f);
+        auto sweep = lazyTree.sweepSphere(sphere, ray.direction * 20.0f);
+        ASSERT_EQ(expectedSweep.has_value(), sweep.has_value());
+        if (sweep) {
+            EXPECT_EQ(expectedSweep->t, sweep->t);
+        }
+    }
+
+    AxisAlignedBoundingBox box{ glm::vec3(-4.0f, -2.0f, -6.0f), glm::vec3(3.0f, 5.0f, 1.0f) };
+    std::vector<uint64_t> expectedInBox;
+    eagerTree.visitTrianglesInBox(box, [&expectedInBox](Triangle<TestSurfaceData>& triangle) {
+        expectedInBox.push_back(triangle.data.id);
+    });
+    std::vector<uint64_t> inBox;
+    lazyTree.visitTrianglesInBox(
+        box, [&inBox](Triangle<TestSurfaceData>& triangle) { inBox.push_back(triangle.data.id); });
+    EXPECT_EQ(expectedInBox, inBox);
+
+    // Coherent packets reach deferred leaves together.
+    PresortedKDTreeBuilder<TestSurfaceData> terrainBuilder(options);
+    auto terrain = buildTerrainTriangles(24);
+    for (size_t i = 0; i < terrain.size(); i++) {
+        terrainBuilder.addTriangle(terrain[i], { i });
+    }
+    auto lazyTerrain = terrainBuilder.build();
+    checkRayPacketsMatchSingleRays<4>(lazyTerrain, glm::vec3(-5.0f, 6.0f, -5.0f));
+    checkRayPacketsMatchSingleRays<8>(lazyTerrain, glm::vec3(30.0f, 0.5f, 3.0f));
+    for (size_t i = 0; i + 4 <= rays.size(); i += 4) {
+        std::array<Ray, 4> packet{ rays[i], rays[i + 1], rays[i + 2], rays[i + 3] };
+        auto occluded = lazyTerrain.occludedPacket(packet, 10.0f);
+        for (size_t j = 0; j < 4; j++) {
+            EXPECT_EQ(lazyTerrain.castRay(packet[j], 10.0f).has_value(), occluded[j]);
+        }
+    }
+
+    // Subtrees only exist in memory, so a lazily built tree can't be saved.
+    auto path = (std::filesystem::temp_directory_path() / "rev_kdtree_lazy.kdtree").string();
+    EXPECT_THROW(saveKDTree(lazyTree, builder.getContentHash(), path), std::runtime_error);
+    std::filesystem::remove(path);
+
+    auto balls = buildRandomBalls(500, 39);
+    auto eagerBallTree = buildBallTree<BasicPresortedKDTreeBuilder<TestBall>>(balls);
+    BasicPresortedKDTreeBuilder<TestBall> ballBuilder(options);
+    for (const auto& ball : balls) {
+        ballBuilder.addPrimitive(ball);
+    }
+    auto lazyBallTree = ballBuilder.build();
+    for (const auto& ray : buildRandomRays(300, 40)) {
+        auto expected = eagerBallTree.castRay(ray);
+        auto hit = lazyBallTree.castRay(ray);
+        ASSERT_EQ(expected.has_value(), hit.has_value());
+        if (hit) {
+            EXPECT_EQ(expected->primitive->id, hit->primitive->id);
+        }
+    }
+}
@@ -1,8 +1,14 @@
 #include "rev/NurbsCurve.h"
 
+#include "rev/ArcLengthTable.h"
+
+#include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <gtest/gtest.h>
 #include <iostream>
+#include <random>
+#include <vector>
 
 using namespace rev;
 
@@ -43,3 +49,680 @@ TEST(NurbsCurveTests, TestNurbsCircle)
         ASSERT_FLOAT_EQ(glm::dot(point, point), 1.0f);
     }
 }
+
+namespace {
+struct CurveData {
+    size_t order;
+    std::vector<float> knots;
+    std::vector<WeightedControlPoint<glm::vec3>> controlPoints;
+
+    NurbsCurve<glm::vec3> build() const { return { order, knots, controlPoints }; }
+
+    template <size_t Order>
+    NurbsCurve<glm::vec3, Order> buildFixedOrder() const
+    {
+        EXPECT_EQ(Order, order);
+        return { knots, controlPoints };
+    }
+
+    NurbsCurve<glm::dvec3> buildDouble() const
+    {
+        std::vector<double> doubleKnots(knots.begin(), knots.end());
+        std::vector<WeightedControlPoint<glm::dvec3>> doubleControlPoints;
+        for (const auto& controlPoint : controlPoints) {
+            doubleControlPoints.push_back(
+                { glm::dvec3(controlPoint.point), static_cast<double>(controlPoint.weight) });
+        }
+        return { order, doubleKnots, doubleControlPoints };
+    }
+};
+
+// A clamped curve with evenly spaced interior knots, and control points and weights scattered
+// around a loop.
+CurveData buildRandomCurve(size_t order, size_t controlPointCount, uint32_t seed)
+{
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<float> offset(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> weight(0.5f, 2.0f);
+
+    CurveData curve{ order, std::vector<float>(order, 0.0f), {} };
+    size_t interiorKnotCount = controlPointCount - order;
+    for (size_t i = 1; i <= interiorKnotCount; i++) {
+        curve.knots.push_back(static_cast<float>(i) / static_cast<float>(interiorKnotCount + 1));
+    }
+    curve.knots.resize(curve.knots.size() + order, 1.0f);
+
+    for (size_t i = 0; i < controlPointCount; i++) {
+        float angle = static_cast<float>(i) * 0.5f;
+        glm::vec3 point(std::cos(angle) * 10.0f, offset(generator), std::sin(angle) * 10.0f);
+        curve.controlPoints.push_back({ point + glm::vec3(offset(generator)), weight(generator) });
+    }
+    return curve;
+}
+
+// The textbook recursive definition of the basis functions.
+double getReferenceBasis(const std::vector<float>& knots, size_t index, size_t order, double t)
+{
+    if (order == 1) {
+        return ((knots[index] <= t) && (t < knots[index + 1])) ? 1.0 : 0.0;
+    }
+    double result = 0.0;
+    double leftWidth = knots[index + order - 1] - knots[index];
+    if (leftWidth > 0.0) {
+        result += (t - knots[index]) / leftWidth * getReferenceBasis(knots, index, order - 1, t);
+    }
+    double rightWidth = knots[index + order] - knots[index + 1];
+    if (rightWidth > 0.0) {
+        result += (knots[index + order] - t) / rightWidth
+            * getReferenceBasis(knots, index + 1, order - 1, t);
+    }
+    return result;
+}
+
+// NurbsCurve's evaluation before the triangular scheme, which recursed through the basis and
+// weighted ramps across repeated knots by one half.
+double getBaselineRampUp(double value, double bottom, double top)
+{
+    return (top == bottom) ? 0.5 : (value - bottom) / (top - bottom);
+}
+
+double getBaselineRampDown(double value, double bottom, double top)
+{
+    return (top == bottom) ? 0.5 : (top - value) / (top - bottom);
+}
+
+double getBaselineBasis(const std::vector<float>& knots, size_t index, size_t order, double t)
+{
+    double firstKnot = knots[index];
+    double lastKnot = knots[index + order];
+    if (order == 2) {
+        double middleKnot = knots[index + 1];
+        return (t < middleKnot) ? getBaselineRampUp(t, firstKnot, middleKnot)
+                                : getBaselineRampDown(t, middleKnot, lastKnot);
+    }
+    double secondKnot = knots[index + 1];
+    double secondToLastKnot = knots[index + order - 1];
+    double result = 0.0;
+    if (t < secondToLastKnot) {
+        result += getBaselineRampUp(t, firstKnot, secondToLastKnot)
+            * getBaselineBasis(knots, index, order - 1, t);
+    }
+    if (t > secondKnot) {
+        result += getBaselineRampDown(t, secondKnot, lastKnot)
+            * getBaselineBasis(knots, index + 1, order - 1, t);
+    }
+    return result;
+}
+
+glm::dvec3 getBaselinePoint(const CurveData& curve, double t)
+{
+    const auto& controlPoints = curve.controlPoints;
+    auto spanStart = std::lower_bound(curve.knots.begin(), curve.knots.end(), t);
+    auto spanEnd = static_cast<size_t>(std::distance(curve.knots.begin(), spanStart));
+    if (spanEnd == 0) {
+        return glm::dvec3(controlPoints.front().point);
+    }
+    if (spanEnd == curve.knots.size()) {
+        return glm::dvec3(controlPoints.back().point);
+    }
+
+    glm::dvec3 numerator(0.0);
+    double denominator = 0.0;
+    size_t firstIndex = (spanEnd > curve.order) ? spanEnd - curve.order : 0;
+    for (size_t i = firstIndex; i < std::min(spanEnd, controlPoints.size()); i++) {
+        double basis = getBaselineBasis(curve.knots, i, curve.order, t) * controlPoints[i].weight;
+        numerator += basis * glm::dvec3(controlPoints[i].point);
+        denominator += basis;
+    }
+    return numerator / denominator;
+}
+}
+
+TEST(NurbsCurveTests, ClampedCurveInterpolatesEnds)
+{
+    for (size_t order = 2; order <= 6; order++) {
+        auto data = buildRandomCurve(order, 12, static_cast<uint32_t>(order + 80));
+        auto curve = data.build();
+        glm::vec3 start = data.controlPoints.front().point;
+        glm::vec3 end = data.controlPoints.back().point;
+        for (int k = 0; k < 3; k++) {
+            EXPECT_FLOAT_EQ(start[k], curve[curve.getStart()][k]) << "order " << order;
+            EXPECT_FLOAT_EQ(end[k], curve[curve.getEnd()][k]) << "order " << order;
+            EXPECT_FLOAT_EQ(end[k], curve.getDerivatives(curve.getEnd()).point[k])
+                << "order " << order;
+        }
+    }
+}
+
+TEST(NurbsCurveTests, MultipleKnotsMatchBaselineEvaluation)
+{
+    std::mt19937 generator(90);
+    std::uniform_real_distribution<float> offset(-10.0f, 10.0f);
+    std::uniform_real_distribution<float> weight(0.5f, 2.0f);
+    for (size_t order = 3; order <= 5; order++) {
+        // Interior knots of every multiplicity up to the one that passes through a control point.
+        CurveData data{ order, std::vector<float>(order, 0.0f), {} };
+        std::vector<float> multipleKnots;
+        for (size_t multiplicity = 1; multiplicity < order; multiplicity++) {
+            float knot = static_cast<float>(multiplicity) / static_cast<float>(order);
+            data.knots.insert(data.knots.end(), multiplicity, knot);
+            if (multiplicity > 1) {
+                multipleKnots.push_back(knot);
+            }
+        }
+        data.knots.resize(data.knots.size() + order, 1.0f);
+        for (size_t i = 0; i + order < data.knots.size(); i++) {
+            glm::vec3 point(offset(generator), offset(generator), offset(generator));
+            data.controlPoints.push_back({ point, weight(generator) });
+        }
+        auto curve = data.build();
+
+        for (double t = 0.0037; t < 1.0; t += 0.01) {
+            glm::dvec3 expected = getBaselinePoint(data, t);
+            for (int k = 0; k < 3; k++) {
+                EXPECT_NEAR(expected[k], curve[static_cast<float>(t)][k], 1e-4)
+                    << "order " << order << ", t " << t;
+            }
+        }
+
+        for (float knot : multipleKnots) {
+            // The baseline divided zero by zero on the knot itself. The curve now takes the value
+            // it approaches from the span before the knot.
+            EXPECT_TRUE(std::isnan(getBaselinePoint(data, knot).x));
+            glm::dvec3 before = getBaselinePoint(data, knot - 1e-6);
+            for (int k = 0; k < 3; k++) {
+                EXPECT_NEAR(before[k], curve[knot][k], 1e-3) << "order " << order;
+            }
+        }
+
+        // A knot repeated one less time than the order passes through the control point before it.
+        auto knotRun
+            = std::lower_bound(data.knots.begin(), data.knots.end(), multipleKnots.back());
+        auto controlPointIndex = std::distance(data.knots.begin(), knotRun) - 1;
+        glm::vec3 controlPoint = data.controlPoints[controlPointIndex].point;
+        for (int k = 0; k < 3; k++) {
+            EXPECT_NEAR(controlPoint[k], curve[multipleKnots.back()][k], 1e-5f)
+                << "order " << order;
+        }
+    }
+}
+
+TEST(NurbsCurveTests, EvaluationMatchesReferenceBasis)
+{
+    for (size_t order = 2; order <= 6; order++) {
+        auto data = buildRandomCurve(order, 12, static_cast<uint32_t>(order));
+        auto curve = data.build();
+        const auto& controlPoints = data.controlPoints;
+
+        for (float t = 0.0013f; t < 1.0f; t += 0.01f) {
+            glm::dvec3 numerator(0.0);
+            double denominator = 0.0;
+            for (size_t i = 0; i < controlPoints.size(); i++) {
+                double basis
+                    = getReferenceBasis(data.knots, i, order, t) * controlPoints[i].weight;
+                numerator += basis * glm::dvec3(controlPoints[i].point);
+                denominator += basis;
+            }
+            glm::vec3 expected(numerator / denominator);
+            glm::vec3 point = curve[t];
+            for (int k = 0; k < 3; k++) {
+                EXPECT_NEAR(expected[k], point[k], 1e-4f) << "order " << order << ", t " << t;
+            }
+        }
+        EXPECT_EQ(controlPoints.front().point, curve[0.0f]);
+        EXPECT_EQ(controlPoints.back().point, curve[2.0f]);
+    }
+}
+
+// Not a correctness test: reports the cost of evaluating points on curves of common orders. It is
+// disabled, so it only runs and prints when asked for with --gtest_also_run_disabled_tests.
+TEST(NurbsCurveTests, DISABLED_BenchmarkEvaluation)
+{
+    constexpr size_t kPointCount = 200000;
+    for (size_t order = 3; order <= 6; order++) {
+        auto curve = buildRandomCurve(order, 64, 10).build();
+
+        using Clock = std::chrono::steady_clock;
+        auto start = Clock::now();
+        glm::vec3 sum(0.0f);
+        for (size_t i = 0; i < kPointCount; i++) {
+            sum += curve[static_cast<float>(i) / static_cast<float>(kPointCount)];
+        }
+        auto elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start);
+
+        std::cout << "Order " << order << ": " << elapsed.count() / kPointCount << " ns per point"
+                  << std::endl;
+        EXPECT_TRUE(std::isfinite(sum.x + sum.y + sum.z));
+    }
+}
+
+TEST(NurbsCurveTests, SampleMatchesEvaluation)
+{
+    for (size_t order = 2; order <= 6; order++) {
+        auto curve = buildRandomCurve(order, 20, static_cast<uint32_t>(order + 20)).build();
+
+        // Runs of increasing positions, with jumps back, repeats, knots and points off the curve.
+        std::vector<float> positions{ -0.5f, 0.0f, 0.0f, 0.25f, 1.0f, 1.5f, 0.5f, 0.5f };
+        for (float t = -0.1f; t < 1.1f; t += 0.0037f) {
+            positions.push_back(t);
+        }
+        for (float t = 0.9f; t > 0.1f; t -= 0.013f) {
+            positions.push_back(t);
+        }
+
+        std::vector<glm::vec3> points(positions.size());
+        curve.sample(positions, points);
+        for (size_t i = 0; i < positions.size(); i++) {
+            glm::vec3 expected = curve[positions[i]];
+            for (int k = 0; k < 3; k++) {
+                ASSERT_FLOAT_EQ(expected[k], points[i][k])
+                    << "order " << order << ", t " << positions[i];
+            }
+        }
+
+        for (size_t count : { 1, 2, 7, 100 }) {
+            std::vector<glm::vec3> uniformPoints(count);
+            curve.sampleUniform(0.0f, 1.0f, count, uniformPoints);
+            for (size_t i = 0; i < count; i++) {
+                float t
+                    = (count > 1) ? static_cast<float>(i) / static_cast<float>(count - 1) : 0.0f;
+                glm::vec3 expected = curve[t];
+                for (int k = 0; k < 3; k++) {
+                    ASSERT_NEAR(expected[k], uniformPoints[i][k], 1e-4f)
+                        << "order " << order << ", t " << t;
+                }
+            }
+            EXPECT_EQ(curve[(count > 1) ? 1.0f : 0.0f], uniformPoints.back());
+        }
+    }
+}
+
+// Not a correctness test: reports how much sampling many points at once saves over evaluating them
+// one at a time, as when building a long track. Disabled like the evaluation benchmark.
+TEST(NurbsCurveTests, DISABLED_BenchmarkSampleUniform)
+{
+    constexpr size_t kPointCount = 100000;
+    auto curve = buildRandomCurve(4, 64, 11).build();
+    std::vector<glm::vec3> points(kPointCount);
+
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    for (size_t i = 0; i < kPointCount; i++) {
+        points[i] = curve[static_cast<float>(i) / static_cast<float>(kPointCount - 1)];
+    }
+    auto evaluationTime = Clock::now() - start;
+
+    start = Clock::now();
+    curve.sampleUniform(0.0f, 1.0f, kPointCount, points);
+    auto sampleTime = Clock::now() - start;
+
+    auto toMilliseconds = [](Clock::duration duration) {
+        return std::chrono::duration<double, std::milli>(duration).count();
+    };
+    std::cout << "Evaluate: " << toMilliseconds(evaluationTime)
+              << " ms, sampleUniform: " << toMilliseconds(sampleTime) << " ms" << std::endl;
+    EXPECT_TRUE(std::isfinite(points.back().x));
+}
+
+TEST(NurbsCurveTests, DerivativesMatchFiniteDifferences)
+{
+    constexpr double kStep = 1e-5;
+    for (size_t order = 2; order <= 6; order++) {
+        auto curve = buildRandomCurve(order, 12, static_cast<uint32_t>(order + 30)).buildDouble();
+
+        // Keeps the differences within a single span, where the curve is smooth.
+        for (double t = 0.013; t < 1.0; t += 0.021) {
+            auto derivatives = curve.getDerivatives(t);
+            glm::dvec3 before = curve[t - kStep];
+            glm::dvec3 after = curve[t + kStep];
+            glm::dvec3 firstDerivative = (after - before) / (2.0 * kStep);
+            glm::dvec3 secondDerivative
+                = (after - (2.0 * derivatives.point) + before) / (kStep * kStep);
+            double firstScale = glm::length(firstDerivative);
+            double secondScale = std::max(glm::length(secondDerivative), firstScale);
+            for (int k = 0; k < 3; k++) {
+                EXPECT_DOUBLE_EQ(curve[t][k], derivatives.point[k]);
+                EXPECT_NEAR(firstDerivative[k], derivatives.firstDerivative[k], 1e-6 * firstScale)
+                    << "order " << order << ", t " << t;
+                EXPECT_NEAR(
+                    secondDerivative[k], derivatives.secondDerivative[k], 1e-4 * secondScale)
+                    << "order " << order << ", t " << t;
+            }
+        }
+
+        auto start = curve.getDerivatives(0.0);
+        auto justAfterStart = curve.getDerivatives(1e-9);
+        for (int k = 0; k < 3; k++) {
+            EXPECT_NEAR(justAfterStart.firstDerivative[k], start.firstDerivative[k],
+                1e-5 * glm::length(start.firstDerivative));
+        }
+        EXPECT_EQ(glm::dvec3(0.0), curve.getDerivatives(-1.0).firstDerivative);
+        EXPECT_EQ(glm::dvec3(0.0), curve.getDerivatives(2.0).firstDerivative);
+    }
+}
+
+TEST(NurbsCurveTests, BatchedDerivativesMatchEvaluation)
+{
+    for (size_t order = 2; order <= 6; order++) {
+        auto curve = buildRandomCurve(order, 20, static_cast<uint32_t>(order + 40)).build();
+
+        // Runs of increasing positions, with jumps back, repeats, knots and points off the curve.
+        std::vector<float> positions{ -0.5f, 0.0f, 0.0f, 0.25f, 1.0f, 1.5f, 0.5f, 0.5f };
+        for (float t = -0.1f; t < 1.1f; t += 0.0037f) {
+            positions.push_back(t);
+        }
+        for (float t = 0.9f; t > 0.1f; t -= 0.013f) {
+            positions.push_back(t);
+        }
+
+        std::vector<CurveDerivatives<glm::vec3>> derivatives(positions.size());
+        curve.getDerivatives(positions, derivatives);
+        for (size_t i = 0; i < positions.size(); i++) {
+            auto expected = curve.getDerivatives(positions[i]);
+            ASSERT_EQ(expected.point, derivatives[i].point)
+                << "order " << order << ", t " << positions[i];
+            ASSERT_EQ(expected.firstDerivative, derivatives[i].firstDerivative)
+                << "order " << order << ", t " << positions[i];
+            ASSERT_EQ(expected.secondDerivative, derivatives[i].secondDerivative)
+                << "order " << order << ", t " << positions[i];
+        }
+    }
+}
+
+TEST(NurbsCurveTests, CircleCurvature)
+{
+    // A quarter of a unit circle.
+    float halfRoot2 = sqrt(2.0f) / 2.0f;
+    WeightedControlPoint<glm::vec2> controlPoints[] = {
+        { { 1.0, 0.0 }, 1.0 },
+        { { 1.0, 1.0 }, halfRoot2 },
+        { { 0.0, 1.0 }, 1.0 },
+    };
+    float knots[] = { 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f };
+    NurbsCurve<glm::vec2> curve(3, knots, controlPoints);
+
+    for (float t = 0.0f; t <= 1.0f; t += 0.05f) {
+        auto derivatives = curve.getDerivatives(t);
+        EXPECT_NEAR(1.0f, derivatives.getCurvature(), 1e-4f) << "t " << t;
+        // A circle's tangent is square to its radius.
+        EXPECT_NEAR(0.0f, glm::dot(derivatives.point, derivatives.firstDerivative), 1e-5f)
+            << "t " << t;
+    }
+}
+
+TEST(NurbsCurveTests, ArcLengthOfCircle)
+{
+    // A quarter of a unit circle, whose parameter doesn't move evenly around it.
+    float halfRoot2 = sqrt(2.0f) / 2.0f;
+    WeightedControlPoint<glm::vec2> controlPoints[] = {
+        { { 1.0, 0.0 }, 1.0 },
+        { { 1.0, 1.0 }, halfRoot2 },
+        { { 0.0, 1.0 }, 1.0 },
+    };
+    float knots[] = { 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f };
+    NurbsCurve<glm::vec2> curve(3, knots, controlPoints);
+    ArcLengthTable<glm::vec2> table(curve);
+
+    constexpr float halfPi = 3.141592653589793846f / 2.0f;
+    EXPECT_NEAR(halfPi, table.getLength(), 1e-5f);
+    for (float distance = 0.0f; distance <= halfPi; distance += 0.01f) {
+        glm::vec2 point = curve[table.parameterAtDistance(distance)];
+        // On a unit circle, the distance travelled is the angle turned.
+        EXPECT_NEAR(distance, std::atan2(point.y, point.x), 1e-5f);
+    }
+    EXPECT_EQ(0.0f, table.parameterAtDistance(-1.0f));
+    EXPECT_EQ(1.0f, table.parameterAtDistance(10.0f));
+}
+
+TEST(NurbsCurveTests, ArcLengthMatchesPolyline)
+{
+    for (size_t order = 2; order <= 6; order++) {
+        auto curve = buildRandomCurve(order, 16, static_cast<uint32_t>(order + 40)).buildDouble();
+        ArcLengthTable<glm::dvec3> table(curve);
+
+        constexpr size_t kPolylinePointCount = 200000;
+        double polylineLength = 0.0;
+        glm::dvec3 previous = curve[0.0];
+        for (size_t i = 1; i < kPolylinePointCount; i++) {
+            glm::dvec3 point = curve[static_cast<double>(i) / (kPolylinePointCount - 1)];
+            polylineLength += glm::length(point - previous);
+            previous = point;
+        }
+        // The polyline cuts corners, so it comes up slightly short.
+        EXPECT_NEAR(polylineLength, table.getLength(), 1e-5 * polylineLength)
+            << "order " << order;
+
+        for (double distance = 0.0; distance < table.getLength(); distance += 0.37) {
+            double parameter = table.parameterAtDistance(distance);
+            EXPECT_NEAR(distance, table.distanceAtParameter(parameter), 1e-9 * table.getLength())
+                << "order " << order;
+        }
+    }
+}
+
+namespace {
+template <size_t Order>
+void expectFixedOrderMatches()
+{
+    auto data = buildRandomCurve(Order, 20, static_cast<uint32_t>(Order + 50));
+    auto curve = data.build();
+    auto fixedCurve = data.buildFixedOrder<Order>();
+
+    std::vector<glm::vec3> points(500);
+    std::vector<glm::vec3> fixedPoints(points.size());
+    curve.sampleUniform(-0.1f, 1.1f, points.size(), points);
+    fixedCurve.sampleUniform(-0.1f, 1.1f, fixedPoints.size(), fixedPoints);
+    for (size_t i = 0; i < points.size(); i++) {
+        float t = -0.1f + (1.2f * static_cast<float>(i) / static_cast<float>(points.size() - 1));
+        auto derivatives = curve.getDerivatives(t);
+        auto fixedDerivatives = fixedCurve.getDerivatives(t);
+        for (int k = 0; k < 3; k++) {
+            ASSERT_FLOAT_EQ(curve[t][k], fixedCurve[t][k]) << "order " << Order << ", t " << t;
+            ASSERT_FLOAT_EQ(points[i][k], fixedPoints[i][k]) << "order " << Order << ", t " << t;
+            ASSERT_FLOAT_EQ(derivatives.firstDerivative[k], fixedDerivatives.firstDerivative[k])
+                << "order " << Order << ", t " << t;
+            ASSERT_FLOAT_EQ(derivatives.secondDerivative[k], fixedDerivatives.secondDerivative[k])
+                << "order " << Order << ", t " << t;
+        }
+    }
+}
+
+// The time per point to evaluate one at a time, which includes finding each point's knot span,
+// and to sample in order, which mostly leaves the basis functions.
+struct EvaluationTimes {
+    double evaluation;
+    double sampling;
+};
+
+template <typename Curve>
+EvaluationTimes getEvaluationTimes(const Curve& curve, std::vector<glm::vec3>& points)
+{
+    using Clock = std::chrono::steady_clock;
+    auto pointCount = static_cast<double>(points.size());
+    auto start = Clock::now();
+    for (size_t i = 0; i < points.size(); i++) {
+        points[i] = curve[static_cast<float>(i) / static_cast<float>(points.size())];
+    }
+    auto evaluation = std::chrono::duration<double, std::nano>(Clock::now() - start);
+    EXPECT_TRUE(std::isfinite(points.back().x));
+
+    start = Clock::now();
+    curve.sampleUniform(0.0f, 1.0f, points.size(), points);
+    auto sampling = std::chrono::duration<double, std::nano>(Clock::now() - start);
+    EXPECT_TRUE(std::isfinite(points.back().x));
+    return { evaluation.count() / pointCount, sampling.count() / pointCount };
+}
+
+double getMedian(std::vector<double> times)
+{
+    std::nth_element(times.begin(), times.begin() + (times.size() / 2), times.end());
+    return times[times.size() / 2];
+}
+
+// Times the two curves in alternating rounds, taking turns to go first, so that warming up and
+// background load don't favour either. Reports the median of the rounds.
+template <size_t Order>
+void reportFixedOrderSpeedup()
+{
+    constexpr size_t kPointCount = 100000;
+    constexpr size_t kRoundCount = 15;
+    auto data = buildRandomCurve(Order, 64, 12);
+    auto curve = data.build();
+    auto fixedCurve = data.buildFixedOrder<Order>();
+    std::vector<glm::vec3> points(kPointCount);
+
+    getEvaluationTimes(curve, points);
+    getEvaluationTimes(fixedCurve, points);
+    std::vector<double> evaluationTimes;
+    std::vector<double> fixedEvaluationTimes;
+    std::vector<double> samplingTimes;
+    std::vector<double> fixedSamplingTimes;
+    for (size_t round = 0; round < kRoundCount; round++) {
+        EvaluationTimes times;
+        EvaluationTimes fixedTimes;
+        if (round % 2) {
+            fixedTimes = getEvaluationTimes(fixedCurve, points);
+            times = getEvaluationTimes(curve, points);
+        } else {
+            times = getEvaluationTimes(curve, points);
+            fixedTimes = getEvaluationTimes(fixedCurve, points);
+        }
+        evaluationTimes.push_back(times.evaluation);
+        fixedEvaluationTimes.push_back(fixedTimes.evaluation);
+        samplingTimes.push_back(times.sampling);
+        fixedSamplingTimes.push_back(fixedTimes.sampling);
+    }
+
+    std::cout << "Order " << Order << ": evaluate " << getMedian(evaluationTimes)
+              << " ns per point, fixed order " << getMedian(fixedEvaluationTimes)
+              << " ns; sample " << getMedian(samplingTimes) << " ns per point, fixed order "
+              << getMedian(fixedSamplingTimes) << " ns" << std::endl;
+}
+}
+
+TEST(NurbsCurveTests, FixedOrderMatchesDynamicOrder)
+{
+    // A fixed order is part of the type, not stored in each curve.
+    static_assert(sizeof(NurbsCurve<glm::vec3, 4>) < sizeof(NurbsCurve<glm::vec3>));
+    static_assert(NurbsCurve<glm::vec3, 4>::getOrder() == 4);
+
+    expectFixedOrderMatches<2>();
+    expectFixedOrderMatches<3>();
+    expectFixedOrderMatches<4>();
+    expectFixedOrderMatches<6>();
+}
+
+// Not a correctness test: reports how much fixing the order at compile time saves. Disabled like
+// the evaluation benchmark.
+TEST(NurbsCurveTests, DISABLED_BenchmarkFixedOrder)
+{
+    reportFixedOrderSpeedup<3>();
+    reportFixedOrderSpeedup<4>();
+}
+
+TEST(NurbsCurveTests, ClosestParameterFindsNearestPoint)
+{
+    for (size_t order = 2; order <= 5; order++) {
+        auto curve = buildRandomCurve(order, 16, static_cast<uint32_t>(order + 60)).buildDouble();
+
+        constexpr size_t kSampleCount = 20000;
+        std::vector<glm::dvec3> samples(kSampleCount);
+        curve.sampleUniform(0.0, 1.0, kSampleCount, samples);
+
+        std::mt19937 generator(static_cast<uint32_t>(order));
+        std::uniform_real_distribution<double> position(-12.0, 12.0);
+        for (size_t i = 0; i < 50; i++) {
+            glm::dvec3 point(position(generator), position(generator) * 0.2, position(generator));
+            double closestDistance = std::numeric_limits<double>::infinity();
+            for (const auto& sample : samples) {
+                closestDistance = std::min(closestDistance, glm::length(sample - point));
+            }
+
+            double distance = glm::length(curve[curve.closestParameter(point)] - point);
+            // Nothing the dense samples found is closer, up to the spacing between them.
+            EXPECT_LE(distance, closestDistance + 1e-9) << "order " << order;
+            EXPECT_GE(distance, closestDistance - 1e-3) << "order " << order;
+        }
+    }
+}
+
+TEST(NurbsCurveTests, ClosestParameterFollowsHint)
+{
+    auto data = buildRandomCurve(4, 32, 70);
+    auto curve = data.build();
+
+    // A racer running alongside the curve, found each tick from where it was the last.
+    float parameter = 0.0f;
+    for (float t = 0.0f; t <= 1.0f; t += 0.001f) {
+        auto derivatives = curve.getDerivatives(t);
+        glm::vec3 side
+            = glm::normalize(glm::cross(derivatives.firstDerivative, glm::vec3(0.0f, 1.0f, 0.0f)));
+        glm::vec3 racer = derivatives.point + (side * 0.5f);
+        parameter = curve.closestParameter(racer, parameter);
+        ASSERT_NEAR(t, parameter, 1e-4f);
+    }
+}
+
+namespace {
+constexpr size_t kRacerCount = 64;
+constexpr float kTickDistance = 0.0004f;
+
+float getRacerParameter(size_t racer, size_t tick)
+{
+    return (static_cast<float>(racer) / static_cast<float>(kRacerCount * 2))
+        + (kTickDistance * static_cast<float>(tick));
+}
+
+// Moves a field of racers alongside the curve for the given number of ticks, finding each one on
+// the curve every tick from where it was the last. Returns the time spent finding them.
+template <typename Curve>
+std::chrono::steady_clock::duration trackRacers(
+    const Curve& curve, size_t tickCount, std::vector<float>& parameters)
+{
+    parameters.resize(kRacerCount);
+    for (size_t i = 0; i < kRacerCount; i++) {
+        parameters[i] = getRacerParameter(i, 0);
+    }
+
+    using Clock = std::chrono::steady_clock;
+    Clock::duration elapsed{};
+    std::vector<glm::vec3> racers(kRacerCount);
+    for (size_t tick = 1; tick <= tickCount; tick++) {
+        for (size_t i = 0; i < kRacerCount; i++) {
+            racers[i] = curve[getRacerParameter(i, tick)] + glm::vec3(0.1f, 0.05f, -0.1f);
+        }
+
+        auto start = Clock::now();
+        for (size_t i = 0; i < kRacerCount; i++) {
+            parameters[i] = curve.closestParameter(racers[i], parameters[i]);
+        }
+        elapsed += Clock::now() - start;
+    }
+    return elapsed;
+}
+}
+
+TEST(NurbsCurveTests, ClosestParameterTracksRacers)
+{
+    constexpr size_t kTickCount = 1000;
+    auto curve = buildRandomCurve(4, 64, 71).build();
+    std::vector<float> parameters;
+    trackRacers(curve, kTickCount, parameters);
+    for (size_t i = 0; i < kRacerCount; i++) {
+        EXPECT_NEAR(getRacerParameter(i, kTickCount), parameters[i], 0.01f);
+    }
+}
+
+// Not a correctness test: reports the cost of tracking a field of racers for one tick. Disabled
+// like the evaluation benchmark.
+TEST(NurbsCurveTests, DISABLED_BenchmarkClosestParameter)
+{
+    constexpr size_t kTickCount = 1000;
+    auto curve = buildRandomCurve(4, 64, 71).build();
+    std::vector<float> parameters;
+    auto elapsed = trackRacers(curve, kTickCount, parameters);
+    std::cout << "Tracking " << kRacerCount << " racers: "
+              << std::chrono::duration<double, std::micro>(elapsed).count() / kTickCount
+              << " us per tick" << std::endl;
+}
+
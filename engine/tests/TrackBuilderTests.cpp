@@ -0,0 +1,142 @@
+#include "rev/track/TrackBuilder.h"
+
+#include <algorithm>
+#include <cmath>
+#include <gtest/gtest.h>
+#include <vector>
+
+using namespace rev;
+
+namespace {
+class RecordingTrackElement : public ITrackElement {
+public:
+    void stamp(const glm::mat4& orientation) override
+    {
+        positions.push_back(glm::vec3(orientation[3]));
+        forwards.push_back(glm::vec3(orientation[2]));
+    }
+
+    void finish() override { isFinished = true; }
+
+    // The largest angle the track turns between one stamp and the next.
+    float getMaxTurnAngle() const
+    {
+        float maxTurnAngle = 0.0f;
+        for (size_t i = 1; i < forwards.size(); i++) {
+            float cosine = std::clamp(glm::dot(forwards[i - 1], forwards[i]), -1.0f, 1.0f);
+            maxTurnAngle = std::max(maxTurnAngle, std::acos(cosine));
+        }
+        return maxTurnAngle;
+    }
+
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> forwards;
+    bool isFinished = false;
+};
+
+// A long straight that ends in a tight hairpin.
+NurbsCurve<glm::vec3> buildHairpinCurve()
+{
+    WeightedControlPoint<glm::vec3> controlPoints[] = {
+        { { 0.0f, 0.0f, 0.0f }, 1.0f },
+        { { 0.0f, 0.0f, 100.0f }, 1.0f },
+        { { 0.0f, 0.0f, 200.0f }, 1.0f },
+        { { 0.0f, 0.0f, 210.0f }, 1.0f },
+        { { 10.0f, 0.0f, 210.0f }, 1.0f },
+        { { 10.0f, 0.0f, 200.0f }, 1.0f },
+    };
+    float knots[] = { 0.0f, 0.0f, 0.0f, 0.3f, 0.6f, 0.8f, 1.0f, 1.0f, 1.0f };
+    return { 3, knots, controlPoints };
+}
+
+// Two straights meeting at a right-angled corner, where a doubled knot leaves the curve with no
+// tangent to follow.
+NurbsCurve<glm::vec3> buildCornerCurve()
+{
+    WeightedControlPoint<glm::vec3> controlPoints[] = {
+        { { 0.0f, 0.0f, 0.0f }, 1.0f },
+        { { 0.0f, 0.0f, 5.0f }, 1.0f },
+        { { 0.0f, 0.0f, 10.0f }, 1.0f },
+        { { 5.0f, 0.0f, 10.0f }, 1.0f },
+        { { 10.0f, 0.0f, 10.0f }, 1.0f },
+    };
+    float knots[] = { 0.0f, 0.0f, 0.0f, 0.5f, 0.5f, 1.0f, 1.0f, 1.0f };
+    return { 3, knots, controlPoints };
+}
+}
+
+TEST(TrackBuilderTests, UniformSegmentsSpanTheCurve)
+{
+    auto curve = buildHairpinCurve();
+    RecordingTrackElement element;
+    buildTrack({ curve, 3.0f, 50 }, element);
+
+    ASSERT_EQ(51u, element.positions.size());
+    EXPECT_EQ(curve[curve.getStart()], element.positions.front());
+    EXPECT_EQ(curve[curve.getEnd()], element.positions.back());
+    EXPECT_TRUE(element.isFinished);
+
+    // Every segment is the same length, so its chord is too, give or take the bend.
+    float firstChord = glm::length(element.positions[1] - element.positions[0]);
+    for (size_t i = 1; i < element.positions.size(); i++) {
+        float chord = glm::length(element.positions[i] - element.positions[i - 1]);
+        EXPECT_LE(chord, firstChord * 1.001f);
+        EXPECT_GE(chord, firstChord * 0.9f);
+    }
+}
+
+TEST(TrackBuilderTests, AdaptiveSegmentsFollowTolerances)
+{
+    auto curve = buildHairpinCurve();
+    TrackTolerances tolerances{ 0.05f, 0.01f };
+    RecordingTrackElement adaptive;
+    buildTrack({ curve, 3.0f, 10, tolerances }, adaptive);
+
+    ASSERT_GE(adaptive.positions.size(), 11u);
+    EXPECT_EQ(curve[curve.getStart()], adaptive.positions.front());
+    EXPECT_EQ(curve[curve.getEnd()], adaptive.positions.back());
+    EXPECT_TRUE(adaptive.isFinished);
+    EXPECT_LE(adaptive.getMaxTurnAngle(), tolerances.maxTurnAngle);
+
+    // The curve strays from each chord most near its middle.
+    for (size_t i = 1; i < adaptive.positions.size(); i++) {
+        glm::vec3 start = adaptive.positions[i - 1];
+        glm::vec3 end = adaptive.positions[i];
+        float middle = curve.closestParameter((start + end) / 2.0f);
+        glm::vec3 chord = glm::normalize(end - start);
+        float error = glm::length(glm::cross(curve[middle] - start, chord));
+        EXPECT_LE(error, tolerances.maxChordError * 1.1f) << "segment " << i;
+    }
+
+    // Spreading the same number of stamps evenly leaves the hairpin too coarse.
+    RecordingTrackElement uniform;
+    buildTrack({ curve, 3.0f, adaptive.positions.size() - 1 }, uniform);
+    EXPECT_GT(uniform.getMaxTurnAngle(), tolerances.maxTurnAngle * 2.0f);
+}
+
+TEST(TrackBuilderTests, AdaptiveSegmentsCrossKinks)
+{
+    auto curve = buildCornerCurve();
+    TrackTolerances tolerances{ 0.05f, 0.01f };
+    RecordingTrackElement element;
+    buildTrack({ curve, 3.0f, 10, tolerances }, element);
+
+    // The corner can't be smoothed, but the stamps still march along the curve to its end. Along
+    // these two straights, the distance travelled is the sum of the coordinates.
+    float previousDistance = -1.0f;
+    for (const auto& position : element.positions) {
+        float distance = position.x + position.z;
+        EXPECT_GT(distance, previousDistance);
+        previousDistance = distance;
+    }
+    glm::vec3 end = curve[curve.getEnd()];
+    EXPECT_EQ(1, std::count(element.positions.begin(), element.positions.end(), end));
+    EXPECT_EQ(end, element.positions.back());
+
+    // Nor is the corner cut into slivers.
+    for (size_t i = 2; i < element.positions.size(); i++) {
+        float chord = glm::length(element.positions[i - 1] - element.positions[i - 2]);
+        EXPECT_GE(chord, tolerances.maxChordError) << "segment " << i - 1;
+    }
+    EXPECT_LT(element.positions.size(), 30u);
+}
@@ -0,0 +1,56 @@
+#include "rev/WorkerPool.h"
+
+#include <gtest/gtest.h>
+#include <numeric>
+#include <stdexcept>
+
+using namespace rev;
+
+namespace {
+size_t sumRecursively(WorkerPool& pool, size_t begin, size_t end)
+{
+    if (end - begin <= 16) {
+        size_t sum = 0;
+        for (size_t i = begin; i < end; i++) {
+            sum += i;
+        }
+        return sum;
+    }
+
+    size_t middle = begin + (end - begin) / 2;
+    size_t leftSum = 0;
+    TaskGroup group(pool);
+    group.run(
+        [&pool, &leftSum, begin, middle]() { leftSum = sumRecursively(pool, begin, middle); });
+    size_t rightSum = sumRecursively(pool, middle, end);
+    group.wait();
+    return leftSum + rightSum;
+}
+} // namespace
+
+TEST(WorkerPoolTests, NestedTaskGroupsFinish)
+{
+    WorkerPool pool(2);
+    EXPECT_EQ(sumRecursively(pool, 0, 10000), 10000u * 9999u / 2u);
+}
+
+TEST(WorkerPoolTests, TaskGroupRethrowsExceptions)
+{
+    WorkerPool pool(2);
+    TaskGroup group(pool);
+    group.run([]() { throw std::runtime_error("Task failed."); });
+    EXPECT_THROW(group.wait(), std::runtime_error);
+}
+
+TEST(WorkerPoolTests, ParallelForCoversEveryIndex)
+{
+    WorkerPool pool(3);
+    std::vector<int> visits(1001, 0);
+    parallelFor(pool, visits.size(), 64, [&visits](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            visits[i]++;
+        }
+    });
+    EXPECT_EQ(std::accumulate(visits.begin(), visits.end(), 0), 1001);
+    EXPECT_EQ(*std::min_element(visits.begin(), visits.end()), 1);
+}
@@ -13,6 +13,8 @@
 #include <rev/SceneView.h>
 #include <rev/WavefrontHelpers.h>
 #include <rev/Window.h>
+#include <rev/geometry/KDTreeFile.h>
+#include <rev/geometry/PresortedKDTreeBuilder.h>
 #include <rev/lights/LightModels.h>
 #include <rev/physics/Gravity.h>
 #include <rev/physics/Particle.h>
@@ -410,7 +412,9 @@ int main(void)
 
     buildTrack(config, trackElement);
 
-    KDTreeBuilder<BlankSurfaceData> treeBuilder;
+    KDTreeBuildOptions treeOptions;
+    treeOptions.workerPool = engine.getWorkerPool();
+    PresortedKDTreeBuilder<BlankSurfaceData> treeBuilder(treeOptions);
     trackElement.getMeshBuilder().addTrianglesToTree(treeBuilder);
 
     auto trackGroup = std::make_shared<SceneObjectGroup<TrackModel>>(
@@ -464,8 +468,10 @@ int main(void)
     auto debugOverlay = debugOverlayGroup->addObject();
     sceneView->addDebugOverlayGroup(debugOverlayGroup);
 
-    auto cameraRayCaster
-        = std::make_shared<CameraRayCaster>(camera, debugOverlay, treeBuilder.build());
+    // The track doesn't change between runs, so its tree is cached in the assets directory, which
+    // like the other assets is found relative to the working directory.
+    auto cameraRayCaster = std::make_shared<CameraRayCaster>(
+        camera, debugOverlay, loadOrBuildKDTree(treeBuilder, "assets/track.kdtree"));
 
     auto environment = engine.createEnvironment();
     environment->addActor(cameraController);